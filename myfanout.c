@@ -0,0 +1,45 @@
+/* 
+ * myfanout.c - A handy program for timing your tiny shell
+ * 
+ * usage: myfanout <depth> <width>
+ * Forks a tree of processes <depth> levels deep, in which every process
+ * above the last level forks <width> children and waits for them.  The
+ * tree has (width^(depth+1) - 1) / (width - 1) processes, all in the
+ * job's process group.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+int main(int argc, char **argv) 
+{
+    int depth, width, level, i;
+    pid_t pid;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: %s <depth> <width>\n", argv[0]);
+	exit(0);
+    }
+    depth = atoi(argv[1]);
+    width = atoi(argv[2]);
+
+    for (level = 0; level < depth; level++) {
+	for (i = 0; i < width; i++) {
+	    if ((pid = fork()) == 0)
+		break;          /* child: fork the next level */
+	    if (pid < 0) {
+		fprintf(stderr, "fork error\n");
+		break;
+	    }
+	}
+	if (i == width || pid < 0)
+	    break;              /* parent: wait for this level */
+    }
+
+    while (wait(NULL) > 0)
+	;
+    exit(0);
+}
@@ -0,0 +1,34 @@
+/* 
+ * mymsint.c - A handy program for timing your tiny shell
+ * 
+ * usage: mymsint <ms>
+ * Sleeps for <ms> milliseconds and sends SIGINT to itself, like myint.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+
+int main(int argc, char **argv) 
+{
+    struct timespec delay;
+    long ms;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <ms>\n", argv[0]);
+	exit(0);
+    }
+    ms = atol(argv[1]);
+
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = ms % 1000 * 1000000;
+    while (nanosleep(&delay, &delay) < 0)
+	;
+
+    if (kill(getpid(), SIGINT) < 0)
+       fprintf(stderr, "kill (int) error");
+
+    exit(0);
+}
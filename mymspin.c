@@ -0,0 +1,36 @@
+/* 
+ * mymspin.c - A handy program for timing your tiny shell
+ * 
+ * usage: mymspin <ms>
+ * Sleeps for <ms> milliseconds, measured from when it starts, even if
+ * it is stopped and continued along the way.
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char **argv) 
+{
+    struct timespec until;
+    long ms;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <ms>\n", argv[0]);
+	exit(0);
+    }
+    ms = atol(argv[1]);
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += ms % 1000 * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+	until.tv_sec++;
+	until.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+	EINTR)
+	;
+    exit(0);
+}
@@ -0,0 +1,12 @@
+/* 
+ * mytrue.c - A handy program for timing your tiny shell
+ * 
+ * usage: mytrue
+ * Exits at once with status 0, so that a job made of it costs no more
+ * than the shell's own work.
+ *
+ */
+int main(void) 
+{
+    return 0;
+}
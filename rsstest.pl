@@ -0,0 +1,99 @@
+#!/usr/bin/perl
+use Getopt::Std;
+use IO::Handle;
+
+#######################################################################
+# rsstest.pl - Check that the shell's memory use does not grow
+#
+# The test feeds a large number of commands to the shell over a pipe
+# and samples the shell's resident set size (VmRSS in /proc/<pid>/status)
+# at regular intervals.  The commands are builtins and unknown commands,
+# so that every one of them goes through parsing, the search path lookup
+# and the job list, but none of them creates a process.  The test fails
+# if the resident set grows by more than the allowed slack between the
+# first and the last sample.
+#
+######################################################################
+
+#
+# usage - print help message and terminate
+#
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] -s <shellprog> [-n <commands>] [-k <slack>]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h            Print this message\n";
+    printf STDERR "  -s <shell>    Shell program to test\n";
+    printf STDERR "  -n <commands> Number of commands to run (default 1000000)\n";
+    printf STDERR "  -k <slack>    Allowed growth in kB (default 256)\n";
+    die "\n" ;
+}
+
+#
+# rss - return the resident set size of process $_[0] in kB
+#
+sub rss
+{
+    my $pid = $_[0];
+    open(STATUS, "/proc/$pid/status")
+        or die "$0: ERROR: Couldn't read /proc/$pid/status\n";
+    while (<STATUS>) {
+        if (/^VmRSS:\s+(\d+)/) {
+            close(STATUS);
+            return $1;
+        }
+    }
+    close(STATUS);
+    die "$0: ERROR: No VmRSS for process $pid\n";
+}
+
+# Parse the command line arguments
+getopts('hs:n:k:');
+if ($opt_h) {
+    usage();
+}
+if (!$opt_s) {
+    usage("Missing required -s argument");
+}
+$shellprog = $opt_s;
+$commands = $opt_n ? $opt_n : 1000000;
+$slack = defined($opt_k) ? $opt_k : 256;
+$interval = int($commands / 10) || 1;
+(-e $shellprog)
+    or  die "$0: ERROR: $shellprog not found\n";
+
+# Start the shell with its output discarded
+open(SAVEOUT, ">&STDOUT");
+open(STDOUT, ">/dev/null");
+$pid = open(SHELL, "|-", $shellprog, "-p")
+    or die "$0: ERROR: Couldn't run $shellprog\n";
+open(STDOUT, ">&SAVEOUT");
+SHELL->autoflush(0);
+
+# Feed it commands, sampling its memory use as we go
+@samples = ();
+for ($i = 1; $i <= $commands; $i++) {
+    if ($i % 4 == 0) {
+        print SHELL "nosuchcommand$i arg1 arg2\n";
+    } elsif ($i % 4 == 1) {
+        print SHELL "hash\n";
+    } else {
+        print SHELL "jobs\n";
+    }
+    if ($i % $interval == 0) {
+        SHELL->flush();
+        # The pipe is small, so the shell is never far behind us.
+        select(undef, undef, undef, 0.05);
+        push(@samples, rss($pid));
+        printf("%9d commands: VmRSS %6d kB\n", $i, $samples[-1]);
+    }
+}
+close(SHELL);
+
+$growth = $samples[-1] - $samples[0];
+if ($growth > $slack) {
+    die "$0: FAIL: VmRSS grew by $growth kB\n";
+}
+printf("PASS: VmRSS grew by %d kB\n", $growth);
+exit;
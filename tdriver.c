@@ -0,0 +1,723 @@
+/*
+ * tdriver.c - A compiled, parallel driver for the tiny shell's traces
+ *
+ * usage: tdriver [-hv] [-j <jobs>] [-w <seconds>] -s <shell>
+ *            [-r <refshell>] [-a <args>] [-A <refargs>] <trace> ...
+ *
+ * Runs <shell> with the extra arguments <args> on each trace, the way
+ * sdriver.pl does, but runs up to <jobs> traces at once.  Each run gets
+ * its own pseudo-terminal, on which the shell is the leader of a new
+ * session, so that runs cannot signal one another's jobs.  Whatever is
+ * left of a session when its trace ends is killed.
+ *
+ * The trace format is that of sdriver.pl, with two additions:
+ *
+ *   SLEEP <n>         <n> may have a fraction, or end in "ms" to give
+ *                     milliseconds.
+ *   WAITFOR <regex>   Waits until the shell prints a line that matches
+ *                     the extended regular expression <regex> and that
+ *                     comes after the line matched by the previous
+ *                     WAITFOR.  Fails the trace if no such line appears
+ *                     within <seconds> (10 by default).
+ *
+ * Like sdriver.pl, tdriver prints a trace's comments and then the
+ * shell's output.  Without -r, it prints the output of each trace in
+ * turn.  With -r, it also runs <refshell> on each trace, with the extra
+ * arguments <refargs> if they are given and <args> if not, compares the
+ * two outputs with process IDs masked, and prints the lines that
+ * differ.  It exits with status 1 if any trace failed or differed.
+ */
+#define _GNU_SOURCE  // for pipe2() and the pseudo-terminal functions
+
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXWAIT      60     // seconds to wait for a shell to exit
+
+/*
+ * A shell running on a pseudo-terminal, with the input that is waiting
+ * to be written to it and the output that it has written so far.
+ */
+struct Session {
+	int master;             // the pseudo-terminal's master side
+	pid_t pid;              // the shell, which leads the session
+	bool reaped;            // Has the shell been waited for?
+	bool closed;            // Has every process closed the terminal?
+	char *in;               // input not yet written
+	size_t inlen, incap;
+	char *out;              // output read so far
+	size_t outlen, outcap;
+	size_t scanned;         // output already searched by WAITFOR
+};
+
+/*
+ * A run of one trace on one shell, in a worker process whose output
+ * goes to a temporary file.
+ */
+struct Run {
+	const char *trace;
+	const char *shell;
+	FILE *out;
+	pid_t worker;
+	int status;
+};
+
+static bool verbose;
+static double waitfor_limit = 10;
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the value of the monotonic clock in seconds.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Prints a usage message and terminates the program.
+ */
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr, "Usage: %s [-hv] [-j <jobs>] [-w <seconds>] "
+	    "-s <shell> [-r <refshell>]\n", prog);
+	fprintf(stderr, "           [-a <args>] [-A <refargs>] <trace> ...\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -h            Print this message\n");
+	fprintf(stderr, "  -v            Be more verbose\n");
+	fprintf(stderr, "  -j <jobs>     Traces to run at once (default 8)\n");
+	fprintf(stderr, "  -w <seconds>  Time limit of each WAITFOR "
+	    "(default 10)\n");
+	fprintf(stderr, "  -s <shell>    Shell program to test\n");
+	fprintf(stderr, "  -r <shell>    Reference shell to compare with\n");
+	fprintf(stderr, "  -a <args>     Shell arguments\n");
+	fprintf(stderr, "  -A <args>     Reference shell arguments (default "
+	    "<args>)\n");
+	exit(1);
+}
+
+/*
+ * Requires:
+ *   "bufp", "lenp" and "capp" describe a buffer allocated with malloc().
+ *
+ * Effects:
+ *   Appends "len" bytes from "data" to the buffer, growing it as needed,
+ *   and keeps it terminated by a NUL that is not counted in "*lenp".
+ */
+static void
+append(char **bufp, size_t *lenp, size_t *capp, const char *data,
+    size_t len)
+{
+
+	if (*lenp + len + 1 > *capp) {
+		*capp = 2 * (*lenp + len + 1);
+		if ((*bufp = realloc(*bufp, *capp)) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(*bufp + *lenp, data, len);
+	*lenp += len;
+	(*bufp)[*lenp] = '\0';
+}
+
+/*
+ * Requires:
+ *   "shell" is the path of a shell and "args", if not NULL, is a string
+ *   of space separated arguments for it.
+ *
+ * Effects:
+ *   Starts the shell as the leader of a new session whose controlling
+ *   terminal is a new pseudo-terminal, with echo, signal characters and
+ *   output processing turned off, and fills in "s".
+ */
+static void
+startsession(struct Session *s, const char *shell, char *args)
+{
+	struct termios t;
+	char *argv[32], *arg, *path, c;
+	int argc = 0, slave, sync[2];
+
+	memset(s, 0, sizeof(*s));
+	if ((s->master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+	    grantpt(s->master) < 0 || unlockpt(s->master) < 0 ||
+	    (path = ptsname(s->master)) == NULL) {
+		perror("posix_openpt");
+		exit(1);
+	}
+
+	// Set the terminal up before the shell can read anything from it.
+	if ((slave = open(path, O_RDWR | O_NOCTTY)) < 0 ||
+	    tcgetattr(slave, &t) < 0) {
+		perror(path);
+		exit(1);
+	}
+	t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL | ISIG);
+	t.c_oflag &= ~OPOST;
+	if (tcsetattr(slave, TCSANOW, &t) < 0 || pipe2(sync, O_CLOEXEC) < 0) {
+		perror("tcsetattr");
+		exit(1);
+	}
+
+	argv[argc++] = (char *)shell;
+	if (args != NULL)
+		for (arg = strtok(args, " "); arg != NULL && argc < 31;
+		    arg = strtok(NULL, " "))
+			argv[argc++] = arg;
+	argv[argc] = NULL;
+	if ((s->pid = fork()) == 0) {
+		close(s->master);
+		close(slave);
+		setsid();
+		// Opening the terminal makes it the session's terminal.
+		if ((slave = open(path, O_RDWR)) < 0) {
+			perror(path);
+			_exit(1);
+		}
+		dup2(slave, STDIN_FILENO);
+		dup2(slave, STDOUT_FILENO);
+		dup2(slave, STDERR_FILENO);
+		if (slave > STDERR_FILENO)
+			close(slave);
+		execvp(shell, argv);
+		perror(shell);
+		_exit(1);
+	}
+	if (s->pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+
+	// Keep the terminal open until the shell has it open, so that the
+	// master does not see it hung up in between.
+	close(sync[1]);
+	while (read(sync[0], &c, 1) < 0 && errno == EINTR)
+		;
+	close(sync[0]);
+	close(slave);
+	fcntl(s->master, F_SETFL, fcntl(s->master, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * Requires:
+ *   "s" is a session started by startsession().
+ *
+ * Effects:
+ *   Waits until the shell writes output or can take more input, or
+ *   until "deadline" if it is not negative, and then reads all of its
+ *   output and writes as much of its input as it will take.  Sets
+ *   "s->closed" once every process has closed the terminal.  Returns
+ *   false if it already had been.
+ */
+static bool
+pump(struct Session *s, double deadline)
+{
+	struct pollfd pfd;
+	char buf[BUFSIZ];
+	ssize_t n;
+	int timeout = -1;
+
+	if (s->closed)
+		return (false);
+	if (deadline >= 0) {
+		timeout = (int)((deadline - now()) * 1000 + 0.999);
+		if (timeout < 0)
+			timeout = 0;
+	}
+	pfd.fd = s->master;
+	pfd.events = POLLIN | (s->inlen > 0 ? POLLOUT : 0);
+	if (poll(&pfd, 1, timeout) < 0) {
+		if (errno == EINTR)
+			return (true);
+		perror("poll");
+		exit(1);
+	}
+	if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+		while ((n = read(s->master, buf, sizeof(buf))) > 0)
+			append(&s->out, &s->outlen, &s->outcap, buf, n);
+		// Linux reports EIO once the last slave is closed.
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+			s->closed = true;
+	}
+	if ((pfd.revents & POLLOUT) && s->inlen > 0 &&
+	    (n = write(s->master, s->in, s->inlen)) > 0) {
+		memmove(s->in, s->in + n, s->inlen - n);
+		s->inlen -= n;
+	}
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "s" is a session started by startsession().
+ *
+ * Effects:
+ *   Writes all of the pending input to the shell, reading its output
+ *   meanwhile, unless every process closes the terminal first.
+ */
+static void
+flush(struct Session *s)
+{
+
+	while (s->inlen > 0 && pump(s, -1))
+		;
+}
+
+/*
+ * Requires:
+ *   "s" is a session started by startsession() and "re" is a compiled
+ *   regular expression.
+ *
+ * Effects:
+ *   Returns true if a line of the shell's output that has not yet been
+ *   searched matches "re", and marks the output up to the end of that
+ *   line as searched.  Otherwise, marks every complete line searched.
+ */
+static bool
+matched(struct Session *s, const regex_t *re)
+{
+	char *line, *nl;
+	size_t len;
+	bool match;
+
+	while (s->scanned < s->outlen) {
+		line = s->out + s->scanned;
+		nl = memchr(line, '\n', s->outlen - s->scanned);
+		len = nl != NULL ? (size_t)(nl - line) : s->outlen - s->scanned;
+		if ((line = strndup(line, len)) == NULL) {
+			perror("strndup");
+			exit(1);
+		}
+		match = regexec(re, line, 0, NULL, 0) == 0;
+		free(line);
+		if (match) {
+			s->scanned += len + (nl != NULL);
+			return (true);
+		}
+		if (nl == NULL)
+			return (false);  // Check the rest of the line later.
+		s->scanned += len + 1;
+	}
+	return (false);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Kills every process that remains in the session led by "sid" and
+ *   reaps those that were this process's children or were handed to it
+ *   as a subreaper.
+ */
+static void
+killsession(pid_t sid)
+{
+	char path[PATH_MAX], stat[512], *end;
+	struct dirent *de;
+	int fd, pid, session;
+	ssize_t n;
+	DIR *dir;
+
+	if ((dir = opendir("/proc")) == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (!isdigit((unsigned char)de->d_name[0]))
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			continue;
+		n = read(fd, stat, sizeof(stat) - 1);
+		close(fd);
+		if (n <= 0)
+			continue;
+		stat[n] = '\0';
+		// The command name may hold spaces and parentheses.
+		if ((end = strrchr(stat, ')')) == NULL ||
+		    sscanf(end + 1, " %*c %*d %*d %d", &session) != 1)
+			continue;
+		pid = atoi(de->d_name);
+		if (session == sid)
+			kill(pid, SIGKILL);
+	}
+	closedir(dir);
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+}
+
+/*
+ * Requires:
+ *   "trace" is the path of a trace file, "shell" is the path of a shell,
+ *   and "args", if not NULL, is a string of space separated arguments.
+ *
+ * Effects:
+ *   Runs the shell on the trace and prints the trace's comments and the
+ *   shell's output to "out".  Returns 0 if the trace ran to completion
+ *   and 1 if it failed.
+ */
+static int
+drive(const char *trace, const char *shell, char *args, FILE *out)
+{
+	struct Session s;
+	regex_t re;
+	double deadline, secs;
+	char *line = NULL, *end;
+	size_t size = 0;
+	ssize_t len;
+	int status = 0;
+	bool found;
+	FILE *fp;
+
+	if ((fp = fopen(trace, "r")) == NULL) {
+		fprintf(out, "tdriver: ERROR: Couldn't open input file %s\n",
+		    trace);
+		return (1);
+	}
+	// Jobs that outlive the shell are handed to us to be reaped.
+	prctl(PR_SET_CHILD_SUBREAPER, 1);
+	startsession(&s, shell, args);
+
+	while ((len = getline(&line, &size, fp)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		// The directives are recognized in the order sdriver.pl
+		// tests for them, after WAITFOR, which contains "WAIT".
+		if (line[0] == '#')
+			fprintf(out, "%s\n", line);
+		else if (strspn(line, " \t") == (size_t)len) {
+			if (verbose)
+				fprintf(out, "tdriver: Ignoring blank line\n");
+		} else if (strncmp(line, "WAITFOR ", 8) == 0) {
+			if (regcomp(&re, line + 8, REG_EXTENDED | REG_NOSUB)
+			    != 0) {
+				fprintf(out, "tdriver: ERROR: Bad regular "
+				    "expression: %s\n", line + 8);
+				status = 1;
+				break;
+			}
+			if (verbose)
+				fprintf(out, "tdriver: Waiting for %s\n",
+				    line + 8);
+			deadline = now() + waitfor_limit;
+			while (!(found = matched(&s, &re)) &&
+			    now() < deadline && pump(&s, deadline))
+				;
+			regfree(&re);
+			if (!found) {
+				fprintf(out, "tdriver: ERROR: Timed out "
+				    "waiting for %s\n", line + 8);
+				status = 1;
+				break;
+			}
+		} else if (strstr(line, "TSTP") != NULL) {
+			flush(&s);
+			if (verbose)
+				fprintf(out, "tdriver: Sending SIGTSTP signal "
+				    "to process %d\n", (int)s.pid);
+			kill(s.pid, SIGTSTP);
+		} else if (strstr(line, "INT") != NULL) {
+			flush(&s);
+			if (verbose)
+				fprintf(out, "tdriver: Sending SIGINT signal "
+				    "to process %d\n", (int)s.pid);
+			kill(s.pid, SIGINT);
+		} else if (strstr(line, "QUIT") != NULL) {
+			flush(&s);
+			if (verbose)
+				fprintf(out, "tdriver: Sending SIGQUIT signal "
+				    "to process %d\n", (int)s.pid);
+			kill(s.pid, SIGQUIT);
+		} else if (strstr(line, "KILL") != NULL) {
+			flush(&s);
+			if (verbose)
+				fprintf(out, "tdriver: Sending SIGKILL signal "
+				    "to process %d\n", (int)s.pid);
+			kill(s.pid, SIGKILL);
+		} else if (strstr(line, "CLOSE") != NULL) {
+			if (verbose)
+				fprintf(out, "tdriver: Closing output end of "
+				    "pipe to child %d\n", (int)s.pid);
+			// End of file is ctrl-d at the start of a line.
+			append(&s.in, &s.inlen, &s.incap, "\004", 1);
+			flush(&s);
+		} else if (strstr(line, "WAIT") != NULL) {
+			if (verbose)
+				fprintf(out, "tdriver: Waiting for child %d\n",
+				    (int)s.pid);
+			while (!s.reaped) {
+				if (waitpid(s.pid, NULL, WNOHANG) == s.pid)
+					s.reaped = true;
+				else if (!pump(&s, now() + 0.01))
+					usleep(10000);
+			}
+		} else if ((end = strstr(line, "SLEEP ")) != NULL) {
+			secs = strtod(end + 6, &end);
+			if (strncmp(end, "ms", 2) == 0)
+				secs /= 1000;
+			if (verbose)
+				fprintf(out, "tdriver: Sleeping %g secs\n",
+				    secs);
+			deadline = now() + secs;
+			while (now() < deadline)
+				if (!pump(&s, deadline))
+					usleep(1000);
+		} else {
+			if (verbose)
+				fprintf(out, "tdriver: Sending :%s: to child "
+				    "%d\n", line, (int)s.pid);
+			append(&s.in, &s.inlen, &s.incap, line, len);
+			append(&s.in, &s.inlen, &s.incap, "\n", 1);
+			pump(&s, 0);
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	// Send end of file and read until every process is done with the
+	// terminal.
+	if (verbose)
+		fprintf(out, "tdriver: Reading data from child %d\n",
+		    (int)s.pid);
+	append(&s.in, &s.inlen, &s.incap, "\004", 1);
+	deadline = now() + MAXWAIT;
+	while (now() < deadline && pump(&s, deadline))
+		;
+	if (!s.closed) {
+		fprintf(out, "tdriver: ERROR: Shell did not exit\n");
+		status = 1;
+	}
+	if (s.outlen > 0)
+		fwrite(s.out, 1, s.outlen, out);
+	killsession(s.pid);
+	if (!s.reaped)
+		waitpid(s.pid, NULL, 0);
+	if (verbose)
+		fprintf(out, "tdriver: Shell terminated\n");
+	close(s.master);
+	free(s.in);
+	free(s.out);
+	return (status);
+}
+
+/*
+ * Requires:
+ *   "fp" is open for reading and writing.
+ *
+ * Effects:
+ *   Returns the contents of "fp", with every parenthesized process ID
+ *   replaced by "(PID)", as a string allocated with malloc().
+ */
+static char *
+masked(FILE *fp)
+{
+	char *buf, *p, *q;
+	long len;
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	if ((buf = malloc(len + 1)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	len = fread(buf, 1, len, fp);
+	buf[len] = '\0';
+	for (p = buf; (p = strchr(p, '(')) != NULL; p++) {
+		for (q = p + 1; isdigit((unsigned char)*q); q++)
+			;
+		if (q > p + 1 && *q == ')') {
+			memmove(p + 5, q + 1, strlen(q + 1) + 1);
+			memcpy(p, "(PID)", 5);
+		}
+	}
+	return (buf);
+}
+
+/*
+ * Requires:
+ *   "ref" and "got" are the masked outputs of a trace.
+ *
+ * Effects:
+ *   Prints the lines at which the two outputs differ, up to a limit.
+ *   Destroys both outputs.
+ */
+static void
+differ(char *ref, char *got)
+{
+	char *rl, *gl, *rsave, *gsave;
+	int line = 0, shown = 0;
+
+	rl = strtok_r(ref, "\n", &rsave);
+	gl = strtok_r(got, "\n", &gsave);
+	while (rl != NULL || gl != NULL) {
+		line++;
+		if ((rl == NULL || gl == NULL || strcmp(rl, gl) != 0) &&
+		    shown++ < 10)
+			printf("  line %d:\n  - %s\n  + %s\n", line,
+			    rl != NULL ? rl : "(end of output)",
+			    gl != NULL ? gl : "(end of output)");
+		if (rl != NULL)
+			rl = strtok_r(NULL, "\n", &rsave);
+		if (gl != NULL)
+			gl = strtok_r(NULL, "\n", &gsave);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct Run *runs;
+	char *shell = NULL, *refshell = NULL, *args = NULL, *refargs = NULL;
+	char *ref, *got;
+	int c, i, nruns, ntraces, next, running, status, failed = 0;
+	int jobs = 8;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "hvj:w:s:r:a:A:")) != -1) {
+		switch (c) {
+		case 'v':
+			verbose = true;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'w':
+			waitfor_limit = strtod(optarg, NULL);
+			break;
+		case 's':
+			shell = optarg;
+			break;
+		case 'r':
+			refshell = optarg;
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		case 'A':
+			refargs = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	ntraces = argc - optind;
+	if (shell == NULL || ntraces < 1 || jobs < 1)
+		usage(argv[0]);
+	if (refargs == NULL)
+		refargs = args;
+	if (access(shell, X_OK) < 0 ||
+	    (refshell != NULL && access(refshell, X_OK) < 0)) {
+		fprintf(stderr, "%s: ERROR: %s is not executable\n", argv[0],
+		    access(shell, X_OK) < 0 ? shell : refshell);
+		exit(1);
+	}
+
+	// Each trace is run on the shell and then, if there is one, on the
+	// reference shell.
+	nruns = ntraces * (refshell != NULL ? 2 : 1);
+	if ((runs = calloc(nruns, sizeof(*runs))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nruns; i++) {
+		runs[i].trace = argv[optind + i % ntraces];
+		runs[i].shell = i < ntraces ? shell : refshell;
+		if ((runs[i].out = tmpfile()) == NULL) {
+			perror("tmpfile");
+			exit(1);
+		}
+	}
+
+	fflush(stdout);
+	next = running = 0;
+	while (next < nruns || running > 0) {
+		while (running < jobs && next < nruns) {
+			if ((runs[next].worker = fork()) == 0) {
+				status = drive(runs[next].trace,
+				    runs[next].shell, next < ntraces ? args :
+				    refargs, runs[next].out);
+				fflush(runs[next].out);
+				_exit(status);
+			}
+			if (runs[next].worker < 0) {
+				perror("fork");
+				exit(1);
+			}
+			running++;
+			next++;
+		}
+		if ((pid = wait(&status)) < 0) {
+			perror("wait");
+			exit(1);
+		}
+		for (i = 0; i < next; i++)
+			if (runs[i].worker == pid) {
+				runs[i].status = status;
+				running--;
+			}
+	}
+
+	for (i = 0; i < ntraces; i++) {
+		if (refshell == NULL) {
+			if (ntraces > 1)
+				printf("%s==> %s <==\n", i > 0 ? "\n" : "",
+				    runs[i].trace);
+			rewind(runs[i].out);
+			while ((c = getc(runs[i].out)) != EOF)
+				putchar(c);
+			if (runs[i].status != 0)
+				failed++;
+			continue;
+		}
+		got = masked(runs[i].out);
+		ref = masked(runs[i + ntraces].out);
+		if (runs[i].status != 0 || runs[i + ntraces].status != 0) {
+			printf("%s: FAIL\n", runs[i].trace);
+			differ(ref, got);
+			failed++;
+		} else if (strcmp(ref, got) != 0) {
+			printf("%s: DIFFERS from %s\n", runs[i].trace,
+			    refshell);
+			differ(ref, got);
+			failed++;
+		} else
+			printf("%s: ok\n", runs[i].trace);
+		free(got);
+		free(ref);
+	}
+	if (refshell != NULL)
+		printf("%d of %d traces match %s\n", ntraces - failed, ntraces,
+		    refshell);
+	return (failed > 0 ? 1 : 0);
+}
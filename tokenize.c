@@ -0,0 +1,481 @@
+/*
+ * tokenize.c - Split a command line into arguments in place
+ *
+ * The line is tokenized in two passes.  The first classifies every byte
+ * of the line at once, using SIMD comparisons where the processor has
+ * them, into two bitmaps: one of the spaces and one of the single quotes.
+ * The second works through the bitmaps a word, that is 64 bytes, at a
+ * time.  A prefix XOR of the quotes marks the bytes within quotes, after
+ * which the arguments begin right after a space or quote and end at a
+ * space or the closing quote, so they are all found with a few shifts
+ * and masks.  That assumes that every quote opens or closes an argument;
+ * a word with a quote in the middle of an argument, or the end of a line
+ * with an unclosed quote, is split one argument at a time instead, by
+ * searching for the next set or clear bit.  Either way, no byte of an
+ * argument is examined individually.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "tokenize.h"
+
+typedef void	classify_fn(const char *s, size_t len, uint64_t *spaces,
+		    uint64_t *quotes);
+
+static classify_fn *classify;      // the chosen classifier
+static const char *classify_isa;   // the name of its instruction set
+
+// Where the splitting stands at the start of a byte
+enum split { BETWEEN, UNQUOTED, QUOTED };
+
+/*
+ * Requires:
+ *   "s" points to "len" bytes and the bitmaps have room for
+ *   (len + 63) / 64 words each.
+ *
+ * Effects:
+ *   Sets bit "i" of "spaces" if s[i] is a space and bit "i" of "quotes"
+ *   if s[i] is a single quote, one byte at a time.  Clears all other
+ *   bits.
+ */
+static void
+classify_scalar(const char *s, size_t len, uint64_t *spaces,
+    uint64_t *quotes)
+{
+	size_t i;
+
+	memset(spaces, 0, (len + 63) / 64 * sizeof(*spaces));
+	memset(quotes, 0, (len + 63) / 64 * sizeof(*quotes));
+	for (i = 0; i < len; i++) {
+		if (s[i] == ' ')
+			spaces[i / 64] |= (uint64_t)1 << (i % 64);
+		else if (s[i] == '\'')
+			quotes[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+}
+
+#if defined(__SSE2__)
+/*
+ * Requires:
+ *   The same as classify_scalar().
+ *
+ * Effects:
+ *   The same as classify_scalar(), comparing 16 bytes at a time.
+ */
+static void
+classify_sse2(const char *s, size_t len, uint64_t *spaces,
+    uint64_t *quotes)
+{
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i quote = _mm_set1_epi8('\'');
+	__m128i v;
+	uint64_t sbits, qbits;
+	char tail[64];
+	const char *p;
+	size_t w;
+	int k;
+
+	for (w = 0; w < (len + 63) / 64; w++) {
+		p = s + w * 64;
+		// Pad the final, partial word with bytes that match nothing.
+		if (len - w * 64 < 64) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, p, len - w * 64);
+			p = tail;
+		}
+		sbits = qbits = 0;
+		for (k = 0; k < 4; k++) {
+			v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+			sbits |= (uint64_t)(unsigned int)_mm_movemask_epi8(
+			    _mm_cmpeq_epi8(v, space)) << (16 * k);
+			qbits |= (uint64_t)(unsigned int)_mm_movemask_epi8(
+			    _mm_cmpeq_epi8(v, quote)) << (16 * k);
+		}
+		spaces[w] = sbits;
+		quotes[w] = qbits;
+	}
+}
+
+/*
+ * Requires:
+ *   The same as classify_scalar(), and the processor supports AVX2.
+ *
+ * Effects:
+ *   The same as classify_scalar(), comparing 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static void
+classify_avx2(const char *s, size_t len, uint64_t *spaces,
+    uint64_t *quotes)
+{
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i quote = _mm256_set1_epi8('\'');
+	__m256i v;
+	uint64_t sbits, qbits;
+	char tail[64];
+	const char *p;
+	size_t w;
+	int k;
+
+	for (w = 0; w < (len + 63) / 64; w++) {
+		p = s + w * 64;
+		// Pad the final, partial word with bytes that match nothing.
+		if (len - w * 64 < 64) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, p, len - w * 64);
+			p = tail;
+		}
+		sbits = qbits = 0;
+		for (k = 0; k < 2; k++) {
+			v = _mm256_loadu_si256((const __m256i *)(p + 32 * k));
+			sbits |= (uint64_t)(unsigned int)_mm256_movemask_epi8(
+			    _mm256_cmpeq_epi8(v, space)) << (32 * k);
+			qbits |= (uint64_t)(unsigned int)_mm256_movemask_epi8(
+			    _mm256_cmpeq_epi8(v, quote)) << (32 * k);
+		}
+		spaces[w] = sbits;
+		quotes[w] = qbits;
+	}
+}
+#endif /* __SSE2__ */
+
+/*
+ * Requires:
+ *   "isa" is NULL or a properly terminated string.
+ *
+ * Effects:
+ *   Makes the tokenizer classify bytes with the named instruction set,
+ *   "avx2", "sse2" or "scalar", or with the best one that the processor
+ *   supports if "isa" is NULL.  Returns 0 if successful and -1 if the
+ *   instruction set is unknown or unsupported.
+ */
+int
+tokenize_use(const char *isa)
+{
+
+#if defined(__SSE2__)
+	if (isa == NULL || strcmp(isa, "avx2") == 0) {
+		if (__builtin_cpu_supports("avx2")) {
+			classify = classify_avx2;
+			classify_isa = "avx2";
+			return (0);
+		}
+		if (isa != NULL)
+			return (-1);
+	}
+	if (isa == NULL || strcmp(isa, "sse2") == 0) {
+		classify = classify_sse2;
+		classify_isa = "sse2";
+		return (0);
+	}
+#endif
+	if (isa == NULL || strcmp(isa, "scalar") == 0) {
+		classify = classify_scalar;
+		classify_isa = "scalar";
+		return (0);
+	}
+	return (-1);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the name of the instruction set that the tokenizer uses.
+ */
+const char *
+tokenize_isa(void)
+{
+
+	if (classify == NULL)
+		tokenize_use(NULL);
+	return (classify_isa);
+}
+
+/*
+ * Requires:
+ *   "bits" is a bitmap of at least "len" bits.
+ *
+ * Effects:
+ *   Returns the index of the first bit at or after "pos" that is set, or
+ *   clear if "clear" is true, or "len" if there is no such bit before
+ *   "len".
+ */
+static inline size_t
+nextbit(const uint64_t *bits, size_t pos, size_t len, bool clear)
+{
+	uint64_t word;
+	size_t w;
+
+	if (pos >= len)
+		return (len);
+	w = pos / 64;
+	word = (clear ? ~bits[w] : bits[w]) & (~(uint64_t)0 << (pos % 64));
+	while (word == 0) {
+		if (++w * 64 >= len)
+			return (len);
+		word = clear ? ~bits[w] : bits[w];
+	}
+	pos = w * 64 + __builtin_ctzll(word);
+	return (pos < len ? pos : len);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns a word in which bit "i" is the XOR of bits 0 through "i" of
+ *   "x".
+ */
+static inline uint64_t
+prefixxor(uint64_t x)
+{
+
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return (x);
+}
+
+/*
+ * Requires:
+ *   "tl" points to a token list.
+ *
+ * Effects:
+ *   Makes room for "n" arguments and a NULL after them, and bitmaps of
+ *   "len" bits.  Returns 0 if successful and -1 if memory is exhausted.
+ */
+static int
+reserve(struct TokenList *tl, int n, size_t len)
+{
+	size_t nwords = len / 64 + 1;
+	void *p;
+	int cap;
+
+	if (n + 1 > tl->cap) {
+		for (cap = tl->cap == 0 ? 64 : tl->cap; cap < n + 1; cap *= 2)
+			continue;
+		if ((p = realloc(tl->argv, cap * sizeof(*tl->argv))) == NULL)
+			return (-1);
+		tl->argv = p;
+		tl->cap = cap;
+	}
+	if (nwords > tl->nwords) {
+		if ((p = realloc(tl->spaces, nwords * sizeof(*tl->spaces))) ==
+		    NULL)
+			return (-1);
+		tl->spaces = p;
+		if ((p = realloc(tl->quotes, nwords * sizeof(*tl->quotes))) ==
+		    NULL)
+			return (-1);
+		tl->quotes = p;
+		if ((p = realloc(tl->nuls, nwords * sizeof(*tl->nuls))) ==
+		    NULL)
+			return (-1);
+		tl->nuls = p;
+		tl->nwords = nwords;
+	}
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "line" points to "len" bytes followed by a NUL, and "tl" points to a
+ *   token list, which is zero-filled before its first use.
+ *
+ * Effects:
+ *   Splits the line into arguments by writing a NUL after each one, and
+ *   fills in "tl->argv" and "tl->argc".  A final argument that begins
+ *   with '&' is removed.  Returns 1 if the line is blank or requests a
+ *   background job, 0 if it requests a foreground job, and -1, leaving
+ *   the line unchanged, if memory is exhausted.
+ */
+int
+tokenize(char *line, size_t len, struct TokenList *tl)
+{
+	const uint64_t *spaces, *quotes;
+	uint64_t *nuls;
+	uint64_t bound, content, ends, in, open, q, sp, starts, unq, valid;
+	size_t base, pos, start, end, w;
+	enum split state;
+	char **argv;
+	int i, n;
+
+	if (classify == NULL)
+		tokenize_use(NULL);
+	tl->argc = 0;
+	tl->line = NULL;
+	tl->newline = len > 0 && line[len - 1] == '\n';
+	if (tl->newline)
+		len--;
+	// Every argument but the last takes at least two bytes.
+	if (reserve(tl, len / 2 + 1, len) < 0)
+		return (-1);
+	tl->line = line;
+	tl->len = len;
+	line[len] = '\0';
+	classify(line, len, tl->spaces, tl->quotes);
+	memset(tl->nuls, 0, (len / 64 + 1) * sizeof(*tl->nuls));
+
+	/*
+	 * Work on local copies, since the compiler must otherwise assume
+	 * that writing a NUL into the line changes the token list.
+	 */
+	spaces = tl->spaces;
+	quotes = tl->quotes;
+	nuls = tl->nuls;
+	argv = tl->argv;
+	n = 0;
+	pos = 0;
+	state = BETWEEN;
+	while (pos < len) {
+		w = pos / 64;
+		base = w * 64;
+
+		/*
+		 * The bytes already split and those past the end of the line
+		 * act as spaces.  "in" marks the quotes that open an argument
+		 * and the bytes within quotes, "bound" the bytes that end an
+		 * argument or come before one, and "unq" the bytes of the
+		 * arguments without quotes.
+		 */
+		valid = len - base >= 64 ? ~(uint64_t)0 :
+		    ((uint64_t)1 << (len - base)) - 1;
+		sp = spaces[w] | ~valid | (((uint64_t)1 << (pos - base)) - 1);
+		q = quotes[w] & ~(((uint64_t)1 << (pos - base)) - 1);
+		in = prefixxor(q) ^ (state == QUOTED ? ~(uint64_t)0 : 0);
+		open = q & in;
+		content = in & ~q;
+		bound = (sp & ~content) | q;
+		unq = ~bound & ~content;
+		starts = (unq | open) & ((bound << 1) | (state == BETWEEN));
+		if (open == (starts & q) &&
+		    ((in >> 63) == 0 || base + 64 < len)) {
+			// A quoted argument begins after its opening quote.
+			for (; starts != 0; starts &= starts - 1) {
+				i = __builtin_ctzll(starts);
+				argv[n++] = line + base + i + (q >> i & 1);
+			}
+			ends = ((q & ~in) | (sp & ~content & ((unq << 1) |
+			    (state == UNQUOTED)))) & valid;
+			nuls[w] |= ends;
+			for (; ends != 0; ends &= ends - 1)
+				line[base + __builtin_ctzll(ends)] = '\0';
+			state = (in >> 63) != 0 ? QUOTED :
+			    (unq >> 63) != 0 ? UNQUOTED : BETWEEN;
+			pos = base + 64;
+			continue;
+		}
+
+		// Otherwise, split the arguments in this word one by one.
+		do {
+			if (state == QUOTED) {
+				// Drop an argument with an unclosed quote.
+				if ((end = nextbit(quotes, pos, len, false)) ==
+				    len) {
+					n--;
+					goto done;
+				}
+			} else if (state == UNQUOTED) {
+				// Quotes within this argument are ordinary.
+				end = nextbit(spaces, pos, len, false);
+			} else {
+				if ((pos = nextbit(spaces, pos, len, true)) ==
+				    len || pos >= base + 64)
+					break;
+				if (line[pos] == '\'') {
+					// Ignore the rest of the line if the
+					// quote is unclosed.
+					start = pos + 1;
+					if ((end = nextbit(quotes, start, len,
+					    false)) == len)
+						goto done;
+				} else {
+					start = pos;
+					end = nextbit(spaces, start, len, false);
+				}
+				argv[n++] = line + start;
+			}
+			if (end < len) {
+				line[end] = '\0';
+				nuls[end / 64] |= (uint64_t)1 << (end % 64);
+			}
+			state = BETWEEN;
+			pos = end + 1;
+		} while (pos < base + 64);
+	}
+done:
+	argv[n] = NULL;
+	tl->argc = n;
+
+	// Ignore blank line.
+	if (tl->argc == 0)
+		return (1);
+
+	// Should the job run in the background?
+	if (*tl->argv[tl->argc - 1] == '&') {
+		tl->argv[--tl->argc] = NULL;
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "tl" points to a token list filled in by tokenize().
+ *
+ * Effects:
+ *   Restores the line that was tokenized to its original contents, by
+ *   turning each NUL that tokenize() wrote back into a space or quote.  The
+ *   arguments in "tl->argv" are then no longer valid.
+ */
+void
+untokenize(struct TokenList *tl)
+{
+	uint64_t bits;
+	size_t w;
+	int i;
+
+	if (tl->line == NULL)
+		return;
+	for (w = 0; w < (tl->len + 63) / 64; w++) {
+		for (bits = tl->nuls[w]; bits != 0; bits &= bits - 1) {
+			i = __builtin_ctzll(bits);
+			tl->line[w * 64 + i] = (tl->quotes[w] >> i & 1) ?
+			    '\'' : ' ';
+		}
+	}
+	if (tl->newline)
+		tl->line[tl->len] = '\n';
+	tl->line = NULL;
+	tl->argc = 0;
+	tl->argv[0] = NULL;
+}
+
+/*
+ * Requires:
+ *   "tl" points to a token list filled in by tokenize(), and "i" is less
+ *   than "tl->argc".
+ *
+ * Effects:
+ *   Returns 1 if argument "i" was written within quotes and 0 otherwise,
+ *   so that the caller can tell an operator such as '|' from a quoted
+ *   argument that looks like one.
+ */
+int
+tokenize_quoted(const struct TokenList *tl, int i)
+{
+
+	// Only an opening quote is left in place before an argument.
+	return (tl->argv[i] > tl->line && tl->argv[i][-1] == '\'');
+}
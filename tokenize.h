@@ -0,0 +1,38 @@
+/*
+ * tokenize.h - Split a command line into arguments in place
+ *
+ * The tokenizer follows the rules of the original parseline(): arguments
+ * are separated by one or more spaces, an argument that begins with a
+ * single quote extends to the next single quote, a trailing newline ends
+ * the last argument, and a final argument that begins with '&' requests
+ * a background job.  Instead of copying the
+ * line, it terminates each argument where it lies, so "argv" points into
+ * the line itself, and untokenize() puts the line back as it was.  There
+ * is no limit on the number or the length of the arguments.
+ */
+#ifndef TOKENIZE_H
+#define TOKENIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct TokenList {
+	char **argv;            // the arguments, followed by NULL
+	int argc;               // number of arguments, without any '&'
+	int cap;                // entries allocated in argv
+	char *line;             // the line, until untokenize() restores it
+	size_t len;             // its length, without any trailing newline
+	int newline;            // Did the line end with a newline?
+	uint64_t *spaces;       // bitmap of the line's spaces
+	uint64_t *quotes;       // bitmap of the line's single quotes
+	uint64_t *nuls;         // bitmap of the NULs written into the line
+	size_t nwords;          // words allocated in each bitmap
+};
+
+int	tokenize(char *line, size_t len, struct TokenList *tl);
+void	untokenize(struct TokenList *tl);
+int	tokenize_quoted(const struct TokenList *tl, int i);
+const char *tokenize_isa(void);
+int	tokenize_use(const char *isa);
+
+#endif /* !TOKENIZE_H */
@@ -7,33 +7,205 @@
  * Alex Bluestein, arb19
  */
 
+#define _GNU_SOURCE  // for CLONE_PARENT and other Linux extensions
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sched.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/mempolicy.h>
+
+#include "tokenize.h"
+
 // You may assume that these constants are large enough.
-#define MAXLINE      1024   // max line size
-#define MAXARGS       128   // max args on a command line
-#define MAXJOBS        16   // max jobs at any point in time
+#define MAXJOBS        16   // initial size of the jobs list
 #define MAXJID   (1 << 16)  // max job ID
 
 #define PATH_MAX 4096 // Defined in linux/limits.h
 
+#define HASHSIZE     1024   // slots in the executable lookup cache (power of 2)
+#define INPUTSIZE   65536   // size of a block read in batch mode
+#define CHUNKSIZE    8192   // minimum size of an arena chunk
+
 // The job states are:
 #define UNDEF 0 // undefined
 #define FG 1    // running in foreground
 #define BG 2    // running in background
 #define ST 3    // stopped
 
+// The states of a node of the dag builtin's graph are:
+#define NODE_WAITING 0 // waiting for its dependencies or for a slot
+#define NODE_RUNNING 1 // running its command
+#define NODE_DONE    2 // finished successfully
+#define NODE_FAILED  3 // finished unsuccessfully
+#define NODE_SKIPPED 4 // not run because a dependency failed
+
+// The ways of launching a job are:
+#define LAUNCH_FORK  0 // fork() followed by execve()
+#define LAUNCH_SPAWN 1 // posix_spawn(), which avoids copying the page tables
+#define LAUNCH_ZYGOTE 2 // requested from a pre-forked helper process
+
+// The policies for placing background jobs on CPUs are:
+#define PLACE_NONE    0 // run on the shell's CPUs
+#define PLACE_SPREAD  1 // one CPU each, spread across the NUMA nodes
+#define PLACE_COMPACT 2 // one CPU each, filling one NUMA node at a time
+#define PLACE_RESERVE 3 // every CPU but one, kept for foreground jobs
+
+#define CPU_NOTFG    -2 // placed on every CPU but the one kept for FG jobs
+
+#define NLIMITS       3 // resources that a job may be limited in
+
+// The phases of evaluating a command and reaping its job, which are timed:
+#define PHASE_PARSE   0 // splitting the line and opening its redirections
+#define PHASE_LOOKUP  1 // finding the executables in the search path
+#define PHASE_LAUNCH  2 // creating the processes of a job
+#define PHASE_ADDJOB  3 // adding the job to the jobs list
+#define PHASE_BUILTIN 4 // running a built-in command
+#define PHASE_EVAL    5 // all of the above, without waiting for the job
+#define PHASE_REAP    6 // reaping a child and applying its change of state
+#define NPHASES       7
+
+#define HISTSUBBITS   3 // each power of two is split into 2^3 buckets
+#define HISTBUCKETS ((64 - HISTSUBBITS + 1) << HISTSUBBITS)
+
+#define TRACESIZE (1 << 20) // initial size of a -T trace file's mapping
+#define CACHESIZE (64 << 20) // default bytes of the output cache
+#define CACHEMAGIC "tshout1"  // first bytes of an output cache entry
+#define TRACESIGQSIZE  32 // signals forwarded that have yet to be traced
+
+// The kinds of redirection are:
+#define REDIR_IN      1 // N<file, N defaulting to 0
+#define REDIR_OUT     2 // N>file, N defaulting to 1
+#define REDIR_APPEND  3 // N>>file
+#define REDIR_DUP     4 // N>&M or N<&M
+#define REDIR_HEREDOC 5 // <<WORD, followed by lines up to one holding WORD
+#define REDIR_HERESTR 6 // <<<word
+
+/*
+ * A redirection gives a stage's descriptor "fd" either a descriptor that
+ * the shell opened for it, which the stage then owns, or a copy of its
+ * own descriptor "src" as it stands at that point of the command.
+ */
+struct Redir {
+	int fd;                 // descriptor to replace, 0 to 2
+	int src;                // descriptor opened for it, or one 0 to 2
+	bool dup;               // Is src one of the stage's descriptors?
+};
+
+/*
+ * A placement restricts a job to some of the CPUs and, optionally, sets
+ * the NUMA policy for its memory.
+ */
+struct Placement {
+	cpu_set_t cpus;         // CPUs that the job may run on
+	int node;               // NUMA node for its memory, or -1
+	int mempolicy;          // MPOL_PREFERRED or MPOL_BIND, if node >= 0
+};
+
+/*
+ * Limits on a job's resources, which are set before it calls execve().
+ * Each entry is for the resource of the same entry of limit_names.
+ */
+struct Limits {
+	rlim_t max[NLIMITS];    // the limit, or RLIM_INFINITY to inherit it
+};
+
+/*
+ * A stage is one command of a pipeline: the program to run and the
+ * descriptors to give it in place of the shell's stdin, stdout and
+ * stderr.
+ */
+struct Stage {
+	const char *executable; // path of the program to run
+	char **argv;            // its NULL terminated arguments
+	int fds[3];             // descriptors for fds 0 to 2, or -1 to inherit
+	struct Redir *redirs;   // redirections still to be applied, in order
+	int nredirs;            // number of redirections
+	const struct Placement *place; // where to run it, or NULL to inherit
+	const struct Limits *limits; // limits to set, or NULL to inherit them
+	const struct CacheKey *cache; // entry to fill with its output, or NULL
+};
+
+/*
+ * A command run with the "cached" prefix is looked up in the output cache
+ * by a key made of its arguments, the identity of its executable, the
+ * current directory, the environment variables and input files that were
+ * named, and the files redirected to its stdin.  Each entry is a file
+ * named by the hash of the key that holds a header, the key, and the
+ * command's stdout and stderr, which are replayed without running it
+ * again, along with its exit status, which parallel and dag go by.  An
+ * entry's modification time is when it was last used, and
+ * the least recently used entries are removed to keep the cache within
+ * its size.
+ */
+struct CacheKey {
+	char *key;              // NUL separated fields
+	size_t len;             // bytes of key
+	char name[17];          // hash of the key in hex, naming its entry
+};
+struct CacheHeader {
+	char magic[8];          // CACHEMAGIC
+	uint32_t keylen;        // bytes of the key that follows
+	int32_t status;         // exit status of the command
+	uint64_t outlen;        // bytes of stdout that follow the key
+	uint64_t errlen;        // bytes of stderr that follow stdout
+};
+struct CacheUse {
+	struct timespec used;   // when the entry was last used
+	off_t size;             // bytes of the entry
+	char name[17];          // name of the entry
+};
+
+/*
+ * A request to the zygote is this header followed by the path of the
+ * program to run and its arguments, each terminated by a NUL.  The
+ * descriptors that replace the new process's stdin, stdout or stderr are
+ * passed along with it, in that order.
+ */
+struct ZygoteRequest {
+	pid_t pgid;             // process group to join, or 0 for a new one
+	int fds;                // bit i is set if fd i is replaced
+	bool placed;            // Is "place" to be applied?
+	struct Placement place; // where to run the process
+	bool limited;           // Are "limits" to be set?
+	struct Limits limits;   // limits on the process's resources
+};
+
 /*
  * The job state transitions and enabling actions are:
  *     FG -> ST  : ctrl-z
@@ -43,29 +215,403 @@
  * At most one job can be in the FG state.
  */
 
+/*
+ * The resources used by one or more processes.
+ */
+struct Usage {
+	long utime;             // user CPU time, in microseconds
+	long stime;             // system CPU time, in microseconds
+	long maxrss;            // largest resident set of any, in kilobytes
+	long nvcsw;             // voluntary context switches
+	long nivcsw;            // involuntary context switches
+};
+
+/*
+ * A job is a pipeline of one or more processes, which all belong to the
+ * process group of the first.  The job is finished once every one of
+ * them has been reaped.
+ */
 struct Job {
-	pid_t pid;              // job PID
+	pid_t pid;              // job PID, which is its process group ID
 	int jid;                // job ID [1, 2, ...]
 	int state;              // UNDEF, FG, BG, or ST
-	char cmdline[MAXLINE];  // command line
+	int procs;              // record of the first process, or EMPTY
+	int live;               // number of processes not yet reaped
+	int cmdline;            // offset of the command line in the pool
+	int cpulist;            // offset of its --cpus list in the pool, or EMPTY
+	int16_t cpu;            // CPU the policy placed it on, CPU_NOTFG, or -1
+	int16_t node;           // NUMA node of its memory, or -1
+	bool timed;             // Is its usage reported when it finishes?
+	struct timespec start;  // when it was added
+	struct timespec since;  // when it last stopped or continued, if traced
+	struct Usage usage;     // resources used by its reaped processes
 };
 typedef volatile struct Job *JobP;
 
+struct Proc {
+	pid_t pid;              // PID, or 0 once the process has been reaped
+	int pidfd;              // pidfd referring to the process, or -1
+	int job;                // record of the job that the process is in
+	int next;               // record of the next process in the pipeline
+};
+typedef volatile struct Proc *ProcP;
+
+/*
+ * The jobs list is a growable array of job records and another of process
+ * records, with two indexes: an open-addressed hash table that maps a PID
+ * to its process record, and an array that maps a job ID to its job
+ * record.  Unused records are kept on stacks and the foreground job is
+ * remembered, so that finding, adding or deleting a job takes constant
+ * time however many jobs there are.
+ *
+ * When run asynchronously, the signal handlers look up and delete jobs,
+ * and sigint_handler() may interrupt addjob().  So a deleted PID's entry
+ * in the hash table is marked DELETED rather than moved, which means that
+ * a lookup never misses a job that is present, and the tables are only
+ * ever reallocated with every signal blocked.
+ */
+#define EMPTY   (-1)    // unused entry in an index
+#define DELETED (-2)    // entry in the PID index of a deleted job
+
+/*
+ * Command lines are kept apart from the job records, in a pool that holds
+ * each distinct command line once, however many jobs share it, along with
+ * the CPU lists of the jobs placed with --cpus.  An entry
+ * is a header followed by the string, padded to the header's alignment,
+ * and is named by its offset in the pool.  Entries are reference counted
+ * and found through hash chains that run through their headers.  The
+ * space of entries that are no longer used is reclaimed by compacting the
+ * pool when it has to grow and at least half of it is unused.
+ */
+struct CmdLine {
+	unsigned int hash;      // FNV-1a hash of the command line
+	int next;               // next entry in the same chain, or EMPTY
+	int refs;               // number of jobs with this string
+	int size;               // size of the entry, including the header
+	char text[];            // the command line
+};
+
+struct CmdPool {
+	char *base;             // the entries
+	int used;               // bytes of entries
+	int cap;                // bytes allocated for entries
+	int unused;             // bytes of entries without references
+	int *chains;            // first entry, or EMPTY, for each hash
+	int chainbits;          // chains has 2^chainbits entries
+	int count;              // number of entries with references
+};
+
+struct JobTable {
+	struct Job *slots;      // job records
+	int nslots;             // number of job records
+	int *freeslots;         // stack of unused job records
+	int nfree;              // number of unused job records
+	struct Proc *procs;     // process records
+	int nprocs;             // number of process records
+	int *freeprocs;         // stack of unused process records
+	int nfreeprocs;         // number of unused process records
+	int *pidindex;          // process record, EMPTY or DELETED for hashes
+	int pidbits;            // pidindex has 2^pidbits entries
+	int pidused;            // entries in pidindex that are not EMPTY
+	int *jidindex;          // record or EMPTY for each job ID
+	int jidcap;             // number of entries in jidindex
+	int maxjid;             // largest job ID in use, or 0
+	int fg;                 // record of the foreground job, or EMPTY
+	int njobs;              // number of jobs
+	struct CmdPool cmdlines; // command lines of the jobs
+};
+typedef volatile struct JobTable *JobTableP;
+
 /*
  * Define the jobs list using the "volatile" qualifier because it is accessed
  * by a signal handler (as well as the main program).
  */
-static volatile struct Job jobs[MAXJOBS];
-static int nextjid = 1;            // next job ID to allocate
+static volatile struct JobTable jobs;
+
+/*
+ * While the parallel builtin runs, its commands are the processes of a
+ * single job, and each one that exits frees a slot for the next.
+ */
+struct BatchCmd {
+	pid_t pid;              // process running the command
+	int out;                // memory file holding its output, or -1
+	int status;             // status returned by waitpid(), once done
+	bool done;              // Has it exited?
+};
+struct Batch {
+	int jid;                // job of the running commands, or 0 if none
+	struct BatchCmd *cmds;  // commands started, in order
+	int ncmds;              // number of commands started
+	int *running;           // commands still running
+	int nrunning;           // number of commands still running
+	int failed;             // commands that did not exit with status 0
+	bool halt;              // Should no more commands be started?
+};
+static struct Batch *batch;        // the running batch, or NULL
+
+/*
+ * A node of the dag builtin's graph is a named command that runs, as a
+ * command of a batch, once the nodes it depends on have all succeeded.
+ */
+struct DagNode {
+	char *name;             // name of the node
+	char **argv;            // its command, or NULL if it has none
+	char **deps;            // names of the nodes it depends on
+	int ndeps;              // number of dependencies
+	int *succs;             // nodes that depend on it
+	int nsuccs;             // number of nodes that depend on it
+	int waiting;            // dependencies that have yet to finish
+	int state;              // NODE_WAITING, NODE_RUNNING, etc.
+	int cmd;                // its command in the batch, once running
+	int gate;               // dependency that finished last, or -1
+	double start;           // seconds from the start that it started
+	double end;             // seconds from the start that it ended
+};
 
 extern char **environ;             // defined by libc
 
 static char prompt[] = "tsh> ";    // command line prompt (DO NOT CHANGE)
 static bool verbose = false;       // If true, print additional output.
+static int launch_mode = LAUNCH_FORK; // How to create a job's process.
+static int zygote_fd = -1;         // socket to the zygote, if one is running
+static pid_t zygote_pid;           // PID of the zygote, if one is running
+static bool report_usage = false;  // Report the usage of every job at its end?
+static bool stdin_redirected = false; // Is a built-in's stdin redirected?
+
+/*
+ * While stats_enabled is true, the time that each phase takes is counted
+ * in a histogram whose buckets grow in proportion to the time, so that
+ * every bucket is within 1/8 of its own size and the histograms have a
+ * fixed size, however many times are counted.
+ */
+struct Histogram {
+	uint64_t counts[HISTBUCKETS]; // times that fell in each bucket
+	uint64_t n;             // number of times counted
+	uint64_t sum;           // their sum, in nanoseconds
+	uint64_t max;           // the largest, in nanoseconds
+};
+static bool stats_enabled = false; // Are the phases being timed?
+static struct Histogram phase_hists[NPHASES];
+static const char *const phase_names[NPHASES] = {
+	[PHASE_PARSE] = "parse",
+	[PHASE_LOOKUP] = "lookup",
+	[PHASE_LAUNCH] = "launch",
+	[PHASE_ADDJOB] = "addjob",
+	[PHASE_BUILTIN] = "builtin",
+	[PHASE_EVAL] = "eval",
+	[PHASE_REAP] = "reap"
+};
+
+/*
+ * With -T, the life of every job is recorded in a file in the Chrome
+ * Trace Event format, which Perfetto and chrome://tracing display as a
+ * timeline.  The shell's own row shows the phases of each command and
+ * each reaping, as timed above, and each job has a row of its own that
+ * shows when it was running or stopped and the signals forwarded to it.
+ *
+ * The file is mapped into memory and events are appended to the mapping,
+ * so that recording one makes no system call; the kernel writes the
+ * pages back on its own.  The signal handlers, which may interrupt an
+ * event being appended, instead queue the signals that they forward
+ * like sigchld_handler() queues children, and they are appended later.
+ */
+struct TraceSignal {
+	int sig;                // signal forwarded
+	pid_t pgid;             // process group of the job it was sent to
+	struct timespec time;   // when it was sent
+};
+
+struct TraceSignalQueue {
+	struct TraceSignal events[TRACESIGQSIZE];
+	atomic_uint head;       // count of signals appended to the trace
+	atomic_uint tail;       // count of signals queued by the handlers
+};
+
+struct TraceSpan {
+	struct timespec start;  // when the phase began
+	uint64_t ns;            // how long it took
+};
+
+static int trace_fd = -1;          // trace file, or -1 if not tracing
+static char *trace_buf;            // the trace file's mapping
+static size_t trace_cap;           // size of the mapping and the file
+static volatile size_t trace_len;  // bytes of events in the mapping
+static unsigned long trace_events; // number of events recorded
+static struct timespec trace_epoch; // time 0 of the trace
+static pid_t shell_pid;            // PID of the shell's row in the trace
+static struct TraceSpan trace_phases[NPHASES]; // phases yet to be traced
+static int trace_pending;          // bit p is set if phase p is in there
+static struct TraceSignalQueue trace_sigs;
+
+/*
+ * Unless the shell is started with -a, SIGCHLD, SIGINT and SIGTSTP are
+ * kept blocked and are instead read from a signalfd by the main loop,
+ * which waits on it and on stdin with epoll.  The signal handlers are
+ * then called synchronously, outside of signal context.
+ */
+static int signal_fd = -1;         // signalfd, or -1 if handlers are async
+static int epoll_fd = -1;          // epoll instance watching signal_fd/stdin
+static bool stdin_polled;          // Is stdin in the epoll set?
+static bool stdin_ready;           // Has epoll reported stdin as readable?
+static bool pidfd_reaping;         // Are exited jobs found through pidfds?
+static sigset_t job_mask;          // signal mask that jobs start with
+
+/*
+ * With --serve, the shell listens on a Unix domain socket and, for each
+ * client that connects, forks a session: a copy of itself that has already
+ * done its startup work.  The session reads command lines from the
+ * connection, writes its output there, and keeps its own jobs list.
+ */
+static bool in_session;            // Is this a session serving one client?
+static bool orphan_jobs;           // Leave a session's jobs running at its end?
+
+/*
+ * sigchld_handler() only reaps children.  It passes their changes of
+ * state to the main program through a single-producer, single-consumer
+ * queue, and the main program applies them to the jobs list, so neither
+ * has to block signals to keep the jobs list consistent.  If the queue is
+ * full, the handler leaves the remaining children unreaped until the main
+ * program has caught up.  When the handlers are run asynchronously, the
+ * handler also signals an eventfd, which waitfg() sleeps on.
+ */
+#define CHLDQSIZE      128   // capacity of the queue (a power of two)
+
+struct ChildEvent {
+	pid_t pid;              // PID of the child
+	int stat_loc;           // status returned by waitpid()
+	struct rusage usage;    // resources that it used, if it exited
+};
+
+struct ChildQueue {
+	struct ChildEvent events[CHLDQSIZE];
+	atomic_uint head;       // count of events applied by the main program
+	atomic_uint tail;       // count of events queued by the handler
+	atomic_bool full;       // Did the handler run out of room?
+};
+
+static struct ChildQueue chld_queue;
+static int chld_event_fd = -1;     // eventfd signaled by sigchld_handler()
+
+/*
+ * The sleep and wait built-in commands run in the shell, so there is no
+ * foreground job for a SIGINT to stop.  sigint_handler() instead sets
+ * this flag, and rings chld_event_fd to wake a waitchange() that may
+ * have missed it.
+ */
+static volatile sig_atomic_t interrupted;
+
+/*
+ * An arena hands out memory by advancing a pointer through a list of
+ * chunks, and releases all of it at once by rewinding that pointer to the
+ * first chunk.  The chunks themselves are kept for reuse, so an arena's
+ * footprint is bounded by its largest ever use.
+ */
+struct Chunk {
+	struct Chunk *next;    // next chunk in the arena, or NULL
+	char *end;             // end of this chunk's data
+	max_align_t data[];    // memory handed out by the arena
+};
+struct Arena {
+	struct Chunk *head;    // first chunk, or NULL if nothing allocated
+	struct Chunk *cur;     // chunk that allocations are made from
+	char *next;            // next free byte in cur
+};
+
+// Memory that lives only until the next command is evaluated.
+static struct Arena cmd_arena;
+// Memory for the arguments of the next command of the parallel builtin.
+static struct Arena batch_arena;
+// Memory that lives as long as the shell, such as the search path.
+static struct Arena path_arena;
+
+// The arguments of the command being evaluated, which point into its line.
+static struct TokenList cmd_tokens;
+
+// The input that commands are read from, or NULL if read with getline().
+static struct Input *cmd_input;
+
+// The arguments of the dag builtin's commands, which point into its graph.
+static struct TokenList dag_tokens;
+
+/*
+ * Background jobs are placed on CPUs according to place_policy, and any
+ * job may be placed by prefixing its command with --cpus or --node.  The
+ * CPUs and NUMA nodes are read when either is first used.
+ */
+static int place_policy = PLACE_NONE;
+static bool topology_read;         // Have the following been filled in?
+static cpu_set_t shell_cpus;       // CPUs that the shell may run on
+static int ncpus;                  // number of CPUs in shell_cpus
+static cpu_set_t online_nodes;     // NUMA nodes, as a set of numbers
+static int16_t cpu_node[CPU_SETSIZE]; // NUMA node of each CPU
+static int cpu_order[CPU_SETSIZE]; // shell_cpus in the policy's order
+static int cpu_jobs[CPU_SETSIZE];  // number of jobs placed on each CPU
+static int reserved_cpu = -1;      // CPU kept for foreground jobs, or -1
+static int shell_mempolicy = MPOL_DEFAULT; // the shell's memory policy
+static unsigned long shell_nodemask; // and its nodes
+
+/*
+ * The resources that a job may be limited in by prefixing its command
+ * with "--limit NAME=VALUE,...".
+ */
+static const struct {
+	const char *name;       // name in the --limit argument
+	int resource;           // resource for setrlimit()
+} limit_names[NLIMITS] = {
+	{ "cpu", RLIMIT_CPU },          // CPU time, in seconds
+	{ "as", RLIMIT_AS },            // address space, in bytes
+	{ "nofile", RLIMIT_NOFILE }     // number of open files
+};
+
+// The longest command line accepted, which is ARG_MAX.
+static size_t max_cmdline;
 
  // An array that contains all of the paths in the PATH variable
 static char **search_path;
 
+/*
+ * The executable lookup cache remembers, for each command name that was
+ * searched for in search_path, either the executable that was found or
+ * that the command was not found.  It is flushed whenever a directory in
+ * the search path changes, as reported by inotify or, if inotify is not
+ * available, by a change in the directory's modification time.  The
+ * inotify events are read whenever the shell waits in epoll, so that a
+ * lookup answered by the cache makes no system calls.
+ */
+struct PathEntry {
+	char *name;            // command name, or NULL if the slot is free
+	char *path;            // resolved executable, or NULL if not found
+	unsigned int hits;     // number of lookups answered by this entry
+};
+static struct PathEntry path_cache[HASHSIZE];
+static int path_cache_count;       // number of used slots in path_cache
+static int path_watch_fd = -1;     // inotify watching search_path, or -1
+static struct timespec *path_mtime; // mtimes of directories not watched
+static int *path_wd;               // inotify watch of each directory, or -1
+static bool path_polled;           // Is path_watch_fd in the epoll set?
+static bool path_stale;            // Have events been read since the check?
+
+static char *cache_dir;            // directory of the output cache, or NULL
+static unsigned long long cache_size = CACHESIZE; // bytes it may hold
+static unsigned int cache_hits;    // commands replayed from the cache
+static unsigned int cache_misses;  // commands run to fill the cache
+
+/*
+ * In batch mode, when commands come from a script or from a pipe rather
+ * than a terminal, the input is read in large blocks, or mapped into
+ * memory in the case of a script, and split into lines in place.
+ */
+struct Input {
+	int fd;                // descriptor being read
+	char *buf;             // input data
+	size_t len;            // number of valid bytes in buf
+	size_t pos;            // offset in buf of the next unread line
+	size_t size;           // allocated size of buf, or 0 if buf is mapped
+	char *last;            // copy of an unterminated or final line
+	char *held;            // byte borrowed to terminate a line, or NULL
+	char heldbyte;         // what that byte was
+};
+
 /*
  * The following array can be used to map a signal number to its name.
  * This mapping is valid for x86(-64)/Linux systems, such as CLEAR.
@@ -109,33 +655,177 @@ static const char *const signame[NSIG] = {
 
 // You must implement the following functions:
 
-static int	builtin_cmd(char **argv);
+static int	builtin_cmd(char **argv, bool standins);
 static void	do_bgfg(char **argv);
-static void	eval(const char *cmdline);
+static void	eval(char *cmdline);
 static void	initpath(const char *pathstr);
-static void	waitfg(pid_t pid);
+static pid_t	launchjob(const struct Stage *stage, pid_t pgid,
+		    const sigset_t *mask);
+static int	launchpipeline(struct Stage *stages, int nstages, pid_t *pids);
+static bool	applyredirs(struct Stage *stage);
+static void	closeredirs(struct Stage *stage);
+static void	closestage(struct Stage *stage);
+static bool	parseredirs(struct Stage *stage);
+static int	readheredoc(const char *delim);
+static int	redirop(const char *arg, int *fdp, const char **targetp);
+static int	runbuiltin(struct Stage *stage, bool standins);
+static void	startzygote(void);
+static void	zygote(int fd);
+static pid_t	zygotejob(const struct Stage *stage, pid_t pgid);
+static void	do_hash(char **argv);
+static void	do_affinity(char **argv);
+static void	do_stats(char **argv);
+static void	do_parallel(char **argv);
+static void	do_dag(char **argv);
+static void	do_echo(char **argv);
+static void	do_printf(char **argv);
+static void	do_kill(char **argv);
+static void	do_sleep(char **argv);
+static void	do_wait(char **argv);
+static void	do_cache(char **argv);
+static const char *escape(const char *s, int *cp, bool echo);
+static bool	printescaped(const char *s, bool echo);
+static int	signum(const char *name);
+static bool	bgrunning(void);
+static int	dagcmp(const void *a, const void *b);
+static void	finishnode(struct DagNode *nodes, int i, bool ok, double now,
+		    int *ready, int *nreadyp);
+static struct DagNode *parsedag(char *spec, size_t len, int *nnodesp);
+static double	secondssince(const struct timespec *start);
+static void	batchexited(pid_t pid, int stat_loc);
+static bool	beginbatch(struct Batch *b, struct Stage *stage, int maxcmds,
+		    int njobs);
+static size_t	bracesize(const char *arg, const char *item);
+static bool	launchbatch(struct Batch *b, const struct Stage *stage,
+		    const char *cmdline);
+static int	printbatch(struct Batch *b, int printed);
+static char	*substbraces(const char *arg, const char *item);
+static char	*joinargs(char **argv);
+static char	*readall(int fd, size_t *lenp);
+static void	evalbatch(struct Input *in, bool emit_prompt);
+static void	waitfg(int jid);
+static void	waitchange(int timeout);
+static void	dispatchsignals(void);
+static void	initevents(void);
+static void	waitevents(int timeout);
 
 static void	sigchld_handler(int signum);
 static void	sigint_handler(int signum);
 static void	sigtstp_handler(int signum);
 
-// We are providing the following functions to you:
+static int	infostatus(const siginfo_t *info);
+static void	notifyjob(pid_t pid, int stat_loc, const struct rusage *usage);
+static void	reappidfd(int pidfd);
+static void	applyqueued(void);
+static void	reapstopped(void);
+static void	signaljob(JobTableP jobs, JobP job, int sig);
 
-static int	parseline(const char *cmdline, char **argv); 
+// We are providing the following functions to you:
 
 static void	sigquit_handler(int signum);
 
-static int	addjob(JobP jobs, pid_t pid, int state, const char *cmdline);
+static int	addjob(JobTableP jobs, const pid_t *pids, int npids, int state,
+		    const char *cmdline);
+static void	addproc(JobTableP jobs, JobP job, pid_t pid);
 static void	clearjob(JobP job);
-static int	deletejob(JobP jobs, pid_t pid); 
-static pid_t	fgpid(JobP jobs);
-static JobP	getjobjid(JobP jobs, int jid); 
-static JobP	getjobpid(JobP jobs, pid_t pid);
-static void	initjobs(JobP jobs);
-static void	listjobs(JobP jobs);
-static int	maxjid(JobP jobs); 
+static void	openpidfd(ProcP proc);
+static int	deletejob(JobTableP jobs, pid_t pid); 
+static void	deleteproc(JobTableP jobs, int h);
+static int	findpid(JobTableP jobs, pid_t pid);
+static pid_t	fgpid(JobTableP jobs);
+static JobP	fgjob(JobTableP jobs);
+static JobP	getjobjid(JobTableP jobs, int jid); 
+static JobP	getjobpid(JobTableP jobs, pid_t pid);
+static void	initjobs(JobTableP jobs);
+static void	listjobs(JobTableP jobs, bool usage);
+static void	setjobstate(JobTableP jobs, JobP job, int state);
+
+static int	interncmd(JobTableP jobs, const char *cmdline);
+static const char *jobcmdline(JobTableP jobs, JobP job);
+static const char *jobcpulist(JobTableP jobs, JobP job);
+static void	rechaincmds(JobTableP jobs);
+static void	releasecmd(JobTableP jobs, int offset);
 static int	pid2jid(pid_t pid); 
 
+static void	mapinput(struct Input *in, const char *filename);
+static char	*nextline(struct Input *in, size_t *lenp);
+static void	readinput(struct Input *in);
+static int	writeall(int fd, const char *buf, size_t len);
+
+static void	*arena_alloc(struct Arena *arena, size_t size);
+static void	arena_reset(struct Arena *arena);
+static char	*arena_strndup(struct Arena *arena, const char *s, size_t len);
+
+static void	applyplacement(const struct Placement *place);
+static int	cpucmp(const void *a, const void *b);
+static void	ordercpus(void);
+static bool	parsecpulist(const char *list, cpu_set_t *set);
+static bool	placejob(const char *cpus, const char *node, bool bg,
+		    struct Placement **placep, int *cpup);
+static void	printcpulist(FILE *f, const cpu_set_t *set);
+static bool	readcpulist(const char *path, cpu_set_t *set);
+static void	readtopology(void);
+static void	restoreplacement(void);
+
+static void	addrusage(struct Usage *u, const struct rusage *ru);
+static void	applylimits(const struct Limits *limits);
+static int	formatusage(char *buf, size_t size, double real,
+		    const struct Usage *u);
+static void	jobusage(JobTableP jobs, JobP job, struct Usage *u);
+static bool	parselimits(const char *spec, struct Limits **limitsp);
+static void	procusage(pid_t pid, struct Usage *u);
+static void	reportbuiltin(const struct timespec *start,
+		    const struct Usage *before);
+static void	reportjob(JobP job);
+static void	shellusage(struct Usage *u);
+
+static int	histbucket(uint64_t ns);
+static uint64_t	histpercentile(const struct Histogram *h, double fraction);
+static void	phasebegin(struct timespec *t);
+static void	phasemark(int phase, struct timespec *t);
+static int	formatduration(char *buf, size_t size, uint64_t ns);
+static void	printstats(void);
+
+static void	quitshell(void);
+static void	tracecat(const char *s, size_t len);
+static void	traceclose(void);
+static void	traceinterval(JobP job);
+static void	tracejob(JobP job);
+static void	traceopen(const char *path);
+static void	tracephases(pid_t pid);
+static void	traceprintf(const char *fmt, ...)
+		    __attribute__((format(printf, 1, 2)));
+static void	tracesignal(int sig, pid_t pgid);
+static void	tracesignals(void);
+static double	tracetime(const struct timespec *t);
+
+static const char *cachedir(bool create);
+static bool	batchcached(struct Batch *b, struct Stage *stage,
+		    const char *vars, const char *files);
+static struct CacheKey *cachekey(const struct Stage *stage, const char *vars,
+		    const char *files, struct Arena *arena);
+static int	cachereplay(const struct Stage *stage,
+		    const struct CacheKey *key);
+static int	cacheusecmp(const void *a, const void *b);
+static void	evictcache(void);
+static void	keystat(FILE *f, const char *what, const char *path, int fd);
+static bool	parsecached(char **argv, int *ip, const char **varsp,
+		    const char **filesp);
+static void	runcached(const struct Stage *stage);
+static int	scancache(struct CacheUse **usesp, unsigned long long *totalp);
+
+static void	endsession(void);
+static void	serve(const char *path);
+
+static void	clearpathcache(void);
+static const char *findexe(const char *name, char *buf);
+static const char *lookupexe(const char *name, char *buf);
+static bool	pathchanged(void);
+static bool	readpathevents(void);
+static int	watchdir(const char *dir);
+static const char *watchname(int i);
+static void	watchpath(void);
+
 static void	app_error(const char *msg);
 static void	unix_error(const char *msg);
 static void	usage(void);
@@ -162,15 +852,29 @@ static size_t	sio_strlen(const char s[]);
  * Effects:
  *   Performs a loop that reads and processes the user input from the
  *   command line, executes the given commands, and prints the output
- *   to stdout.
+ *   to stdout.  With --serve, does so instead for each client of a Unix
+ *   domain socket, in a session forked by serve().
  */
 int
 main(int argc, char **argv) 
 {
+	static const struct option longopts[] = {
+		{ "serve", required_argument, NULL, 'S' },
+		{ "orphan", no_argument, NULL, 'O' },
+		{ NULL, 0, NULL, 0 }
+	};
 	struct sigaction action;
+	sigset_t pipe_mask;
 	int c;
-	char cmdline[MAXLINE];
+	struct Input in = { .fd = STDIN_FILENO };
+	bool async_handlers = false;	// Run the signal handlers as such.
+	char *cmdline = NULL;
+	size_t cmdsize = 0;
+	ssize_t len;
 	char *path = NULL;
+	char *script = NULL;		// Read commands from this file.
+	char *trace = NULL;		// Write a trace to this file.
+	char *socket_path = NULL;	// Serve clients on this socket.
 	bool emit_prompt = true;	// Emit a prompt by default.
 
 	/*
@@ -180,31 +884,72 @@ main(int argc, char **argv)
 	dup2(1, 2);
 
 	// Parse the command line.
-	while ((c = getopt(argc, argv, "hvp")) != -1) {
+	while ((c = getopt_long(argc, argv, "hvpszarf:T:", longopts,
+	    NULL)) != -1) {
 		switch (c) {
 		case 'h':             // Print a help message.
 			usage();
 			break;
 		case 'v':             // Emit additional diagnostic info.
 			verbose = true;
+			stats_enabled = true;
 			break;
 		case 'p':             // Don't print a prompt.
 			// This is handy for automatic testing.
 			emit_prompt = false;
 			break;
+		case 's':             // Launch jobs with posix_spawn().
+			launch_mode = LAUNCH_SPAWN;
+			break;
+		case 'z':             // Launch jobs from a zygote process.
+			launch_mode = LAUNCH_ZYGOTE;
+			break;
+		case 'a':             // Handle signals asynchronously.
+			async_handlers = true;
+			break;
+		case 'r':             // Report the usage of every job.
+			report_usage = true;
+			break;
+		case 'f':             // Read commands from a script.
+			script = optarg;
+			break;
+		case 'T':             // Record a trace of the jobs.
+			trace = optarg;
+			break;
+		case 'S':             // Serve clients on a socket.
+			socket_path = optarg;
+			break;
+		case 'O':             // Leave a client's jobs running.
+			orphan_jobs = true;
+			break;
 		default:
 			usage();
 		}
 	}
+	// Sessions read from their clients and cannot share a trace.
+	if (socket_path != NULL && (script != NULL || trace != NULL))
+		usage();
+
+	/*
+	 * Start the zygote before any handlers are installed, so that it and
+	 * the jobs it creates begin with the default signal dispositions.
+	 * Each session of a server starts its own, whose jobs are its
+	 * children.
+	 */
+	if (launch_mode == LAUNCH_ZYGOTE && socket_path == NULL)
+		startzygote();
 
 	/*
 	 * Install sigint_handler() as the handler for SIGINT (ctrl-c).  SET
 	 * action.sa_mask TO REFLECT THE SYNCHRONIZATION REQUIRED BY YOUR
-	 * IMPLEMENTATION OF sigint_handler().
+	 * IMPLEMENTATION OF sigint_handler().  It and sigtstp_handler() both
+	 * queue the signals they forward for the trace, which has room for
+	 * only one producer at a time, so each blocks the other.
 	 */
 	action.sa_handler = sigint_handler;
 	action.sa_flags = SA_RESTART;
 	sigemptyset(&action.sa_mask);
+	sigaddset(&action.sa_mask, SIGTSTP);
 	if (sigaction(SIGINT, &action, NULL) < 0)
 		unix_error("sigaction error");
 
@@ -216,6 +961,7 @@ main(int argc, char **argv)
 	action.sa_handler = sigtstp_handler;
 	action.sa_flags = SA_RESTART;
 	sigemptyset(&action.sa_mask);
+	sigaddset(&action.sa_mask, SIGINT);
 	if (sigaction(SIGTSTP, &action, NULL) < 0)
 		unix_error("sigaction error");
 
@@ -242,12 +988,48 @@ main(int argc, char **argv)
 	if (sigaction(SIGQUIT, &action, NULL) < 0)
 		unix_error("sigaction error");
 
+	// Accept command lines as long as a program's arguments may be.
+	max_cmdline = sysconf(_SC_ARG_MAX) > 0 ? (size_t)sysconf(_SC_ARG_MAX) :
+	    4096;    // the least that POSIX allows
+
 	// Initialize the search path.
 	path = getenv("PATH");
 	initpath(path);
 
 	// Initialize the jobs list.
-	initjobs(jobs);
+	initjobs(&jobs);
+
+	if (trace != NULL)
+		traceopen(trace);
+
+	// Only a session, serving one client, returns.
+	if (socket_path != NULL)
+		serve(socket_path);
+
+	// Switch to reading signals from a signalfd.
+	sigprocmask(SIG_SETMASK, NULL, &job_mask);
+
+	/*
+	 * A session learns that its client has gone from a failed write
+	 * rather than being killed by SIGPIPE, which its jobs still receive.
+	 */
+	if (in_session) {
+		sigemptyset(&pipe_mask);
+		sigaddset(&pipe_mask, SIGPIPE);
+		sigprocmask(SIG_BLOCK, &pipe_mask, NULL);
+	}
+	if (!async_handlers)
+		initevents();
+	else if ((chld_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		unix_error("eventfd error");
+
+	// Run a script, commands that are not typed at a terminal, or any
+	// commands when signals are read from a signalfd in batch mode.
+	if (script != NULL) {
+		mapinput(&in, script);
+		evalbatch(&in, false);
+	} else if (!isatty(STDIN_FILENO) || signal_fd >= 0)
+		evalbatch(&in, emit_prompt);
 
 	// Execute the shell's read/eval loop.
 	while (true) {
@@ -257,16 +1039,17 @@ main(int argc, char **argv)
 			printf("%s", prompt);
 			fflush(stdout);
 		}
-		if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-			app_error("fgets error");
-		if (feof(stdin)) { // End of file (ctrl-d)
-			fflush(stdout);
-			exit(0);
-		}
+		if ((len = getline(&cmdline, &cmdsize, stdin)) < 0 &&
+		    ferror(stdin))
+			app_error("getline error");
+		if (feof(stdin)) // End of file (ctrl-d)
+			quitshell();
 
 		// Evaluate the command line.
-		eval(cmdline);
-		fflush(stdout);
+		if ((size_t)len > max_cmdline)
+			printf("Command line too long\n");
+		else
+			eval(cmdline);
 		fflush(stdout);
 	}
 
@@ -277,188 +1060,1114 @@ main(int argc, char **argv)
 /* 
  * eval - Evaluate the command line that the user has just typed in.
  * 
- * If the user has requested a built-in command (quit, jobs, bg or fg)
+ * If the user has requested a built-in command (quit, jobs, bg, fg, hash,
+ * affinity, stats, parallel, dag, wait or cache)
  * then execute it immediately.  Otherwise, fork a child process and
  * run the job in the context of the child.  If the job is running in
  * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
+ * each job must have a unique process group ID so that our
  * background children don't receive SIGINT (SIGTSTP) from the kernel
  * when we type ctrl-c (ctrl-z) at the keyboard.  
  *
+ * A job may be a pipeline of commands separated by '|', which, like '&',
+ * must stand alone as an argument.  Its processes share one process
+ * group and are a single job.  Built-in commands cannot be part of a
+ * pipeline.
+ *
+ * Each command may redirect its descriptors 0 to 2 with arguments that
+ * begin with "<", ">", ">>", "N>&M", "<<" for a here-document, whose body
+ * is read from the following lines of input, or "<<<" for a here-string.
+ * The name of the file may be attached or be the next argument.  The
+ * shell opens the files, and the child installs them before execve().
+ *
+ * A job may be placed on CPUs by beginning the line with "--cpus LIST",
+ * on the CPUs and memory of a NUMA node with "--node N", or both.
+ * Otherwise, a background job is placed according to the policy set by
+ * the affinity built-in command.  The prefix "--limit NAME=VALUE,..."
+ * limits the job's CPU time in seconds ("cpu"), its address space in
+ * bytes ("as") or its number of open files ("nofile"), and the prefix
+ * "time" reports the resources that the job used once it finishes.
+ *
+ * The built-in commands echo, printf, true, false, kill and sleep stand
+ * in for the programs of the same names, so that they run without a
+ * fork() and execve().  The prefix "command" runs the program instead,
+ * as does running one of them in the background, in a pipeline, or with
+ * a --cpus, --node or --limit prefix, which only a process can honor.
+ *
+ * The prefix "cached [-e NAME,...] [-i FILE,...]" replays the output of
+ * a command that has been run before in the same way from the output
+ * cache, without running it.  The environment variables and the input
+ * files that the command depends on are named by -e and -i.  A command
+ * that is not found there is run with its output saved.
+ *
  * Requires:
  *  "*cmdline" is a string consisting of a name and zero or more
  *  arguments that are separated by one or more spaces. The name 
  *  should either be a built-in command or the name of an 
- *  executable file.
+ *  executable file.  It is modified while the command is evaluated.
  *
  * Effects:
  *   If "*cmdline" is a built-in command then eval executes the 
  *   built-in command. Otherwise, eval finds the entire name of 
- *   the executable and executes it using execve. If the executable
+ *   each executable and executes it using execve. If the job
  *   is run in the foreground, then eval waits for the execution to
  *   finish before terminating.
  */
 static void
-eval(const char *cmdline) 
+eval(char *cmdline) 
 {
-	// Parse the string from the shell into argument values
-	char **argv;
-	if ((argv = malloc(sizeof(char*) * MAXARGS)) == NULL) {
-		Sio_error("Failed allocating memory");
+	struct timespec phase, begin;
+
+	// Report the jobs that changed state since the last command.
+	applyqueued();
+	trace_pending = 0;
+	phasebegin(&phase);
+	begin = phase;
+
+	// Reclaim everything that the previous command allocated.
+	arena_reset(&cmd_arena);
+
+	// Split the line into arguments where it lies.
+	size_t len = strlen(cmdline);
+	int bg = tokenize(cmdline, len, &cmd_tokens);
+	char **argv = cmd_tokens.argv;
+	struct Stage *stages;
+	struct Placement *place;
+	struct Limits *limits = NULL;
+	struct Usage before;
+	struct timespec start;
+	const char *executable, *target, *cpus = NULL, *node = NULL;
+	const char *limit = NULL, *cachevars = NULL, *cachefiles = NULL;
+	struct CacheKey *key;
+	char *pathbuf, *list;
+	size_t listlen;
+	FILE *f;
+	sigset_t mask, prev;
+	pid_t *pids;
+	int cpu, fd, first, i, n, nstages;
+	bool ok, timed = false, external = false, cached = false;
+
+	if (bg < 0) {
+		printf("Failed allocating memory\n");
+		return;
 	}
-	int bg = parseline(cmdline, argv);
-	
 	if (argv[0] == NULL) {
 		return;
 	}
-	// If builtin command, evaluate it
-	if (builtin_cmd(argv)) {
-		return;
+
+	/*
+	 * Reading the body of a here-document may move or overwrite the
+	 * line, so first make a copy of it.
+	 */
+	for (i = 0; argv[i] != NULL; i++)
+		if (!tokenize_quoted(&cmd_tokens, i) &&
+		    redirop(argv[i], &fd, &target) == REDIR_HEREDOC)
+			break;
+	if (argv[i] != NULL) {
+		untokenize(&cmd_tokens);
+		cmdline = arena_strndup(&cmd_arena, cmdline, len);
+		bg = tokenize(cmdline, len, &cmd_tokens);
+		argv = cmd_tokens.argv;
+		if (bg < 0) {
+			printf("Failed allocating memory\n");
+			return;
+		}
 	}
-	int is_exe_in_cwd = 0;
-	if (access(argv[0], X_OK) == 0) {
-		is_exe_in_cwd = 1;
-		int i = 0;
-		while (argv[0][i] != '\0') {
-			if (argv[0][i] == '/') {
-				is_exe_in_cwd = 0;
-			}
-			i++;
+
+	// Take the job's prefixes, if any, off the front.
+	first = 0;
+	while (argv[first] != NULL && !tokenize_quoted(&cmd_tokens, first)) {
+		if (!strcmp(argv[first], "time")) {
+			timed = true;
+			first++;
+			continue;
+		}
+		if (!strcmp(argv[first], "command")) {
+			external = true;
+			first++;
+			continue;
+		}
+		if (!strcmp(argv[first], "cached")) {
+			cached = true;
+			if (!parsecached(argv, &first, &cachevars,
+			    &cachefiles))
+				return;
+			continue;
+		}
+		if (strcmp(argv[first], "--cpus") &&
+		    strcmp(argv[first], "--node") &&
+		    strcmp(argv[first], "--limit"))
+			break;
+		if (argv[first + 1] == NULL) {
+			printf("%s requires an argument\n", argv[first]);
+			return;
 		}
+		if (argv[first][2] == 'c')
+			cpus = argv[first + 1];
+		else if (argv[first][2] == 'n')
+			node = argv[first + 1];
+		else
+			limit = argv[first + 1];
+		first += 2;
 	}
-	
-	char *executable = NULL;
-	// Otherwise we have a executable path or name
-	if (argv[0][0] == '/' || argv[0][0] == '.' || search_path == NULL) { 
-		executable = argv[0];
-		// We have a full path to executable
-	} else if (!is_exe_in_cwd) {
-		int i = 0;
-		// search through path for valid path to executable
-		while(search_path[i] != NULL) {
-			char *abs_path;
-			if ((abs_path = malloc(strlen(search_path[i]) + 1 
-					       + strlen(argv[0]))) == NULL) {
-				    Sio_error("Failed allocating memory");
-			}
-			// concat executable to path
-			strcpy(abs_path, search_path[i]);
-			strcat(abs_path, "/");
-			strcat(abs_path, argv[0]);
+	argv += first;
 
-			if (access(abs_path, X_OK) == 0) {
-				executable = abs_path;
-				break;
-			}
+	// Split the arguments into stages at each '|' that is not quoted.
+	nstages = 1;
+	for (i = 0; argv[i] != NULL; i++)
+		if (!strcmp(argv[i], "|") &&
+		    !tokenize_quoted(&cmd_tokens, first + i))
+			nstages++;
+	stages = arena_alloc(&cmd_arena, nstages * sizeof(*stages));
+	for (n = i = 0; n < nstages; n++) {
+		stages[n].argv = &argv[i];
+		while (argv[i] != NULL && (strcmp(argv[i], "|") ||
+		    tokenize_quoted(&cmd_tokens, first + i)))
 			i++;
-		} 
+		if (argv[i] != NULL)
+			argv[i++] = NULL;
+		for (fd = 0; fd < 3; fd++)
+			stages[n].fds[fd] = -1;
+		stages[n].cache = NULL;
 	}
 
-	if (executable == NULL || access(executable, X_OK) != 0) {
-		printf("%s: Command not found\n", argv[0]);
+	/*
+	 * Take out every stage's redirections, even after an error, so that
+	 * no here-document's body is left to be run as commands.
+	 */
+	ok = true;
+	for (n = 0; n < nstages; n++)
+		if (!parseredirs(&stages[n]))
+			ok = false;
+	for (n = 0; ok && n < nstages; n++)
+		if (stages[n].argv[0] == NULL) {
+			printf("Invalid null command\n");
+			ok = false;
+		}
+	if (ok && !placejob(cpus, node, bg, &place, &cpu))
+		ok = false;
+	if (ok && limit != NULL && !parselimits(limit, &limits))
+		ok = false;
+	if (ok && cached && nstages > 1) {
+		printf("cached: A pipeline cannot be cached\n");
+		ok = false;
+	}
+	if (!ok) {
+		for (n = 0; n < nstages; n++)
+			closeredirs(&stages[n]);
 		return;
 	}
-        
-	sigset_t mask, prev_mask;
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGCHLD);
-	sigprocmask(SIG_BLOCK, &mask, &prev_mask);
-
-	pid_t pid = fork();
-	if (pid == 0) {
-		// Child task
+	phasemark(PHASE_PARSE, &phase);
 
-		// Put child into new process group, so only shell is in 
-		// FG process group
-		setpgid(0, 0);
-		// Unblock blocking of child signal before we execute
-		sigprocmask(SIG_SETMASK, &prev_mask,  NULL);
+	// If builtin command, evaluate it
+	if (timed && nstages == 1) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		shellusage(&before);
+	}
+	if (nstages == 1 && runbuiltin(&stages[0], !external && !bg &&
+	    cpus == NULL && node == NULL && limit == NULL)) {
+		if (timed)
+			reportbuiltin(&start, &before);
+		phasemark(PHASE_BUILTIN, &phase);
+		phasemark(PHASE_EVAL, &begin);
+		tracephases(0);
+		return;
+	}
+	// Otherwise we have a executable path or name for each stage
+	pathbuf = arena_alloc(&cmd_arena, PATH_MAX);
+	for (n = 0; n < nstages; n++) {
+		executable = lookupexe(stages[n].argv[0], pathbuf);
+		if (executable == NULL) {
+			printf("%s: Command not found\n", stages[n].argv[0]);
+			for (n = 0; n < nstages; n++) {
+				closeredirs(&stages[n]);
+				closestage(&stages[n]);
+			}
+			return;
+		}
+		// The next lookup may reuse the buffer or flush the cache.
+		stages[n].executable = nstages == 1 ? executable :
+		    arena_strndup(&cmd_arena, executable, strlen(executable));
+		stages[n].place = place;
+		stages[n].limits = limits;
+	}
+	phasemark(PHASE_LOOKUP, &phase);
 
-		if (execve(executable, argv, environ) < 0) {
-			printf("%s: Command not found\n", argv[0]);
-			exit(0);
+	// Replay the output of a cached command, or else have it saved.
+	if (cached && cachedir(false) != NULL && (key = cachekey(&stages[0],
+	    cachevars, cachefiles, &cmd_arena)) != NULL) {
+		if (cachereplay(&stages[0], key) >= 0) {
+			closestage(&stages[0]);
+			if (timed)
+				reportbuiltin(&start, &before);
+			phasemark(PHASE_BUILTIN, &phase);
+			phasemark(PHASE_EVAL, &begin);
+			tracephases(0);
+			return;
 		}
-	} else if (pid < 0) {
-		// TASK CREATION FAILED
-		printf("Task creation failed.\n");
+		if (cachedir(true) != NULL) {
+			stages[0].cache = key;
+			cache_misses++;
+		}
+	}
+
+	/*
+	 * A change read from the signalfd is only applied once the job has
+	 * been added.  But an asynchronous sigchld_handler() could reap a
+	 * process before addjob() opens its pidfd, so SIGCHLD is then
+	 * blocked until the job has been added.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (signal_fd < 0)
+		sigprocmask(SIG_BLOCK, &mask, &prev);
+
+	// Write out anything buffered before the job can print.
+	fflush(stdout);
+	pids = arena_alloc(&cmd_arena, nstages * sizeof(*pids));
+	if ((n = launchpipeline(stages, nstages, pids)) > 0) {
+		phasemark(PHASE_LAUNCH, &phase);
+		// The job keeps a copy of the line, so restore it first.
+		untokenize(&cmd_tokens);
+		ok = addjob(&jobs, pids, n, bg ? BG : FG, cmdline);
+	}
+	if (signal_fd < 0)
+		sigprocmask(SIG_SETMASK, &prev, NULL);
+	if (n == 0 || !ok)
+		return;
+	phasemark(PHASE_ADDJOB, &phase);
+	JobP job = getjobpid(&jobs, pids[0]);
+	job->cpu = cpu;
+	job->node = place != NULL ? place->node : -1;
+	job->timed = timed;
+	if (cpu >= 0)
+		cpu_jobs[cpu]++;
+	// The jobs list shows the CPUs that a --cpus prefix left it on.
+	if (cpus != NULL && (f = open_memstream(&list, &listlen)) != NULL) {
+		printcpulist(f, &place->cpus);
+		if (fclose(f) == 0)
+			job->cpulist = interncmd(&jobs, list);
+		free(list);
 	}
-	addjob(jobs, pid, bg ? BG : FG, cmdline);
-	JobP job = getjobpid(jobs, pid);
 	if (bg) { 
-		printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+		printf("[%d] (%d) %s", job->jid, job->pid,
+		    jobcmdline(&jobs, job));
 	}
+	phasemark(PHASE_EVAL, &begin);
+	tracephases(job->pid);
 
-       	sigprocmask(SIG_SETMASK, &prev_mask,  NULL);
 	// If it's a foreground task, 
 	// wait for it to finish before continuing REPL
 	if (!bg) {
-		waitfg(pid);
+		waitfg(job->jid);
 	}
 }
 
 /* 
- * parseline - Parse the command line and build the argv array.
+ * launchjob - Create a process of a job using the method selected by
+ *  launch_mode.
  *
  * Requires:
- *   "cmdline" is a NUL ('\0') terminated string with a trailing
- *   '\n' character.  "cmdline" must contain less than MAXARGS
- *   arguments.
+ *   "stage" is the command to run, "pgid" is the process group to put it
+ *   in, or 0 for a new one, and "mask" is the signal mask that the new
+ *   process should run with.
  *
  * Effects:
- *   Builds "argv" array from space delimited arguments on the command line.
- *   The final element of "argv" is set to NULL.  Characters enclosed in
- *   single quotes are treated as a single argument.  Returns true if
- *   the user has requested a BG job and false if the user has requested
- *   a FG job.
+ *   Creates a process running the stage's executable, with the stage's
+ *   descriptors in place of its stdin, stdout and stderr, in process
+ *   group "pgid" or in a new process group whose ID is its PID, and
+ *   returns that PID.  Returns -1 and prints an error message if the
+ *   process could not be created.
  */
-static int
-parseline(const char *cmdline, char **argv) 
+static pid_t
+launchjob(const struct Stage *stage, pid_t pgid, const sigset_t *mask)
 {
-	int argc;                   // number of args
-	int bg;                     // background job?
-	static char array[MAXLINE]; // local copy of command line
-	char *buf = array;          // ptr that traverses command line
-	char *delim;                // points to first space delimiter
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t block, prev;
+	pid_t pid;
+	int error, i;
 
-	strcpy(buf, cmdline);
+	// The output of a cached command is saved by a copy of the shell.
+	if (launch_mode == LAUNCH_ZYGOTE && stage->cache == NULL) {
+		if ((pid = zygotejob(stage, pgid)) != 0 && pid != -2)
+			return (pid);
+		/*
+		 * If the zygote has died, launch this and future jobs here.
+		 * A request too big to send is only launched here itself.
+		 */
+		if (pid == 0)
+			launch_mode = LAUNCH_FORK;
+	}
+	// posix_spawn() cannot set limits, so such a job is forked.
+	if (launch_mode == LAUNCH_SPAWN && stage->limits == NULL &&
+	    stage->cache == NULL) {
+		/*
+		 * posix_spawn() performs the dup2(), setpgid() and
+		 * sigprocmask() below on our behalf, but in a child that
+		 * shares our address space until it calls execve().
+		 */
+		if ((error = posix_spawnattr_init(&attr)) != 0) {
+			printf("Task creation failed.\n");
+			return (-1);
+		}
+		if ((error = posix_spawn_file_actions_init(&actions)) != 0) {
+			posix_spawnattr_destroy(&attr);
+			printf("Task creation failed.\n");
+			return (-1);
+		}
+		for (i = 0; i < 3; i++)
+			if (stage->fds[i] >= 0)
+				posix_spawn_file_actions_adddup2(&actions,
+				    stage->fds[i], i);
+		posix_spawnattr_setflags(&attr,
+		    POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+		posix_spawnattr_setpgroup(&attr, pgid);
+		posix_spawnattr_setsigmask(&attr, mask);
+		// The child inherits the CPUs and memory policy in place.
+		if (stage->place != NULL)
+			applyplacement(stage->place);
+		error = posix_spawn(&pid, stage->executable, &actions, &attr,
+		    stage->argv, environ);
+		if (stage->place != NULL)
+			restoreplacement();
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
+		if (error != 0) {
+			printf("%s: Command not found\n", stage->argv[0]);
+			return (-1);
+		}
+		return (pid);
+	}
 
-	// Replace trailing '\n' with space.
-	buf[strlen(buf) - 1] = ' ';
+	/*
+	 * Until the child has restored the default actions, a signal sent to
+	 * the job would run the shell's handlers in the child instead.
+	 */
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTSTP);
+	sigaddset(&block, SIGQUIT);
+	sigprocmask(SIG_BLOCK, &block, &prev);
+	pid = fork();
+	if (pid == 0) {
+		// Child task
 
-	// Ignore leading spaces.
-	while (*buf != '\0' && *buf == ' ')
-		buf++;
+		// Put child into new process group, so only shell is in 
+		// FG process group
+		setpgid(0, pgid);
+		if (stage->place != NULL)
+			applyplacement(stage->place);
+		if (stage->limits != NULL)
+			applylimits(stage->limits);
+		// Connect the child to the rest of its pipeline.  The
+		// originals are closed on exec.
+		for (i = 0; i < 3; i++)
+			if (stage->fds[i] >= 0)
+				dup2(stage->fds[i], i);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		// Unblock blocking of child signal before we execute
+		sigprocmask(SIG_SETMASK, mask, NULL);
 
-	// Build the argv list.
-	argc = 0;
-	if (*buf == '\'') {
-		buf++;
-		delim = strchr(buf, '\'');
-	} else
-		delim = strchr(buf, ' ');
-	while (delim != NULL) {
-		argv[argc++] = buf;
-		*delim = '\0';
-		buf = delim + 1;
-		while (*buf != '\0' && *buf == ' ')	// Ignore spaces.
-			buf++;
-		if (*buf == '\'') {
-			buf++;
-			delim = strchr(buf, '\'');
-		} else
-			delim = strchr(buf, ' ');
+		if (stage->cache != NULL)
+			runcached(stage);
+		if (execve(stage->executable, stage->argv, environ) < 0) {
+			printf("%s: Command not found\n", stage->argv[0]);
+			exit(0);
+		}
+	} else if (pid < 0) {
+		// TASK CREATION FAILED
+		printf("Task creation failed.\n");
+	} else {
+		// Also set the group here, so that it exists before the next
+		// stage of a pipeline joins it, even if the child has not
+		// yet run.
+		setpgid(pid, pgid);
 	}
-	argv[argc] = NULL;
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	return (pid);
+}
 
-	// Ignore blank line.
-	if (argc == 0)
-		return (1);
+/*
+ * launchpipeline - Create the processes of a job.
+ *
+ * Requires:
+ *   "stages" is an array of the "nstages" commands of a pipeline, and
+ *   "pids" has room for "nstages" PIDs.  Only a lone stage may already
+ *   have descriptors.
+ *
+ * Effects:
+ *   Connects each stage's stdout to the next stage's stdin with a pipe,
+ *   applies the stage's redirections on top of that, and creates the
+ *   stages' processes, in order, in the process group of the first.
+ *   Stores their PIDs in "pids" and returns how many were created, which
+ *   is fewer than "nstages" only if a process could not be created.  The
+ *   earlier stages then see the pipeline end early.  Closes every
+ *   descriptor that the stages own.
+ */
+static int
+launchpipeline(struct Stage *stages, int nstages, pid_t *pids)
+{
+	sigset_t mask, prev;
+	int fds[2], i, n;
+
+	/*
+	 * Keep the first process from being reaped, which would free its
+	 * PID and with it the process group, until the rest have joined.
+	 */
+	if (nstages > 1) {
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &mask, &prev);
+	}
+	for (i = n = 0; i < nstages; i++) {
+		// The pipe's descriptors must not leak into any other stage.
+		if (i + 1 < nstages) {
+			if (pipe2(fds, O_CLOEXEC) < 0) {
+				printf("Task creation failed.\n");
+				closestage(&stages[i]);
+				break;
+			}
+			stages[i].fds[STDOUT_FILENO] = fds[1];
+			stages[i + 1].fds[STDIN_FILENO] = fds[0];
+		}
+		if (applyredirs(&stages[i]))
+			pids[i] = launchjob(&stages[i], i > 0 ? pids[0] : 0,
+			    &job_mask);
+		else
+			pids[i] = -1;
+		closestage(&stages[i]);
+		if (pids[i] < 0) {
+			if (i + 1 < nstages)
+				closestage(&stages[i + 1]);
+			break;
+		}
+		n++;
+	}
+	// Release the files opened for any stages that were not created.
+	for (; i < nstages; i++)
+		closeredirs(&stages[i]);
+	if (nstages > 1)
+		sigprocmask(SIG_SETMASK, &prev, NULL);
+	return (n);
+}
+
+/*
+ * redirop - Recognize an argument that begins a redirection.
+ *
+ * Requires:
+ *   "arg" is an unquoted argument, and "fdp" and "targetp" point to
+ *   where the redirection's descriptor and target should be stored.
+ *
+ * Effects:
+ *   If "arg" begins with a redirection operator, stores the descriptor
+ *   that it redirects in "*fdp" and the rest of the argument, which is
+ *   empty if the target is the next argument, in "*targetp", and returns
+ *   the kind of redirection.  Otherwise, returns 0.
+ */
+static int
+redirop(const char *arg, int *fdp, const char **targetp)
+{
+	int fd = -1, op;
+
+	if (arg[0] >= '0' && arg[0] <= '2' && (arg[1] == '<' || arg[1] == '>'))
+		fd = *arg++ - '0';
+	if (arg[0] == '<') {
+		if (arg[1] == '<' && arg[2] == '<') {
+			op = REDIR_HERESTR;
+			arg += 3;
+		} else if (arg[1] == '<') {
+			op = REDIR_HEREDOC;
+			arg += 2;
+		} else if (arg[1] == '&') {
+			op = REDIR_DUP;
+			arg += 2;
+		} else {
+			op = REDIR_IN;
+			arg++;
+		}
+		if (fd < 0)
+			fd = STDIN_FILENO;
+	} else if (arg[0] == '>') {
+		if (arg[1] == '>') {
+			op = REDIR_APPEND;
+			arg += 2;
+		} else if (arg[1] == '&') {
+			op = REDIR_DUP;
+			arg += 2;
+		} else {
+			op = REDIR_OUT;
+			arg++;
+		}
+		if (fd < 0)
+			fd = STDOUT_FILENO;
+	} else
+		return (0);
+	*fdp = fd;
+	*targetp = arg;
+	return (op);
+}
+
+/*
+ * parseredirs - Take the redirections out of a stage's arguments.
+ *
+ * Requires:
+ *   "stage" is a stage of the command in cmd_tokens, without any
+ *   redirections yet.
+ *
+ * Effects:
+ *   Removes the redirections from the stage's arguments and records
+ *   them in the stage, opening their files and reading the bodies of
+ *   their here-documents as it goes.  Returns true if every redirection
+ *   is valid.  Otherwise, prints an error message for each one that is
+ *   not and returns false, with the rest recorded.
+ */
+static bool
+parseredirs(struct Stage *stage)
+{
+	char **argv = stage->argv;
+	int first = argv - cmd_tokens.argv;  // index of argv[0] in cmd_tokens
+	struct Redir *redir;
+	const char *target;
+	int fd, i, j, op;
+	bool ok = true;
+
+	stage->redirs = NULL;
+	stage->nredirs = 0;
+	for (i = j = 0; argv[i] != NULL; i++)
+		if (!tokenize_quoted(&cmd_tokens, first + i) &&
+		    redirop(argv[i], &fd, &target) != 0)
+			j++;
+	if (j == 0)
+		return (true);
+	stage->redirs = arena_alloc(&cmd_arena, j * sizeof(*stage->redirs));
+
+	for (i = j = 0; argv[i] != NULL; i++) {
+		if (tokenize_quoted(&cmd_tokens, first + i) ||
+		    (op = redirop(argv[i], &fd, &target)) == 0) {
+			argv[j++] = argv[i];
+			continue;
+		}
+		if (*target == '\0' && (target = argv[++i]) == NULL) {
+			printf("Missing name for redirect\n");
+			ok = false;
+			break;
+		}
+		redir = &stage->redirs[stage->nredirs];
+		redir->fd = fd;
+		redir->dup = false;
+		switch (op) {
+		case REDIR_IN:
+			redir->src = open(target, O_RDONLY | O_CLOEXEC);
+			break;
+		case REDIR_OUT:
+			redir->src = open(target,
+			    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			break;
+		case REDIR_APPEND:
+			redir->src = open(target,
+			    O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+			break;
+		case REDIR_DUP:
+			if (target[0] < '0' || target[0] > '2' ||
+			    target[1] != '\0') {
+				printf("%s: Bad file descriptor\n", target);
+				ok = false;
+				continue;
+			}
+			redir->src = target[0] - '0';
+			redir->dup = true;
+			break;
+		case REDIR_HEREDOC:
+			redir->src = readheredoc(target);
+			break;
+		case REDIR_HERESTR:
+			if ((redir->src = memfd_create("tsh-herestring",
+			    MFD_CLOEXEC)) >= 0 &&
+			    (writeall(redir->src, target, strlen(target)) < 0 ||
+			    writeall(redir->src, "\n", 1) < 0 ||
+			    lseek(redir->src, 0, SEEK_SET) < 0)) {
+				close(redir->src);
+				redir->src = -1;
+			}
+			break;
+		}
+		if (redir->src < 0) {
+			printf("%s: %s\n", target, strerror(errno));
+			ok = false;
+			continue;
+		}
+		stage->nredirs++;
+	}
+	argv[j] = NULL;
+	return (ok);
+}
+
+/*
+ * readheredoc - Read the body of a here-document.
+ *
+ * Requires:
+ *   "delim" is the word that ends the here-document.
+ *
+ * Effects:
+ *   Reads lines from the shell's input up to one that holds only "delim"
+ *   or the end of the input, and returns a descriptor for a memory file
+ *   holding them, positioned at its start.  Returns -1 with errno set if
+ *   the file could not be created or written.
+ */
+static int
+readheredoc(const char *delim)
+{
+	static char *buf;          // line read by getline()
+	static size_t size;        // allocated size of buf
+	char *line;
+	size_t dlen = strlen(delim), len;
+	ssize_t n;
+	int error = 0, fd;
+
+	if ((fd = memfd_create("tsh-heredoc", MFD_CLOEXEC)) < 0)
+		return (-1);
+	while (true) {
+		if (cmd_input != NULL)
+			line = nextline(cmd_input, &len);
+		else if ((n = getline(&buf, &size, stdin)) < 0)
+			line = NULL;
+		else {
+			line = buf;
+			len = n;
+		}
+		if (line == NULL)
+			break;
+		if ((len == dlen + 1 && line[dlen] == '\n' &&
+		    !memcmp(line, delim, dlen)) ||
+		    (len == dlen && !memcmp(line, delim, dlen)))
+			break;
+		// Keep reading after an error so that the body is skipped.
+		if (error == 0 && writeall(fd, line, len) < 0)
+			error = errno;
+	}
+	if (error == 0 && lseek(fd, 0, SEEK_SET) < 0)
+		error = errno;
+	if (error != 0) {
+		close(fd);
+		errno = error;
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * applyredirs - Apply a stage's redirections to its descriptors.
+ *
+ * Requires:
+ *   "stage" is a stage whose descriptors are those it will be given
+ *   before its redirections, such as the ends of its pipes.
+ *
+ * Effects:
+ *   Applies the stage's redirections in order, closing any descriptor
+ *   of the stage that one replaces, and leaves the stage with none to
+ *   apply.  Returns true on success.  Otherwise, prints an error message,
+ *   closes the files of the redirections not applied, and returns false.
+ */
+static bool
+applyredirs(struct Stage *stage)
+{
+	struct Redir *redir;
+	int fd, i;
+
+	for (i = 0; i < stage->nredirs; i++) {
+		redir = &stage->redirs[i];
+		fd = redir->src;
+		// The copy must be a new descriptor, which is closed on exec.
+		if (redir->dup && (fd = fcntl(stage->fds[fd] >= 0 ?
+		    stage->fds[fd] : fd, F_DUPFD_CLOEXEC, 3)) < 0) {
+			printf("%d: %s\n", redir->src, strerror(errno));
+			stage->redirs += i + 1;
+			stage->nredirs -= i + 1;
+			closeredirs(stage);
+			return (false);
+		}
+		if (stage->fds[redir->fd] >= 0)
+			close(stage->fds[redir->fd]);
+		stage->fds[redir->fd] = fd;
+	}
+	stage->nredirs = 0;
+	return (true);
+}
+
+/*
+ * closeredirs - Discard a stage's redirections.
+ *
+ * Requires:
+ *   "stage" is a stage.
+ *
+ * Effects:
+ *   Closes the files opened for the redirections that the stage has yet
+ *   to apply, and leaves it with none.
+ */
+static void
+closeredirs(struct Stage *stage)
+{
+	int i;
+
+	for (i = 0; i < stage->nredirs; i++)
+		if (!stage->redirs[i].dup)
+			close(stage->redirs[i].src);
+	stage->nredirs = 0;
+}
+
+/*
+ * closestage - Close a stage's descriptors.
+ *
+ * Requires:
+ *   "stage" is a stage.
+ *
+ * Effects:
+ *   Closes every descriptor that the stage owns and sets it to -1.
+ */
+static void
+closestage(struct Stage *stage)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		if (stage->fds[i] >= 0) {
+			close(stage->fds[i]);
+			stage->fds[i] = -1;
+		}
+}
+
+/*
+ * runbuiltin - Run a stage if it is a built-in command.
+ *
+ * Requires:
+ *   "stage" is the only stage of a command, with no descriptors.
+ *
+ * Effects:
+ *   Applies the stage's redirections.  If its command is a built-in
+ *   command, and "standins" is true or the command does not stand in
+ *   for a program, runs it with the shell's own descriptors redirected
+ *   for its duration, restores them, closes the stage's descriptors, and
+ *   returns 1.  Also returns 1 if a redirection failed.  Otherwise,
+ *   returns 0 with the stage's descriptors in place for the job to be
+ *   launched.
+ */
+static int
+runbuiltin(struct Stage *stage, bool standins)
+{
+	int i, ran, saved[3];
+
+	if (stage->nredirs == 0)
+		return (builtin_cmd(stage->argv, standins));
+	if (!applyredirs(stage)) {
+		closestage(stage);
+		return (1);
+	}
+	// Anything already buffered belongs to the original stdout.
+	fflush(stdout);
+	for (i = 0; i < 3; i++) {
+		saved[i] = -1;
+		if (stage->fds[i] >= 0) {
+			saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+			dup2(stage->fds[i], i);
+		}
+	}
+	stdin_redirected = stage->fds[STDIN_FILENO] >= 0;
+	ran = builtin_cmd(stage->argv, standins);
+	stdin_redirected = false;
+	fflush(stdout);
+	for (i = 0; i < 3; i++)
+		if (saved[i] >= 0) {
+			dup2(saved[i], i);
+			close(saved[i]);
+		}
+	if (ran)
+		closestage(stage);
+	return (ran);
+}
+
+/*
+ * startzygote - Start the zygote, a helper process that creates jobs on
+ *  the shell's behalf.
+ *
+ * Requires:
+ *   The signals that the shell handles are not blocked.
+ *
+ * Effects:
+ *   Forks the zygote, connected to the shell by a sequenced-packet socket
+ *   pair, and stores the shell's end of the socket in zygote_fd.  The
+ *   zygote is placed in its own process group so that it never receives
+ *   signals from the keyboard, and restores the default actions of any
+ *   handlers that have already been installed.
+ */
+static void
+startzygote(void)
+{
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		unix_error("socketpair error");
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		unix_error("fork error");
+	if (pid == 0) {
+		close(sv[0]);
+		setpgid(0, 0);
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		zygote(sv[1]);
+	}
+	close(sv[1]);
+	zygote_fd = sv[0];
+	zygote_pid = pid;
+}
+
+/*
+ * zygote - The main loop of the zygote process.
+ *
+ * Requires:
+ *   "fd" is the zygote's end of the socket pair created by startzygote().
+ *
+ * Effects:
+ *   Repeatedly receives a request for a process, as described by struct
+ *   ZygoteRequest, creates a process running the requested executable in
+ *   the requested process group, and replies with the new PID, or with
+ *   the negated errno if no process could be created.  The process is created with
+ *   CLONE_PARENT, which makes it a child of the shell rather than of the
+ *   zygote, so the shell reaps and controls it like any other job.  The
+ *   zygote exits when the shell closes its end of the socket.
+ */
+static void
+zygote(int fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct ZygoteRequest request;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char *buf = NULL, *cp, *end, **argv = NULL;
+	ssize_t len;
+	size_t bufsize = 0, argvsize = 0;
+	pid_t pid;
+	int argc, fds[3], i, k, nfds;
+
+	while ((len = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC)) > 0) {
+		// Grow the buffers to fit the request and its argv array.
+		if ((size_t)len + 1 > bufsize) {
+			bufsize = len + 1;
+			if ((buf = realloc(buf, bufsize)) == NULL)
+				_exit(1);
+		}
+		if ((size_t)len + 1 > argvsize) {
+			argvsize = len + 1;
+			if ((argv = realloc(argv, argvsize * sizeof(*argv))) ==
+			    NULL)
+				_exit(1);
+		}
+		iov.iov_base = buf;
+		iov.iov_len = bufsize;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if ((len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <
+		    (ssize_t)sizeof(request))
+			break;
+		buf[len] = '\0';
+		memcpy(&request, buf, sizeof(request));
+
+		// Match the descriptors that came along to the fds they replace.
+		nfds = 0;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = k = 0; i < 3; i++) {
+			fds[i] = -1;
+			if ((request.fds & (1 << i)) != 0 && k < nfds)
+				memcpy(&fds[i], CMSG_DATA(cmsg) +
+				    k++ * sizeof(int), sizeof(int));
+		}
+
+		// Split the request into the executable and its arguments.
+		cp = buf + sizeof(request);
+		end = buf + len;
+		argc = 0;
+		for (cp += strlen(cp) + 1; cp < end; cp += strlen(cp) + 1)
+			argv[argc++] = cp;
+		argv[argc] = NULL;
+
+		pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+		if (pid == 0) {
+			close(fd);
+			setpgid(0, request.pgid);
+			if (request.placed)
+				applyplacement(&request.place);
+			if (request.limited)
+				applylimits(&request.limits);
+			for (i = 0; i < 3; i++)
+				if (fds[i] >= 0)
+					dup2(fds[i], i);
+			if (execve(buf + sizeof(request), argv, environ) < 0) {
+				printf("%s: Command not found\n", argv[0]);
+				exit(0);
+			}
+		}
+		if (pid < 0)
+			pid = -errno;
+		for (i = 0; i < 3; i++)
+			if (fds[i] >= 0)
+				close(fds[i]);
+		if (send(fd, &pid, sizeof(pid), MSG_NOSIGNAL) < 0)
+			break;
+	}
+	_exit(0);
+}
+
+/*
+ * zygotejob - Ask the zygote to create the process for a job.
+ *
+ * Requires:
+ *   "stage" is the command to run and "pgid" is the process group to put
+ *   it in, or 0 for a new one.
+ *
+ * Effects:
+ *   Returns the PID of the new process, whose parent is this shell and
+ *   whose process group ID is "pgid" or, if that is 0, its PID.  Passes
+ *   the stage's descriptors to the zygote for the process to use.
+ *   Returns -1 and prints an error message if the zygote could not
+ *   create the process, 0 if the zygote could not be reached, or -2 if
+ *   the request is too big to send, which leaves the zygote usable.
+ */
+static pid_t
+zygotejob(const struct Stage *stage, pid_t pgid)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct ZygoteRequest request = { .pgid = pgid };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char *buf;
+	size_t len;
+	ssize_t sent;
+	pid_t pid;
+	int fds[3], i, nfds = 0;
+
+	// The request is the header and every string, with its NUL.
+	len = sizeof(request) + strlen(stage->executable) + 1;
+	for (i = 0; stage->argv[i] != NULL; i++)
+		len += strlen(stage->argv[i]) + 1;
+	buf = arena_alloc(&cmd_arena, len);
+	len = sizeof(request);
+	len += stpcpy(buf + len, stage->executable) - (buf + len) + 1;
+	for (i = 0; stage->argv[i] != NULL; i++)
+		len += stpcpy(buf + len, stage->argv[i]) - (buf + len) + 1;
+	for (i = 0; i < 3; i++)
+		if (stage->fds[i] >= 0) {
+			request.fds |= 1 << i;
+			fds[nfds++] = stage->fds[i];
+		}
+	if ((request.placed = stage->place != NULL))
+		request.place = *stage->place;
+	if ((request.limited = stage->limits != NULL))
+		request.limits = *stage->limits;
+	memcpy(buf, &request, sizeof(request));
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds > 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	if ((sent = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL)) < 0 &&
+	    errno == EMSGSIZE)
+		return (-2);   // Too big for the socket, but the zygote is fine.
+	if (sent < 0 || recv(zygote_fd, &pid, sizeof(pid), 0) != sizeof(pid)) {
+		close(zygote_fd);
+		zygote_fd = -1;
+		return (0);
+	}
+	if (pid < 0) {
+		printf("Task creation failed.\n");
+		return (-1);
+	}
+
+	/*
+	 * Also set the process group here, as a parent, so that it is in
+	 * place before any signal is forwarded, even if the child has not
+	 * yet run.
+	 */
+	setpgid(pid, pgid);
+	return (pid);
+}
+
+/*
+ * evalbatch - Evaluate every command line in the input and exit.
+ *
+ * Requires:
+ *   "in" is an initialized input.
+ *
+ * Effects:
+ *   Evaluates each line of the input in turn, without copying it, and
+ *   exits at the end of the input.  Output is only flushed before a job
+ *   is launched and before waiting for more input, rather than after
+ *   every command, so a run of builtins costs a single write().
+ */
+static void
+evalbatch(struct Input *in, bool emit_prompt)
+{
+	char *line;
+	size_t len;
 
-	// Should the job run in the background?
-	if ((bg = (*argv[argc - 1] == '&')) != 0)
-		argv[--argc] = NULL;
+	// Here-documents read their bodies from the same input.
+	cmd_input = in;
+	while (true) {
+		if (emit_prompt)
+			printf("%s", prompt);
+		if ((line = nextline(in, &len)) == NULL)
+			quitshell();
+		// Catch up on jobs that changed state since the last line.
+		if (signal_fd >= 0)
+			dispatchsignals();
+		if (len > max_cmdline) {
+			printf("Command line too long\n");
+			continue;
+		}
 
-	return (bg);
+		/*
+		 * Terminate the line in place.  The byte overwritten belongs
+		 * to the next line, so put it back afterward, unless reading
+		 * a here-document has already done so.
+		 */
+		in->held = &line[len];
+		in->heldbyte = line[len];
+		line[len] = '\0';
+		eval(line);
+		if (in->held != NULL) {
+			*in->held = in->heldbyte;
+			in->held = NULL;
+		}
+	}
 }
 
 /* 
@@ -470,23 +2179,77 @@ parseline(const char *cmdline, char **argv)
  *
  * Effects:
  *   If the first word of argv is a builtin command, executes it
- *   and returns 1. Otherwise returns 0.
+ *   and returns 1. Otherwise returns 0.  The built-in commands that
+ *   stand in for programs are only recognized if "standins" is true.
  */
 static int
-builtin_cmd(char **argv) 
+builtin_cmd(char **argv, bool standins) 
 {
 
 	if (!strcmp(argv[0], "quit")) {
-		exit(0);
+		quitshell();
 	}
 	if (!strcmp(argv[0], "jobs")) {
-	        listjobs(jobs);
+		if (argv[1] != NULL && (strcmp(argv[1], "-l") ||
+		    argv[2] != NULL)) {
+			printf("jobs: usage: jobs [-l]\n");
+			return 1;
+		}
+	        listjobs(&jobs, argv[1] != NULL);
 		return 1;
 	}
 	if (!strcmp(argv[0], "bg") || !strcmp(argv[0], "fg")) {
 		do_bgfg(argv);
 		return 1;
 	}
+	if (!strcmp(argv[0], "hash")) {
+		do_hash(argv);
+		return 1;
+	}
+	if (!strcmp(argv[0], "affinity")) {
+		do_affinity(argv);
+		return 1;
+	}
+	if (!strcmp(argv[0], "stats")) {
+		do_stats(argv);
+		return 1;
+	}
+	if (!strcmp(argv[0], "parallel")) {
+		do_parallel(argv);
+		return 1;
+	}
+	if (!strcmp(argv[0], "dag")) {
+		do_dag(argv);
+		return 1;
+	}
+	if (!strcmp(argv[0], "wait")) {
+		do_wait(argv);
+		return 1;
+	}
+	if (!strcmp(argv[0], "cache")) {
+		do_cache(argv);
+		return 1;
+	}
+	if (!standins)
+		return (0);
+	if (!strcmp(argv[0], "echo")) {
+		do_echo(argv);
+		return 1;
+	}
+	if (!strcmp(argv[0], "printf")) {
+		do_printf(argv);
+		return 1;
+	}
+	if (!strcmp(argv[0], "true") || !strcmp(argv[0], "false"))
+		return 1;
+	if (!strcmp(argv[0], "kill")) {
+		do_kill(argv);
+		return 1;
+	}
+	if (!strcmp(argv[0], "sleep")) {
+		do_sleep(argv);
+		return 1;
+	}
 
 	return (0);     // This is not a built-in command.
 }
@@ -535,13 +2298,13 @@ do_bgfg(char **argv)
 
 	JobP job;
 	if (is_jid) {
-		job = getjobjid(jobs, id);
+		job = getjobjid(&jobs, id);
 		if (job == NULL) {
 			printf("%%%d: No such job\n", id);
 			return;
 		}
 	} else {
-		job = getjobpid(jobs, (pid_t) id);
+		job = getjobpid(&jobs, (pid_t) id);
 		if (job == NULL) {
 			printf("%d: No such job\n", id);
 			return;
@@ -550,485 +2313,5395 @@ do_bgfg(char **argv)
 	
 	// Do the actual command
 	
-	kill(-job->pid, SIGCONT);
+	signaljob(&jobs, job, SIGCONT);
         if (!strcmp(argv[0], "bg")) {
-		job->state = BG;
-		printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+		setjobstate(&jobs, job, BG);
+		printf("[%d] (%d) %s", job->jid, job->pid,
+		    jobcmdline(&jobs, job));
 	} else if (!strcmp(argv[0], "fg")) {
-		job->state = FG;
-		waitfg(job->pid);
+		setjobstate(&jobs, job, FG);
+		waitfg(job->jid);
 	} else {
 		Sio_error("unknown bg/fg command");
 	}
 }
 
 /* 
- * waitfg - Block until process pid is no longer the foreground process.
+ * do_hash - Execute the built-in hash command.
  *
  * Requires:
- *   The pid of the job that the calling thread is to wait for.
+ *   "**argv" is an array of strings where the first string is "hash".
  *
  * Effects:
- *   Suspends the calling thread until the job corresponding to the pid
- *   is no longer running in the foreground.
+ *   With no arguments, lists the contents of the executable lookup cache.
+ *   With "-r", empties the cache.  Otherwise, looks up each argument in
+ *   the search path and remembers the result, printing an error for
+ *   each name that cannot be found.
  */
 static void
-waitfg(pid_t pid)
+do_hash(char **argv)
 {
-	while (1) {
-		sleep(1);
-		
-		JobP job = getjobpid(jobs, pid);
-		// if fg task doesn't exist or it isn't FG, stop waiting
-		if (job == NULL || job->state != FG) {
-			break;
+	char pathbuf[PATH_MAX];
+	int i;
+
+	if (argv[1] == NULL) {
+		if (path_cache_count == 0) {
+			printf("hash: hash table empty\n");
+			return;
+		}
+		printf("hits\tcommand\n");
+		for (i = 0; i < HASHSIZE; i++) {
+			struct PathEntry *entry = &path_cache[i];
+			if (entry->name == NULL)
+				continue;
+			if (entry->path != NULL)
+				printf("%4u\t%s\n", entry->hits, entry->path);
+			else
+				printf("%4u\t%s (not found)\n", entry->hits,
+				    entry->name);
+		}
+		return;
+	}
+	if (!strcmp(argv[1], "-r")) {
+		clearpathcache();
+		return;
+	}
+	for (i = 1; argv[i] != NULL; i++) {
+		if (strchr(argv[i], '/') != NULL) {
+			printf("hash: %s: not a command name\n", argv[i]);
+			continue;
 		}
+		if (lookupexe(argv[i], pathbuf) == NULL)
+			printf("hash: %s: not found\n", argv[i]);
 	}
 }
 
-/* 
- * initpath - Perform all necessary initialization of the search path,
- *  which may be simply saving the path.
+/*
+ * do_affinity - Execute the built-in affinity command.
  *
  * Requires:
- *   "pathstr" is a string of directories separated by the ":"
- *   character.
+ *   "**argv" is an array of strings where the first string is
+ *   "affinity".
  *
  * Effects:
- *   Parses the pathstr into the static search_path array.
+ *   With no arguments, prints the policy for placing background jobs and
+ *   the CPUs of each NUMA node that the shell may use.  Otherwise, sets
+ *   the policy for the background jobs launched from now on: "none" runs
+ *   them wherever the shell runs, "spread" and "compact" give each one a
+ *   CPU of its own, with memory on that CPU's node, taking a CPU from
+ *   each node in turn or filling one node before the next, and
+ *   "reserve-fg-core" keeps them off one CPU, left to foreground jobs.
  */
 static void
-initpath(const char *pathstr)
+do_affinity(char **argv)
 {
-	if (pathstr == NULL) {
-		search_path = NULL;
+	static const char *const names[] = {
+		[PLACE_NONE] = "none",
+		[PLACE_SPREAD] = "spread",
+		[PLACE_COMPACT] = "compact",
+		[PLACE_RESERVE] = "reserve-fg-core"
+	};
+	cpu_set_t cpus;
+	int cpu, node, policy;
+
+	readtopology();
+	if (argv[1] == NULL) {
+		printf("%s\n", names[place_policy]);
+		for (node = 0; node < CPU_SETSIZE; node++) {
+			if (!CPU_ISSET(node, &online_nodes))
+				continue;
+			CPU_ZERO(&cpus);
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &shell_cpus) &&
+				    cpu_node[cpu] == node)
+					CPU_SET(cpu, &cpus);
+			printf("node %d: cpus ", node);
+			printcpulist(stdout, &cpus);
+			printf("\n");
+		}
 		return;
 	}
+	for (policy = 0; policy <= PLACE_RESERVE; policy++)
+		if (!strcmp(argv[1], names[policy]))
+			break;
+	if (policy > PLACE_RESERVE || argv[2] != NULL) {
+		printf("affinity: usage: affinity "
+		    "[none | spread | compact | reserve-fg-core]\n");
+		return;
+	}
+	place_policy = policy;
+	ordercpus();
+}
 
-	// Calculate the number of paths to store, equals
-	// the number of colons in the string plus one,
-	// plus 1 for the current dir.
-	int num_paths = 2;
-	int i = 0;
-	while (pathstr[i] != '\0') {
-		if (pathstr[i] == ':') {
-			num_paths++;
+/*
+ * do_stats - Execute the built-in stats command.
+ *
+ * Requires:
+ *   "**argv" is an array of strings where the first string is "stats".
+ *
+ * Effects:
+ *   With no arguments, prints how long each phase of evaluating commands
+ *   and reaping their jobs has taken.  "stats on" and "stats off" start
+ *   and stop timing the phases, and "stats reset" forgets the times.
+ */
+static void
+do_stats(char **argv)
+{
+
+	if (argv[1] == NULL)
+		printstats();
+	else if (argv[2] == NULL && !strcmp(argv[1], "on"))
+		stats_enabled = true;
+	else if (argv[2] == NULL && !strcmp(argv[1], "off"))
+		stats_enabled = false;
+	else if (argv[2] == NULL && !strcmp(argv[1], "reset"))
+		memset(phase_hists, 0, sizeof(phase_hists));
+	else
+		printf("stats: usage: stats [on | off | reset]\n");
+}
+
+/*
+ * do_parallel - Execute the built-in parallel command.
+ *
+ * Requires:
+ *   "**argv" is an array of strings where the first string is
+ *   "parallel".
+ *
+ * Effects:
+ *   Runs a command once for each item, given after ":::" or read from
+ *   stdin one per line, with every "{}" in its arguments replaced by the
+ *   item or, if it has none, the item appended.  Stdin is only read if
+ *   it is redirected or a terminal, since otherwise it holds the rest of
+ *   the shell's own commands.  With "-X", each command
+ *   is given as many items as fit in ARG_MAX instead.  Keeps up to "-j"
+ *   commands running at once, by default one per CPU, as the processes of
+ *   a single foreground job, and starts the next as soon as one exits.
+ *   With "-k", buffers each command's output in a memory file and prints
+ *   it in the order of the items.  With "-s", prints the number of
+ *   commands run and their throughput.  Stops starting commands once one
+ *   is terminated by a signal or the job is stopped.  With a "cached"
+ *   prefix, a command found in the output cache is not run: its output
+ *   is replayed and it counts as having exited with the saved status.
+ */
+static void
+do_parallel(char **argv)
+{
+	struct Batch b = { .failed = 0 };
+	struct BatchCmd *cmd;
+	struct Stage stage;
+	struct timespec start, end;
+	char **tmpl, **items, *cmdline, *input = NULL, *end_item, *p;
+	char pathbuf[PATH_MAX];
+	const char *cachevars = NULL, *cachefiles = NULL;
+	size_t size, len, tmplsize, itemsize, limit;
+	int i, j, k, m, ntmpl, nitems, next, printed, njobs = 0;
+	bool keep = false, pack = false, summary = false, braces = false;
+	bool cached = false;
+	double secs;
+	long n;
+	JobP job;
+
+	for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-j") && argv[i + 1] != NULL) {
+			n = strtol(argv[++i], &p, 10);
+			njobs = p == argv[i] || *p != '\0' || n < 0 ||
+			    n > INT_MAX ? -1 : (int)n;
+		} else if (!strcmp(argv[i], "-k"))
+			keep = true;
+		else if (!strcmp(argv[i], "-s"))
+			summary = true;
+		else if (!strcmp(argv[i], "-X"))
+			pack = true;
+		else
+			break;
+	}
+	tmpl = &argv[i];
+	// A "cached" prefix applies to each of the commands.
+	if (tmpl[0] != NULL && !strcmp(tmpl[0], "cached")) {
+		cached = true;
+		j = 0;
+		if (!parsecached(tmpl, &j, &cachevars, &cachefiles))
+			return;
+		tmpl += j;
+	}
+	for (ntmpl = 0; tmpl[ntmpl] != NULL && strcmp(tmpl[ntmpl], ":::");
+	    ntmpl++)
+		if (strstr(tmpl[ntmpl], "{}") != NULL)
+			braces = true;
+	if (ntmpl == 0 || (argv[i] != NULL && argv[i][0] == '-') ||
+	    njobs < 0) {
+		printf("parallel: usage: parallel [-j jobs] [-k] [-s] [-X] "
+		    "[cached] command [arg ...] [::: item ...]\n");
+		return;
+	}
+	if (njobs == 0 && (njobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		njobs = 1;
+
+	// Take the items from the command line or else from stdin.
+	if (tmpl[ntmpl] != NULL) {
+		items = &tmpl[ntmpl + 1];
+		for (nitems = 0; items[nitems] != NULL; nitems++)
+			continue;
+	} else if (!stdin_redirected && !isatty(STDIN_FILENO)) {
+		printf("parallel: Items must follow ::: or be redirected "
+		    "to stdin\n");
+		return;
+	} else {
+		if ((input = readall(STDIN_FILENO, &len)) == NULL) {
+			printf("parallel: stdin: %s\n", strerror(errno));
+			return;
+		}
+		input[len] = '\n';
+		for (nitems = 0, p = input; p < input + len; p = end_item + 1) {
+			end_item = memchr(p, '\n', input + len + 1 - p);
+			nitems += end_item > p;
+		}
+		items = arena_alloc(&cmd_arena, nitems * sizeof(*items));
+		for (nitems = 0, p = input; p < input + len; p = end_item + 1) {
+			end_item = memchr(p, '\n', input + len + 1 - p);
+			*end_item = '\0';
+			if (end_item > p)
+				items[nitems++] = p;
 		}
-		i++;
 	}
-	// Allocate the path array
-	if ((search_path = malloc(sizeof(char*) * (num_paths + 1))) == NULL) {
-		Sio_error("Failed getting path");
+
+	/*
+	 * When packing, leave the same 2048 bytes of headroom below ARG_MAX
+	 * as xargs, after the environment and the fixed arguments.
+	 */
+	limit = max_cmdline > 2048 ? max_cmdline - 2048 : 0;
+	for (i = 0; environ[i] != NULL; i++)
+		limit -= limit > strlen(environ[i]) + 1 + sizeof(char *) ?
+		    strlen(environ[i]) + 1 + sizeof(char *) : limit;
+	for (tmplsize = sizeof(char *), i = 0; i < ntmpl; i++)
+		if (strstr(tmpl[i], "{}") == NULL)
+			tmplsize += strlen(tmpl[i]) + 1 + sizeof(char *);
+
+	// The job is named by the whole command line.
+	cmdline = joinargs(argv);
+
+	if (!beginbatch(&b, &stage, nitems, njobs))
+		nitems = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (next = printed = 0; true; ) {
+		while (!b.halt && b.nrunning < njobs && next < nitems) {
+			// Choose the items and lay out the arguments.
+			itemsize = 0;
+			for (k = next; k < nitems && (k == next || pack); k++) {
+				size = itemsize;
+				for (i = 0; i < ntmpl; i++)
+					if (strstr(tmpl[i], "{}") != NULL)
+						size += bracesize(tmpl[i],
+						    items[k]);
+				if (!braces)
+					size += strlen(items[k]) + 1 +
+					    sizeof(char *);
+				if (k > next && tmplsize + size > limit)
+					break;
+				itemsize = size;
+			}
+			arena_reset(&batch_arena);
+			stage.argv = arena_alloc(&batch_arena,
+			    (ntmpl + (k - next) * (ntmpl + 1) + 1) *
+			    sizeof(char *));
+			for (j = i = 0; i < ntmpl; i++) {
+				if (strstr(tmpl[i], "{}") == NULL) {
+					stage.argv[j++] = tmpl[i];
+					continue;
+				}
+				for (m = next; m < k; m++)
+					stage.argv[j++] = substbraces(tmpl[i],
+					    items[m]);
+			}
+			if (!braces)
+				for (m = next; m < k; m++)
+					stage.argv[j++] = items[m];
+			stage.argv[j] = NULL;
+			next = k;
+
+			cmd = &b.cmds[b.ncmds];
+			cmd->done = false;
+			cmd->out = -1;
+			if ((stage.executable = lookupexe(stage.argv[0],
+			    pathbuf)) == NULL) {
+				printf("%s: Command not found\n",
+				    stage.argv[0]);
+				b.failed++;
+				continue;
+			}
+			if (keep && (cmd->out = memfd_create("tsh-parallel",
+			    MFD_CLOEXEC)) < 0) {
+				printf("parallel: %s\n", strerror(errno));
+				b.halt = true;
+				break;
+			}
+			stage.fds[STDOUT_FILENO] = cmd->out;
+			stage.cache = NULL;
+			if (cached && batchcached(&b, &stage, cachevars,
+			    cachefiles)) {
+				b.ncmds++;
+				continue;
+			}
+			if (!launchbatch(&b, &stage, cmdline)) {
+				if (cmd->out >= 0)
+					close(cmd->out);
+				b.halt = true;
+				break;
+			}
+			b.ncmds++;
+		}
+		if (keep)
+			printed = printbatch(&b, printed);
+		if (b.nrunning == 0)
+			break;
+		if ((job = getjobjid(&jobs, b.jid)) != NULL &&
+		    job->state == ST) {
+			b.halt = true;
+			break;
+		}
+		waitchange(-1);
 	}
-        
-	// Put current directory at beginning so we search this first
-	char *path_cwd;
-	if ((path_cwd = malloc(sizeof(char) * PATH_MAX)) == NULL) {
-		Sio_error("Failed getting path");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	batch = NULL;
+
+	// The output of commands left stopped is lost.
+	for (i = printed; i < b.ncmds; i++)
+		if (b.cmds[i].out >= 0)
+			close(b.cmds[i].out);
+	if (stage.fds[STDIN_FILENO] >= 0)
+		close(stage.fds[STDIN_FILENO]);
+	if (summary) {
+		secs = (end.tv_sec - start.tv_sec) +
+		    (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("parallel: %d commands, %d failed, %d not run, "
+		    "%.3f s, %.1f commands/s\n", b.ncmds, b.failed,
+		    nitems - next, secs,
+		    secs > 0 ? b.ncmds / secs : 0.0);
 	}
-	if (getcwd(path_cwd, sizeof(char) * PATH_MAX) == NULL) {
-		Sio_error("Failed getting path");
+	free(b.running);
+	free(b.cmds);
+	free(input);
+}
+
+/*
+ * Requires:
+ *   "argv" is a NULL terminated array of strings.
+ *
+ * Effects:
+ *   Returns the strings joined by spaces and followed by a newline, like
+ *   a command line, allocated from cmd_arena.
+ */
+static char *
+joinargs(char **argv)
+{
+	size_t len, size;
+	char *line, *p;
+	int i;
+
+	for (size = 2, i = 0; argv[i] != NULL; i++)
+		size += strlen(argv[i]) + 1;
+	line = arena_alloc(&cmd_arena, size);
+	for (p = line, i = 0; argv[i] != NULL; i++) {
+		len = strlen(argv[i]);
+		memcpy(p, argv[i], len);
+		p += len;
+		*p++ = argv[i + 1] != NULL ? ' ' : '\n';
 	}
-	search_path[0] = path_cwd;
-	// Copy the paths into search_path
-	int cur_pos = 0;
-	for (i = 1; i < num_paths; i++) {
-		int len = 0;
-		while (pathstr[cur_pos + len] != ':' && 
-		       pathstr[cur_pos + len] != '\0') {
-			len++;
+	*p = '\0';
+	return (line);
+}
+
+/*
+ * Requires:
+ *   "fd" is a descriptor open for reading and "lenp" points to a size_t.
+ *
+ * Effects:
+ *   Reads everything up to the end of "fd" into a new buffer, with at
+ *   least one byte to spare at the end, stores the number of bytes read
+ *   in "*lenp" and returns the buffer, which the caller must free.
+ *   Returns NULL with errno set if reading fails.
+ */
+static char *
+readall(int fd, size_t *lenp)
+{
+	size_t len = 0, size = 0;
+	char *buf = NULL;
+	ssize_t n;
+	int error;
+
+	while (true) {
+		if (len + 1 >= size) {
+			size = size == 0 ? INPUTSIZE : size * 2;
+			if ((buf = realloc(buf, size)) == NULL)
+				Sio_error("Failed allocating memory");
 		}
-		char *path;
-		if (len == 0) {
-			if ((path = malloc(sizeof(char) * PATH_MAX)) == NULL) {
-				Sio_error("Failed getting path");
+		if ((n = read(fd, buf + len, size - len - 1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			error = errno;
+			free(buf);
+			errno = error;
+			return (NULL);
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	*lenp = len;
+	return (buf);
+}
+
+/*
+ * Requires:
+ *   "arg" is an argument of a parallel command's template that holds
+ *   "{}", and "item" is an item.
+ *
+ * Effects:
+ *   Returns the space that "arg" with every "{}" replaced by "item" takes
+ *   up in a program's arguments, including its pointer.
+ */
+static size_t
+bracesize(const char *arg, const char *item)
+{
+	size_t size = strlen(arg) + 1 + sizeof(char *);
+	size_t itemlen = strlen(item);
+
+	for (; (arg = strstr(arg, "{}")) != NULL; arg += 2)
+		size += itemlen - 2;
+	return (size);
+}
+
+/*
+ * Requires:
+ *   "arg" is an argument of a parallel command's template, and "item" is
+ *   an item.
+ *
+ * Effects:
+ *   Returns a copy of "arg", allocated from batch_arena, with every "{}"
+ *   replaced by "item".
+ */
+static char *
+substbraces(const char *arg, const char *item)
+{
+	size_t itemlen = strlen(item);
+	const char *brace;
+	char *copy, *p;
+
+	p = copy = arena_alloc(&batch_arena, bracesize(arg, item));
+	while ((brace = strstr(arg, "{}")) != NULL) {
+		memcpy(p, arg, brace - arg);
+		p += brace - arg;
+		memcpy(p, item, itemlen);
+		p += itemlen;
+		arg = brace + 2;
+	}
+	strcpy(p, arg);
+	return (copy);
+}
+
+/*
+ * Requires:
+ *   "b" is a new batch of at most "maxcmds" commands, of which up to
+ *   "njobs" run at once, and "stage" is to hold each command in turn.
+ *
+ * Effects:
+ *   Allocates the batch's arrays, sets up the stage with /dev/null as
+ *   its stdin and the shell's stdout and stderr, and makes the batch the
+ *   running one.  Returns true on success.  Otherwise, prints an error
+ *   message and returns false, and no command may be started.
+ */
+static bool
+beginbatch(struct Batch *b, struct Stage *stage, int maxcmds, int njobs)
+{
+	int i;
+
+	b->cmds = malloc((maxcmds > 0 ? maxcmds : 1) * sizeof(*b->cmds));
+	b->running = malloc(njobs * sizeof(*b->running));
+	if (b->cmds == NULL || b->running == NULL)
+		Sio_error("Failed allocating memory");
+	for (i = 0; i < 3; i++)
+		stage->fds[i] = -1;
+	stage->nredirs = 0;
+	stage->place = NULL;
+	stage->limits = NULL;
+	stage->cache = NULL;
+
+	// Write out anything buffered before the commands can print.
+	fflush(stdout);
+	batch = b;
+	// The commands share the terminal, so none may read from it.
+	if ((stage->fds[STDIN_FILENO] = open("/dev/null",
+	    O_RDONLY | O_CLOEXEC)) < 0) {
+		printf("/dev/null: %s\n", strerror(errno));
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "b" is the running batch, whose next command is "stage", and
+ *   "cmdline" names the batch's job.
+ *
+ * Effects:
+ *   Creates the command's process in the batch's job, or in a new
+ *   foreground job if the batch has none, which is the case when every
+ *   earlier command has exited.  Returns true on success.  Otherwise,
+ *   prints an error message and returns false.
+ */
+static bool
+launchbatch(struct Batch *b, const struct Stage *stage, const char *cmdline)
+{
+	sigset_t mask, prev;
+	pid_t pid, pgid = 0;
+	JobP job;
+
+	/*
+	 * While the job has a process that has not been reaped, its process
+	 * group exists, so keep any from being reaped until the new one has
+	 * joined it, and keep the handlers out while the job is changed.
+	 */
+	sigfillset(&mask);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	applyqueued();
+	if ((job = getjobjid(&jobs, b->jid)) != NULL)
+		pgid = job->pid;
+	if ((pid = launchjob(stage, pgid, &job_mask)) > 0) {
+		if (job != NULL)
+			addproc(&jobs, job, pid);
+		else if (addjob(&jobs, &pid, 1, FG, cmdline))
+			b->jid = getjobpid(&jobs, pid)->jid;
+		else {
+			kill(pid, SIGKILL);
+			pid = -1;
+		}
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	if (pid < 0)
+		return (false);
+	b->cmds[b->ncmds].pid = pid;
+	b->running[b->nrunning++] = b->ncmds;
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "pid" is a process of the running batch's job and "stat_loc" is the
+ *   status with which it exited or was terminated.
+ *
+ * Effects:
+ *   Records that the batch's command has finished, so that its slot can
+ *   be reused, and stops the batch if the command was terminated by a
+ *   signal.
+ */
+static void
+batchexited(pid_t pid, int stat_loc)
+{
+	struct BatchCmd *cmd;
+	int i;
+
+	for (i = 0; i < batch->nrunning; i++) {
+		cmd = &batch->cmds[batch->running[i]];
+		if (cmd->pid != pid)
+			continue;
+		cmd->done = true;
+		cmd->status = stat_loc;
+		if (!WIFEXITED(stat_loc) || WEXITSTATUS(stat_loc) != 0)
+			batch->failed++;
+		if (WIFSIGNALED(stat_loc))
+			batch->halt = true;
+		batch->running[i] = batch->running[--batch->nrunning];
+		return;
+	}
+}
+
+/*
+ * Requires:
+ *   "b" is a batch whose commands' output is buffered, of which the first
+ *   "printed" have been printed.
+ *
+ * Effects:
+ *   Prints, in order, the output of the commands that have finished,
+ *   up to the first that has not, and returns how many have now been
+ *   printed.
+ */
+static int
+printbatch(struct Batch *b, int printed)
+{
+	struct BatchCmd *cmd;
+	ssize_t n;
+
+	fflush(stdout);
+	for (; printed < b->ncmds && b->cmds[printed].done; printed++) {
+		cmd = &b->cmds[printed];
+		lseek(cmd->out, 0, SEEK_SET);
+		while ((n = sendfile(STDOUT_FILENO, cmd->out, NULL,
+		    INPUTSIZE)) > 0)
+			continue;
+		close(cmd->out);
+		cmd->out = -1;
+	}
+	return (printed);
+}
+
+/*
+ * do_dag - Execute the built-in dag command.
+ *
+ * Requires:
+ *   "**argv" is an array of strings where the first string is "dag".
+ *
+ * Effects:
+ *   Reads a graph of named commands from the file named by the argument
+ *   or, if there is none, from stdin, which must be redirected or a
+ *   terminal, since otherwise it holds the rest of the shell's own
+ *   commands.  Runs each command once every node that it depends on has
+ *   finished successfully.  Keeps up to "-j" commands running at once,
+ *   by default one per CPU, as the processes of a single foreground job,
+ *   and starts the nodes that become ready as soon as a command exits.
+ *   The nodes that depend on one that fails are skipped.  Prints the
+ *   critical path, the chain of nodes that each waited on the last, with
+ *   the time that each took, unless "-q" is given.  Stops starting
+ *   commands once one is terminated by a signal or the job is stopped.
+ *   A command with a "cached" prefix that is found in the output cache
+ *   is not run: its output is replayed and the node succeeds or fails by
+ *   the saved exit status.
+ *
+ *   The graph is given as in a makefile: a line "name: dep ..." defines
+ *   a node and the nodes it depends on, and an optional line that begins
+ *   with a tab gives its command.  Blank lines and lines that begin with
+ *   '#' are ignored.
+ */
+static void
+do_dag(char **argv)
+{
+	struct Batch b = { .failed = 0 };
+	struct DagNode *nodes, *node;
+	struct Stage stage;
+	struct timespec start;
+	char *cmdline, *spec, *end, pathbuf[PATH_MAX];
+	const char *cachevars, *cachefiles;
+	size_t len;
+	int i, j, fd, nnodes, nready, nrun, *ready, *run, next, njobs = 0;
+	int counts[NODE_SKIPPED + 1] = { 0 };
+	bool quiet = false;
+	double now;
+	long n;
+	JobP job;
+
+	for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-j") && argv[i + 1] != NULL) {
+			n = strtol(argv[++i], &end, 10);
+			njobs = end == argv[i] || *end != '\0' || n < 0 ||
+			    n > INT_MAX ? -1 : (int)n;
+		} else if (!strcmp(argv[i], "-q"))
+			quiet = true;
+		else
+			break;
+	}
+	if ((argv[i] != NULL && (argv[i][0] == '-' || argv[i + 1] != NULL)) ||
+	    njobs < 0) {
+		printf("dag: usage: dag [-j jobs] [-q] [file]\n");
+		return;
+	}
+	if (njobs == 0 && (njobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		njobs = 1;
+
+	if (argv[i] == NULL && !stdin_redirected && !isatty(STDIN_FILENO)) {
+		printf("dag: The graph must be in a file or redirected to "
+		    "stdin\n");
+		return;
+	} else if (argv[i] == NULL)
+		fd = STDIN_FILENO;
+	else if ((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) < 0) {
+		printf("%s: %s\n", argv[i], strerror(errno));
+		return;
+	}
+	spec = readall(fd, &len);
+	if (spec == NULL)
+		printf("%s: %s\n", argv[i] != NULL ? argv[i] : "dag: stdin",
+		    strerror(errno));
+	if (fd != STDIN_FILENO)
+		close(fd);
+	if (spec == NULL)
+		return;
+	spec[len] = '\n';
+	if ((nodes = parsedag(spec, len, &nnodes)) == NULL) {
+		free(spec);
+		return;
+	}
+
+	cmdline = joinargs(argv);
+	ready = arena_alloc(&cmd_arena, (nnodes + 1) * sizeof(*ready));
+	run = arena_alloc(&cmd_arena, njobs * sizeof(*run));
+
+	// The nodes with no dependencies are ready at once, in order.
+	for (nready = i = 0; i < nnodes; i++)
+		if (nodes[i].waiting == 0)
+			ready[nready++] = i;
+
+	if (!beginbatch(&b, &stage, nnodes, njobs))
+		b.halt = true;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (next = nrun = 0; true; ) {
+		while (!b.halt && nrun < njobs && next < nready) {
+			node = &nodes[ready[next++]];
+			node->start = now = secondssince(&start);
+			if (node->argv == NULL) {
+				// A node without a command only gathers others.
+				finishnode(nodes, node - nodes, true, now,
+				    ready, &nready);
+				continue;
 			}
-			if (getcwd(path, sizeof(char) * PATH_MAX) == NULL) {
-				Sio_error("Failed getting path");
+			stage.cache = NULL;
+			cachevars = cachefiles = NULL;
+			j = 0;
+			if (!strcmp(node->argv[0], "cached") &&
+			    (!parsecached(node->argv, &j, &cachevars,
+			    &cachefiles) || node->argv[j] == NULL)) {
+				if (node->argv[j] == NULL)
+					printf("cached requires a command\n");
+				finishnode(nodes, node - nodes, false, now,
+				    ready, &nready);
+				continue;
 			}
-		} else {
-			if ((path = malloc(sizeof(char) * (len + 1))) == NULL) {
-				Sio_error("Failed getting path");
+			stage.argv = &node->argv[j];
+			if ((stage.executable = lookupexe(stage.argv[0],
+			    pathbuf)) == NULL) {
+				printf("%s: Command not found\n",
+				    stage.argv[0]);
+				finishnode(nodes, node - nodes, false, now,
+				    ready, &nready);
+				continue;
+			}
+			b.cmds[b.ncmds].done = false;
+			b.cmds[b.ncmds].out = -1;
+			if (j > 0) {
+				arena_reset(&batch_arena);
+				if (batchcached(&b, &stage, cachevars,
+				    cachefiles)) {
+					node->cmd = b.ncmds++;
+					finishnode(nodes, node - nodes,
+					    WEXITSTATUS(b.cmds[node->cmd].
+					    status) == 0, now, ready, &nready);
+					continue;
+				}
 			}
-			int z;
-			for (z = 0; z < len; z++) {
-				path[z] = pathstr[cur_pos + z];
+			if (!launchbatch(&b, &stage, cmdline)) {
+				b.halt = true;
+				break;
 			}
-			path[z + 1] = '\0';
+			node->cmd = b.ncmds++;
+			node->state = NODE_RUNNING;
+			run[nrun++] = node - nodes;
+		}
+		if (nrun == 0)
+			break;
+		if ((job = getjobjid(&jobs, b.jid)) != NULL &&
+		    job->state == ST) {
+			b.halt = true;
+			break;
+		}
+		waitchange(-1);
+
+		// Let the nodes that depend on those that finished go ahead.
+		now = secondssince(&start);
+		for (j = 0; j < nrun; ) {
+			node = &nodes[run[j]];
+			if (!b.cmds[node->cmd].done) {
+				j++;
+				continue;
+			}
+			run[j] = run[--nrun];
+			finishnode(nodes, node - nodes,
+			    WIFEXITED(b.cmds[node->cmd].status) &&
+			    WEXITSTATUS(b.cmds[node->cmd].status) == 0, now,
+			    ready, &nready);
 		}
-		search_path[i] = path;
-		cur_pos += len + 1;
 	}
-	search_path[num_paths] = NULL;
+	now = secondssince(&start);
+	batch = NULL;
+	if (stage.fds[STDIN_FILENO] >= 0)
+		close(stage.fds[STDIN_FILENO]);
+
+	if (!quiet) {
+		for (j = -1, i = 0; i < nnodes; i++) {
+			counts[nodes[i].state]++;
+			if ((nodes[i].state == NODE_DONE ||
+			    nodes[i].state == NODE_FAILED) &&
+			    (j < 0 || nodes[i].end > nodes[j].end))
+				j = i;
+		}
+		printf("dag: %d done, %d failed, %d skipped, %d not run, "
+		    "%.3f s\n", counts[NODE_DONE], counts[NODE_FAILED],
+		    counts[NODE_SKIPPED],
+		    counts[NODE_WAITING] + counts[NODE_RUNNING], now);
+		// Follow the critical path back from the node that ended last.
+		for (len = 0; j >= 0; j = nodes[j].gate)
+			ready[len++] = j;
+		if (len > 0)
+			printf("dag: critical path:");
+		while (len-- > 0) {
+			node = &nodes[ready[len]];
+			printf(" %s %.3f s%s", node->name,
+			    node->end - node->start, len > 0 ? " ->" : "\n");
+		}
+	}
+	free(b.running);
+	free(b.cmds);
+	free(spec);
+}
+
+/*
+ * Requires:
+ *   "spec" points to the "len" bytes of a dag builtin's graph, followed
+ *   by a '\n', and "nnodesp" points to an int.
+ *
+ * Effects:
+ *   Parses the graph in place and returns its nodes, allocated from
+ *   cmd_arena, with each one's dependencies resolved, and stores their
+ *   number in "*nnodesp".  Returns NULL and prints an error message if
+ *   the graph is malformed, names a node that is not defined, or has a
+ *   cycle.
+ */
+static struct DagNode *
+parsedag(char *spec, size_t len, int *nnodesp)
+{
+	struct DagNode *nodes, *node = NULL, **sorted, key, *keyp = &key;
+	struct DagNode **found;
+	char *p, *eol, *colon, *name;
+	int i, j, k, bg, lineno, nlines, nnodes, nready, *ready;
+
+	for (nlines = 1, p = spec; (p = memchr(p, '\n', spec + len - p)) !=
+	    NULL; p++)
+		nlines++;
+	nodes = arena_alloc(&cmd_arena, nlines * sizeof(*nodes));
+	nnodes = lineno = 0;
+	for (p = spec; p < spec + len; p = eol + 1) {
+		eol = memchr(p, '\n', spec + len + 1 - p);
+		*eol = '\0';
+		lineno++;
+		if (*p == '\t') {
+			// The command of the node defined just before.
+			while (*p == ' ' || *p == '\t')
+				p++;
+			if ((bg = tokenize(p, eol - p, &dag_tokens)) < 0) {
+				printf("Failed allocating memory\n");
+				return (NULL);
+			}
+			if (dag_tokens.argc == 0)
+				continue;
+			if (node == NULL || node->argv != NULL || bg) {
+				printf("dag: line %d: %s\n", lineno, bg ?
+				    "A command cannot run in the background" :
+				    "Command does not follow a node");
+				return (NULL);
+			}
+			node->argv = arena_alloc(&cmd_arena,
+			    (dag_tokens.argc + 1) * sizeof(char *));
+			memcpy(node->argv, dag_tokens.argv,
+			    (dag_tokens.argc + 1) * sizeof(char *));
+			continue;
+		}
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0' || *p == '#')
+			continue;
+		if ((colon = strchr(p, ':')) == NULL) {
+			printf("dag: line %d: Missing ':'\n", lineno);
+			return (NULL);
+		}
+		for (name = colon; name > p && (name[-1] == ' ' ||
+		    name[-1] == '\t'); name--)
+			continue;
+		*name = '\0';
+		if (*p == '\0') {
+			printf("dag: line %d: Missing name\n", lineno);
+			return (NULL);
+		}
+		node = &nodes[nnodes++];
+		node->name = p;
+		node->argv = NULL;
+		node->nsuccs = node->waiting = 0;
+		node->state = NODE_WAITING;
+		node->gate = -1;
+
+		// Split the dependencies where they lie.
+		node->ndeps = 0;
+		for (p = colon + 1; *p != '\0'; ) {
+			while (*p == ' ' || *p == '\t')
+				p++;
+			if (*p != '\0')
+				node->ndeps++;
+			while (*p != '\0' && *p != ' ' && *p != '\t')
+				p++;
+		}
+		node->deps = arena_alloc(&cmd_arena,
+		    node->ndeps * sizeof(*node->deps));
+		for (i = 0, p = colon + 1; i < node->ndeps; i++) {
+			while (*p == ' ' || *p == '\t')
+				p++;
+			node->deps[i] = p;
+			while (*p != '\0' && *p != ' ' && *p != '\t')
+				p++;
+			*p++ = '\0';
+		}
+	}
+
+	// Find the nodes by name with a sorted index.
+	sorted = arena_alloc(&cmd_arena, nnodes * sizeof(*sorted));
+	for (i = 0; i < nnodes; i++)
+		sorted[i] = &nodes[i];
+	qsort(sorted, nnodes, sizeof(*sorted), dagcmp);
+	for (i = 1; i < nnodes; i++)
+		if (!strcmp(sorted[i - 1]->name, sorted[i]->name)) {
+			printf("dag: %s: Defined twice\n", sorted[i]->name);
+			return (NULL);
+		}
+	// Count each node's successors, then record them.
+	for (k = 0; k < 2; k++) {
+		for (i = 0; i < nnodes; i++) {
+			for (j = 0; j < nodes[i].ndeps; j++) {
+				key.name = nodes[i].deps[j];
+				if ((found = bsearch(&keyp, sorted, nnodes,
+				    sizeof(*sorted), dagcmp)) == NULL) {
+					printf("dag: %s: No such node\n",
+					    key.name);
+					return (NULL);
+				}
+				node = *found;
+				if (k == 1)
+					node->succs[node->nsuccs] = i;
+				node->nsuccs++;
+			}
+			nodes[i].waiting = nodes[i].ndeps;
+		}
+		for (i = 0; k == 0 && i < nnodes; i++) {
+			nodes[i].succs = arena_alloc(&cmd_arena,
+			    nodes[i].nsuccs * sizeof(*nodes[i].succs));
+			nodes[i].nsuccs = 0;
+		}
+	}
+
+	/*
+	 * Look for a cycle by taking out the nodes in an order in which each
+	 * follows its dependencies.  Any that are left are part of a cycle
+	 * or depend on one.
+	 */
+	ready = arena_alloc(&cmd_arena, (nnodes + 1) * sizeof(*ready));
+	for (nready = i = 0; i < nnodes; i++)
+		if (nodes[i].waiting == 0)
+			ready[nready++] = i;
+	for (i = 0; i < nready; i++) {
+		node = &nodes[ready[i]];
+		for (j = 0; j < node->nsuccs; j++)
+			if (--nodes[node->succs[j]].waiting == 0)
+				ready[nready++] = node->succs[j];
+	}
+	for (i = 0; i < nnodes; i++) {
+		if (nodes[i].waiting > 0) {
+			printf("dag: %s: Dependency cycle\n", nodes[i].name);
+			return (NULL);
+		}
+		nodes[i].waiting = nodes[i].ndeps;
+	}
+	*nnodesp = nnodes;
+	return (nodes);
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to pointers to nodes of a dag builtin's graph.
+ *
+ * Effects:
+ *   Compares the nodes by name, for qsort() and bsearch().
+ */
+static int
+dagcmp(const void *a, const void *b)
+{
+
+	return (strcmp((*(struct DagNode *const *)a)->name,
+	    (*(struct DagNode *const *)b)->name));
+}
+
+/*
+ * Requires:
+ *   "nodes" is the graph of the dag builtin, in which node "i" has just
+ *   finished, successfully if "ok" is true, at "now" seconds.  "ready"
+ *   holds the "*nreadyp" nodes that have been ready so far and has room
+ *   for all of them.
+ *
+ * Effects:
+ *   Records the node's result.  If it succeeded, adds each node that
+ *   depends on it and now has no dependencies left to "ready", with this
+ *   node as the one that it waited on last.  Otherwise, skips every node
+ *   that depends on it, directly or not.
+ */
+static void
+finishnode(struct DagNode *nodes, int i, bool ok, double now, int *ready,
+    int *nreadyp)
+{
+	struct DagNode *node = &nodes[i], *succ;
+	int j;
+
+	node->end = now;
+	node->state = ok ? NODE_DONE : NODE_FAILED;
+	for (j = 0; j < node->nsuccs; j++) {
+		succ = &nodes[node->succs[j]];
+		if (succ->state != NODE_WAITING)
+			continue;
+		if (!ok) {
+			// Skip it, and in turn the nodes that depend on it.
+			succ->start = now;
+			finishnode(nodes, node->succs[j], false, now, ready,
+			    nreadyp);
+			succ->state = NODE_SKIPPED;
+		} else if (--succ->waiting == 0) {
+			succ->gate = i;
+			ready[(*nreadyp)++] = node->succs[j];
+		}
+	}
+}
+
+/*
+ * do_echo - Execute the built-in echo command.
+ *
+ * Requires:
+ *   "**argv" is an array of strings where the first string is "echo".
+ *
+ * Effects:
+ *   Prints the remaining arguments separated by spaces and followed by a
+ *   newline, like /bin/echo.  Leading arguments made up of the options
+ *   "-n", which leaves out the newline, "-e", which interprets
+ *   backslash escapes, and "-E", which does not, are taken as options.
+ */
+static void
+do_echo(char **argv)
+{
+	bool escapes = false, newline = true;
+	char *opt;
+	int i;
+
+	for (i = 1; argv[i] != NULL && argv[i][0] == '-' &&
+	    argv[i][1] != '\0' && argv[i][strspn(argv[i] + 1, "neE") + 1] ==
+	    '\0'; i++)
+		for (opt = argv[i] + 1; *opt != '\0'; opt++) {
+			if (*opt == 'n')
+				newline = false;
+			else
+				escapes = *opt == 'e';
+		}
+	for (; argv[i] != NULL; i++) {
+		if (!escapes)
+			fputs(argv[i], stdout);
+		else if (!printescaped(argv[i], true)) {
+			newline = false;  // "\c" ends the output.
+			break;
+		}
+		if (argv[i + 1] != NULL)
+			putchar(' ');
+	}
+	if (newline)
+		putchar('\n');
+	// Appear before anything that a job prints next.
+	fflush(stdout);
+}
+
+/*
+ * do_printf - Execute the built-in printf command.
+ *
+ * Requires:
+ *   "**argv" is an array of strings where the first string is "printf".
+ *
+ * Effects:
+ *   Prints the remaining arguments under the control of the format given
+ *   by the second, like /usr/bin/printf.  The format may contain
+ *   backslash escapes and the conversions %d, %i, %o, %u, %x, %X, %f,
+ *   %e, %E, %g, %G, %c, %s and %b, with flags, a field width and a
+ *   precision.  The format is reused until the arguments run out, and
+ *   missing arguments are taken as empty or zero.
+ */
+static void
+do_printf(char **argv)
+{
+	char spec[32], **args, *end;
+	const char *arg, *bad = NULL, *p, *q;
+	bool used;
+	int c;
+
+	if (argv[1] == NULL) {
+		printf("printf: usage: printf format [arguments]\n");
+		return;
+	}
+	args = &argv[2];
+	do {
+		used = false;
+		for (p = argv[1]; *p != '\0'; p++) {
+			if (*p == '\\') {
+				p = escape(p + 1, &c, false) - 1;
+				if (c < 0)
+					goto done;
+				putchar(c);
+				continue;
+			}
+			if (*p != '%') {
+				putchar(*p);
+				continue;
+			}
+			if (p[1] == '%') {
+				putchar('%');
+				p++;
+				continue;
+			}
+
+			// Copy the flags, width and precision into spec.
+			q = p + 1 + strspn(p + 1, "-+ #0");
+			q += strspn(q, "0123456789");
+			if (*q == '.')
+				q += 1 + strspn(q + 1, "0123456789");
+			if (*q == '\0' || strchr("diouxXfeEgGcsb", *q) == NULL ||
+			    q - p > (ptrdiff_t)sizeof(spec) - 4) {
+				printf("printf: %.*s: invalid conversion\n",
+				    (int)(q - p + (*q != '\0')), p);
+				goto done;
+			}
+			memcpy(spec, p, q - p);
+			spec[q - p] = '\0';
+			if ((arg = *args) != NULL) {
+				args++;
+				used = true;
+			}
+			switch (*q) {
+			case 'd':
+			case 'i':
+				strcat(spec, "lld");
+				spec[strlen(spec) - 1] = *q;
+				printf(spec, arg == NULL ? 0LL :
+				    strtoll(arg, &end, 0));
+				break;
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				strcat(spec, "ll?");
+				spec[strlen(spec) - 1] = *q;
+				printf(spec, arg == NULL ? 0ULL :
+				    strtoull(arg, &end, 0));
+				break;
+			case 'c':
+				strcat(spec, "c");
+				printf(spec, arg == NULL ? '\0' : arg[0]);
+				break;
+			case 's':
+				strcat(spec, "s");
+				printf(spec, arg == NULL ? "" : arg);
+				break;
+			case 'b':
+				if (arg != NULL && !printescaped(arg, true))
+					goto done;
+				break;
+			default:
+				strcat(spec, "?");
+				spec[strlen(spec) - 1] = *q;
+				printf(spec, arg == NULL ? 0.0 :
+				    strtod(arg, &end));
+			}
+			// Like bash, print what was converted and complain later.
+			if (arg != NULL && strchr("diouxXfeEgG", *q) != NULL &&
+			    (end == arg || *end != '\0') && bad == NULL)
+				bad = arg;
+			p = q;
+		}
+	} while (used && *args != NULL);
+done:
+	if (bad != NULL)
+		printf("printf: %s: invalid number\n", bad);
+	// Appear before anything that a job prints next.
+	fflush(stdout);
+}
+
+/*
+ * Requires:
+ *   "s" points just past a backslash and "cp" points to an int.
+ *
+ * Effects:
+ *   Decodes the escape sequence at "s", stores the byte that it stands
+ *   for in "*cp", or -1 for "\c", and returns a pointer past the
+ *   sequence.  Octal escapes are "\0NNN" if "echo" is true and "\NNN"
+ *   otherwise.  An unknown sequence stands for the backslash itself, and
+ *   what follows it is not consumed.
+ */
+static const char *
+escape(const char *s, int *cp, bool echo)
+{
+	static const char from[] = "\\abefnrtv", to[] = "\\\a\b\033\f\n\r\t\v";
+	const char *p;
+	int c, n;
+
+	if (*s == 'c') {
+		*cp = -1;
+		return (s + 1);
+	}
+	if (*s != '\0' && (p = strchr(from, *s)) != NULL) {
+		*cp = to[p - from];
+		return (s + 1);
+	}
+	if (*s == 'x' && isxdigit((unsigned char)s[1])) {
+		for (c = 0, n = 0, s++; n < 2 && isxdigit((unsigned char)*s);
+		    n++, s++)
+			c = c * 16 + (isdigit((unsigned char)*s) ? *s - '0' :
+			    tolower((unsigned char)*s) - 'a' + 10);
+		*cp = c;
+		return (s);
+	}
+	if (echo ? *s == '0' : (*s >= '0' && *s <= '7')) {
+		if (echo)
+			s++;
+		for (c = 0, n = 0; n < 3 && *s >= '0' && *s <= '7'; n++, s++)
+			c = c * 8 + *s - '0';
+		*cp = c & 0xff;
+		return (s);
+	}
+	*cp = '\\';
+	return (s);
+}
+
+/*
+ * Requires:
+ *   "s" is a properly terminated string.
+ *
+ * Effects:
+ *   Prints "s" with its backslash escapes decoded, with octal escapes
+ *   written as for echo if "echo" is true and as for printf otherwise.
+ *   Returns false if it stopped at "\c", and true otherwise.
+ */
+static bool
+printescaped(const char *s, bool echo)
+{
+	int c;
+
+	while (*s != '\0') {
+		if (*s != '\\') {
+			putchar(*s++);
+			continue;
+		}
+		s = escape(s + 1, &c, echo);
+		if (c < 0)
+			return (false);
+		putchar(c);
+	}
+	return (true);
+}
+
+/*
+ * do_kill - Execute the built-in kill command.
+ *
+ * Requires:
+ *   "**argv" is an array of strings where the first string is "kill".
+ *
+ * Effects:
+ *   Sends a signal, SIGTERM unless the first argument names another as
+ *   "-s NAME", "-NAME" or "-NUMBER", to each process named by a PID and
+ *   to each job named by "%jid".  A name may be given with or without
+ *   its "SIG" prefix.  A job that is sent SIGCONT is marked as running.
+ *   With "-l", lists the names of the signals instead, or translates
+ *   between the name and number of the signal given.  Prints an error
+ *   for each argument that cannot be signaled.
+ */
+static void
+do_kill(char **argv)
+{
+	char *end;
+	JobP job;
+	long id;
+	int i = 1, sig = SIGTERM;
+
+	if (argv[1] != NULL && !strcmp(argv[1], "-l")) {
+		if (argv[2] == NULL) {
+			for (i = 1; i < NSIG && signame[i] != NULL &&
+			    strchr(signame[i], ' ') == NULL; i++) {
+				printf("%s%s", i % 8 == 1 ? "" : " ",
+				    signame[i]);
+				if (i % 8 == 0)
+					printf("\n");
+			}
+			if ((i - 1) % 8 != 0)
+				printf("\n");
+		} else if ((sig = signum(argv[2])) < 0 ||
+		    signame[sig] == NULL)
+			printf("kill: %s: invalid signal specification\n",
+			    argv[2]);
+		else if (isdigit((unsigned char)argv[2][0]))
+			printf("%s\n", signame[sig]);
+		else
+			printf("%d\n", sig);
+		return;
+	}
+	if (argv[1] != NULL && !strcmp(argv[1], "-s")) {
+		if (argv[2] == NULL || (sig = signum(argv[2])) < 0) {
+			printf("kill: %s: invalid signal specification\n",
+			    argv[2] != NULL ? argv[2] : "");
+			return;
+		}
+		i = 3;
+	} else if (argv[1] != NULL && argv[1][0] == '-') {
+		if ((sig = signum(argv[1] + 1)) < 0) {
+			printf("kill: %s: invalid signal specification\n",
+			    argv[1] + 1);
+			return;
+		}
+		i = 2;
+	}
+	if (argv[i] == NULL) {
+		printf("kill: usage: kill [-s sigspec | -sigspec] pid | "
+		    "%%jobid ... or kill -l [sigspec]\n");
+		return;
+	}
+
+	for (; argv[i] != NULL; i++) {
+		id = strtol(argv[i] + (argv[i][0] == '%'), &end, 10);
+		if (end == argv[i] + (argv[i][0] == '%') || *end != '\0' ||
+		    id <= 0 || id > INT_MAX) {
+			printf("kill: %s: arguments must be process or job "
+			    "IDs\n", argv[i]);
+			continue;
+		}
+		if (argv[i][0] == '%') {
+			if ((job = getjobjid(&jobs, (int)id)) == NULL) {
+				printf("kill: %s: No such job\n", argv[i]);
+				continue;
+			}
+			signaljob(&jobs, job, sig);
+		} else {
+			if (kill((pid_t)id, sig) < 0) {
+				printf("kill: (%ld) - %s\n", id,
+				    strerror(errno));
+				continue;
+			}
+			job = getjobpid(&jobs, (pid_t)id);
+		}
+		if (job != NULL && sig == SIGCONT && job->state == ST)
+			setjobstate(&jobs, job, BG);
+	}
+}
+
+/*
+ * Requires:
+ *   "name" is a properly terminated string.
+ *
+ * Effects:
+ *   Returns the number of the signal named by "name", which is either a
+ *   number or a name from signame[] with or without a "SIG" prefix, in
+ *   any case.  Returns -1 if there is no such signal.
+ */
+static int
+signum(const char *name)
+{
+	char *end;
+	long n;
+	int sig;
+
+	if (isdigit((unsigned char)name[0])) {
+		n = strtol(name, &end, 10);
+		return (*end == '\0' && n < NSIG ? (int)n : -1);
+	}
+	if (strncasecmp(name, "SIG", 3) == 0)
+		name += 3;
+	for (sig = 1; sig < NSIG && signame[sig] != NULL; sig++)
+		if (strchr(signame[sig], ' ') == NULL &&
+		    strcasecmp(name, signame[sig]) == 0)
+			return (sig);
+	return (-1);
+}
+
+/*
+ * do_sleep - Execute the built-in sleep command.
+ *
+ * Requires:
+ *   "**argv" is an array of strings where the first string is "sleep".
+ *
+ * Effects:
+ *   Waits for the sum of the arguments, each a number of seconds that may
+ *   have a fraction and a suffix of "s", "m" for minutes, "h" for hours
+ *   or "d" for days, like /bin/sleep.  Reports and reaps jobs that
+ *   change state meanwhile, and stops early if the shell receives a
+ *   SIGINT.
+ */
+static void
+do_sleep(char **argv)
+{
+	static const char units[] = "smhd";
+	static const double scale[] = { 1, 60, 3600, 86400 };
+	struct timespec start;
+	double left, secs = 0, n;
+	char *end;
+	int i;
+
+	if (argv[1] == NULL) {
+		printf("sleep: missing operand\n");
+		return;
+	}
+	for (i = 1; argv[i] != NULL; i++) {
+		n = strtod(argv[i], &end);
+		if (*end != '\0' && end[1] == '\0' &&
+		    strchr(units, *end) != NULL)
+			n *= scale[strchr(units, *end++) - units];
+		// This also rejects NaN and infinity.
+		if (end == argv[i] || *end != '\0' || !(n >= 0 && n < 1e9)) {
+			printf("sleep: invalid time interval '%s'\n", argv[i]);
+			return;
+		}
+		secs += n;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// Show what has been printed before the notifications to come.
+	fflush(stdout);
+	interrupted = 0;
+	if (signal_fd < 0)
+		applyqueued();
+	while (!interrupted && (left = secs - secondssince(&start)) > 0)
+		waitchange(left < 1e6 ? (int)(left * 1000) + 1 : 1000000000);
+}
+
+/*
+ * do_wait - Execute the built-in wait command.
+ *
+ * Requires:
+ *   "**argv" is an array of strings where the first string is "wait".
+ *
+ * Effects:
+ *   Waits until each job given by a PID or "%jid" has finished or
+ *   stopped or, with no arguments, until no job is running in the
+ *   background.  Reports and reaps jobs that change state meanwhile,
+ *   and stops early if the shell receives a SIGINT.  Prints an error
+ *   for each argument that is not a job.
+ */
+static void
+do_wait(char **argv)
+{
+	char *end;
+	JobP job;
+	long id;
+	int i, jid;
+
+	// Show what has been printed before the notifications to come.
+	fflush(stdout);
+	interrupted = 0;
+	if (signal_fd < 0)
+		applyqueued();
+	if (argv[1] == NULL) {
+		while (!interrupted && bgrunning())
+			waitchange(-1);
+		return;
+	}
+	for (i = 1; argv[i] != NULL && !interrupted; i++) {
+		id = strtol(argv[i] + (argv[i][0] == '%'), &end, 10);
+		job = NULL;
+		if (end != argv[i] + (argv[i][0] == '%') && *end == '\0' &&
+		    id > 0 && id <= INT_MAX)
+			job = argv[i][0] == '%' ? getjobjid(&jobs, (int)id) :
+			    getjobpid(&jobs, (pid_t)id);
+		if (job == NULL) {
+			printf("wait: %s: No such job\n", argv[i]);
+			continue;
+		}
+		// The job's ID is not reused while the shell waits.
+		jid = job->jid;
+		while (!interrupted && (job = getjobjid(&jobs, jid)) != NULL &&
+		    job->state == BG)
+			waitchange(-1);
+	}
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns true if any job is running in the background.
+ */
+static bool
+bgrunning(void)
+{
+	JobP job;
+	int jid;
+
+	for (jid = 1; jid <= jobs.maxjid; jid++)
+		if ((job = getjobjid(&jobs, jid)) != NULL && job->state == BG)
+			return (true);
+	return (false);
+}
+
+/*
+ * do_cache - Execute the built-in cache command.
+ *
+ * Requires:
+ *   "**argv" is an array of strings where the first string is "cache".
+ *
+ * Effects:
+ *   With no arguments, prints the directory of the output cache, the
+ *   number of entries and bytes that it holds out of its size, and how
+ *   many commands have been replayed from it or run to fill it.  "-d
+ *   DIR" moves the cache to DIR.  "-s SIZE" sets its size in bytes, with
+ *   an optional suffix of K, M or G, and removes entries to fit.  "-r"
+ *   removes every entry.
+ */
+static void
+do_cache(char **argv)
+{
+	struct CacheUse *uses;
+	unsigned long long total, value;
+	char *end, path[PATH_MAX];
+	int i, n, shift;
+
+	cachedir(false);
+	if (argv[1] == NULL) {
+		if ((n = scancache(&uses, &total)) < 0) {
+			n = 0;
+			total = 0;
+		} else
+			free(uses);
+		printf("%s: %d entries, %llu of %llu bytes, %u hits, "
+		    "%u misses\n", cache_dir, n, total, cache_size,
+		    cache_hits, cache_misses);
+		return;
+	}
+	for (i = 1; argv[i] != NULL; i++) {
+		if (!strcmp(argv[i], "-r")) {
+			if ((n = scancache(&uses, &total)) < 0)
+				continue;
+			while (n-- > 0) {
+				snprintf(path, sizeof(path), "%s/%s",
+				    cache_dir, uses[n].name);
+				unlink(path);
+			}
+			free(uses);
+		} else if (!strcmp(argv[i], "-d") && argv[i + 1] != NULL) {
+			free(cache_dir);
+			if ((cache_dir = strdup(argv[++i])) == NULL)
+				Sio_error("Failed allocating memory");
+		} else if (!strcmp(argv[i], "-s") && argv[i + 1] != NULL) {
+			errno = 0;
+			value = strtoull(argv[++i], &end, 10);
+			shift = *end == 'K' ? 10 : *end == 'M' ? 20 :
+			    *end == 'G' ? 30 : 0;
+			if (shift != 0)
+				end++;
+			if (errno != 0 || end == argv[i] || *end != '\0' ||
+			    value > ULLONG_MAX >> shift) {
+				printf("cache: %s: Invalid size\n", argv[i]);
+				return;
+			}
+			cache_size = value << shift;
+			evictcache();
+		} else {
+			printf("cache: usage: cache [-r] [-d dir] [-s size]\n");
+			return;
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   "start" is a time read from CLOCK_MONOTONIC.
+ *
+ * Effects:
+ *   Returns the number of seconds since "start".
+ */
+static double
+secondssince(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/* 
+ * waitfg - Block until job jid is no longer the foreground job.
+ *
+ * Requires:
+ *   The job ID of the job that the calling thread is to wait for.  The
+ *   job is named by its ID rather than by its PID because the process
+ *   whose PID names a pipeline may be reaped before the others.
+ *
+ * Effects:
+ *   Suspends the calling thread until the job corresponding to the jid
+ *   is no longer running in the foreground.
+ */
+static void
+waitfg(int jid)
+{
+	JobP job;
+
+	if (signal_fd < 0)
+		applyqueued();
+	// if fg task doesn't exist or it isn't FG, stop waiting
+	while ((job = getjobjid(&jobs, jid)) != NULL && job->state == FG)
+		waitchange(-1);
+}
+
+/*
+ * waitchange - Block until a child changes state.
+ *
+ * Requires:
+ *   Any change that has already happened has been applied.
+ *
+ * Effects:
+ *   Waits for a change in the state of a child, such as a job exiting,
+ *   and applies it to the jobs list.  Gives up after "timeout"
+ *   milliseconds unless "timeout" is negative.  May also return early,
+ *   for example when input arrives or the shell is interrupted.
+ */
+static void
+waitchange(int timeout)
+{
+	struct pollfd bell = { .fd = chld_event_fd, .events = POLLIN };
+	uint64_t count;
+
+	if (signal_fd >= 0) {
+		waitevents(timeout);
+		return;
+	}
+
+	/*
+	 * A change queued after applyqueued() has looked at the queue also
+	 * signals the eventfd, so poll() cannot sleep through it.
+	 */
+	if (poll(&bell, 1, timeout) > 0 &&
+	    read(chld_event_fd, &count, sizeof(count)) < 0 &&
+	    errno != EAGAIN)
+		unix_error("read error");
+	applyqueued();
+}
+
+/*
+ * initevents - Start reading SIGCHLD, SIGINT and SIGTSTP from a signalfd
+ *  instead of handling them asynchronously.
+ *
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Blocks the signals, creates signal_fd and an epoll instance that
+ *   watches it, the inotify watching search_path and, if possible,
+ *   stdin.  Regular files, which epoll refuses, never block, so they
+ *   need not be watched.
+ */
+static void
+initevents(void)
+{
+	struct epoll_event event;
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTSTP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		unix_error("signalfd error");
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		unix_error("epoll_create1 error");
+	event.events = EPOLLIN;
+	event.data.fd = signal_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) < 0)
+		unix_error("epoll_ctl error");
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.fd = STDIN_FILENO;
+	stdin_polled = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO,
+	    &event) == 0;
+	event.events = EPOLLIN;
+	event.data.fd = path_watch_fd;
+	path_polled = path_watch_fd >= 0 && epoll_ctl(epoll_fd,
+	    EPOLL_CTL_ADD, path_watch_fd, &event) == 0;
+
+	/*
+	 * If the kernel supports pidfds, each job's pidfd is added to the
+	 * epoll set, and a job that exits is reaped on its own.  SIGCHLD is
+	 * then only needed to learn of jobs that stop.
+	 */
+	int pidfd;
+	if ((pidfd = pidfd_open(getpid(), 0)) >= 0) {
+		pidfd_reaping = true;
+		close(pidfd);
+	}
+}
+
+/*
+ * waitevents - Wait for a signal or for input.
+ *
+ * Requires:
+ *   initevents() has been called.
+ *
+ * Effects:
+ *   Blocks until a signal arrives, a job exits, or stdin becomes
+ *   readable, or for at most "timeout" milliseconds if "timeout" is not
+ *   negative.  Handles any signals, reaps any jobs that exited, reads any
+ *   changes to the directories in search_path, and sets stdin_ready if
+ *   stdin is readable.  Ends a session whose client has hung up.
+ *   Because stdin is watched with EPOLLONESHOT, it is not reported again
+ *   until it is next read, so waiting for a foreground job never spins
+ *   on input that is typed ahead.
+ */
+static void
+waitevents(int timeout)
+{
+	struct epoll_event events[16];
+	int avail, i, n;
+
+	if ((n = epoll_wait(epoll_fd, events, 16, timeout)) < 0) {
+		if (errno == EINTR)
+			return;
+		unix_error("epoll_wait error");
+	}
+	for (i = 0; i < n; i++) {
+		if (events[i].data.fd == signal_fd)
+			dispatchsignals();
+		else if (events[i].data.fd == STDIN_FILENO) {
+			/*
+			 * A client that has closed its connection with
+			 * nothing left to read has hung up, even if a
+			 * foreground job is still running.
+			 */
+			if (in_session && (events[i].events & EPOLLHUP) != 0 &&
+			    ioctl(STDIN_FILENO, FIONREAD, &avail) == 0 &&
+			    avail == 0)
+				quitshell();
+			stdin_ready = true;
+		} else if (path_polled && events[i].data.fd == path_watch_fd) {
+			if (readpathevents())
+				path_stale = true;
+		} else
+			reappidfd(events[i].data.fd);
+	}
+}
+
+/*
+ * dispatchsignals - Handle the signals that are pending on signal_fd.
+ *
+ * Requires:
+ *   initevents() has been called.
+ *
+ * Effects:
+ *   Reads every pending signal from signal_fd without blocking and calls
+ *   the corresponding handler.  Any number of pending SIGCHLDs result in
+ *   a single call to sigchld_handler(), which reaps every child that
+ *   has changed state, or, when exited jobs are found through their
+ *   pidfds, to reapstopped().
+ */
+static void
+dispatchsignals(void)
+{
+	struct signalfd_siginfo info[16];
+	bool child = false;
+	ssize_t n;
+	int i;
+
+	while ((n = read(signal_fd, info, sizeof(info))) > 0) {
+		for (i = 0; i < n / (ssize_t)sizeof(info[0]); i++) {
+			switch (info[i].ssi_signo) {
+			case SIGCHLD:
+				child = true;
+				break;
+			case SIGINT:
+				sigint_handler(SIGINT);
+				break;
+			case SIGTSTP:
+				sigtstp_handler(SIGTSTP);
+				break;
+			}
+		}
+	}
+	if (child && pidfd_reaping)
+		reapstopped();
+	else if (child) {
+		sigchld_handler(SIGCHLD);
+		applyqueued();
+	}
+}
+
+/* 
+ * initpath - Perform all necessary initialization of the search path,
+ *  which may be simply saving the path.
+ *
+ * Requires:
+ *   "pathstr" is a string of directories separated by the ":"
+ *   character.
+ *
+ * Effects:
+ *   Parses the pathstr into the static search_path array.
+ */
+static void
+initpath(const char *pathstr)
+{
+	if (pathstr == NULL) {
+		search_path = NULL;
+		return;
+	}
+
+	// Calculate the number of paths to store, equals
+	// the number of colons in the string plus one,
+	// plus 1 for the current dir.
+	int num_paths = 2;
+	int i = 0;
+	while (pathstr[i] != '\0') {
+		if (pathstr[i] == ':') {
+			num_paths++;
+		}
+		i++;
+	}
+	// Allocate the path array
+	search_path = arena_alloc(&path_arena, sizeof(char*) * (num_paths + 1));
+        
+	// Put current directory at beginning so we search this first
+	char path_cwd[PATH_MAX];
+	if (getcwd(path_cwd, sizeof(path_cwd)) == NULL) {
+		Sio_error("Failed getting path");
+	}
+	search_path[0] = arena_strndup(&path_arena, path_cwd,
+	    strlen(path_cwd));
+	// Copy the paths into search_path
+	int cur_pos = 0;
+	for (i = 1; i < num_paths; i++) {
+		int len = 0;
+		while (pathstr[cur_pos + len] != ':' && 
+		       pathstr[cur_pos + len] != '\0') {
+			len++;
+		}
+		// An empty path is the current directory, which we already
+		// have a copy of.
+		if (len == 0) {
+			search_path[i] = search_path[0];
+		} else {
+			search_path[i] = arena_strndup(&path_arena,
+			    &pathstr[cur_pos], len);
+		}
+		cur_pos += len + 1;
+	}
+	search_path[num_paths] = NULL;
+
+	watchpath();
+}
+
+/*
+ * The signal handlers follow.
+ */
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *  a child job terminates (becomes a zombie), or stops because it
+ *  received a SIGSTOP or SIGTSTP signal.  The handler reaps all
+ *  available zombie children, but doesn't wait for any other
+ *  currently running children to terminate.  
+ *
+ * Requires:
+ *   An integer corresponding to the type of signal.
+ *
+ * Effects:
+ *   Reaps all of the zombie children, and the stopped ones, and queues
+ *   their changes of state, with the resources that they used, for
+ *   applyqueued().
+ */
+static void
+sigchld_handler(int signum)
+{
+	(void)signum;
+        int olderrno = errno;
+	struct ChildEvent *event;
+	unsigned int tail;
+	uint64_t one = 1;
+	struct rusage usage;
+	pid_t pid;
+	int stat_loc;
+
+	tail = atomic_load_explicit(&chld_queue.tail, memory_order_relaxed);
+	while (true) {
+		if (tail - atomic_load_explicit(&chld_queue.head,
+		    memory_order_acquire) == CHLDQSIZE) {
+			atomic_store(&chld_queue.full, true);
+			break;
+		}
+		if ((pid = wait4(-1, &stat_loc, WNOHANG | WUNTRACED, &usage)) <=
+		    0)
+			break;
+		event = &chld_queue.events[tail % CHLDQSIZE];
+		event->pid = pid;
+		event->stat_loc = stat_loc;
+		event->usage = usage;
+		// Publish the event only once it is complete.
+		atomic_store_explicit(&chld_queue.tail, ++tail,
+		    memory_order_release);
+	}
+	if (chld_event_fd >= 0)
+		(void)write(chld_event_fd, &one, sizeof(one));
+
+	errno = olderrno;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenever the
+ *  user types ctrl-c at the keyboard.  Catch it and send it along
+ *  to the foreground job.  
+ *
+ * Requires:
+ *   An integer corresponding to the type of signal.
+ *
+ * Effects:
+ *   Terminates each process in the foregound by sending a SIGINT signal 
+ *   and then displays information about the job that was terminated. 
+ *   If there is no foreground job, interrupts a built-in command that
+ *   is waiting, such as sleep or wait.
+ */
+static void
+sigint_handler(int signum)
+{
+        JobP job = fgjob(&jobs);
+	uint64_t one = 1;
+
+	if (job == NULL) {
+		interrupted = 1;
+		if (chld_event_fd >= 0)
+			(void)write(chld_event_fd, &one, sizeof(one));
+		return;
+	}
+	// send signal to every process in the job's process group
+	signaljob(&jobs, job, signum);
+	tracesignal(signum, job->pid);
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *  the user types ctrl-z at the keyboard.  Catch it and suspend the
+ *  foreground job by sending it a SIGTSTP.  
+ *
+ * Requires:
+ *   An integer corresponding to the type of signal.
+ *
+ * Effects:
+ *   Places each process in the foreground in the stopped state by sending 
+ *   a SIGSTP signal.
+ */
+static void
+sigtstp_handler(int signum)
+{
+	JobP job = fgjob(&jobs);
+	if (job == NULL) {
+		return;
+	}
+	// send signal to every process in the job's process group
+	signaljob(&jobs, job, signum);
+	tracesignal(signum, job->pid);
+}
+
+/*
+ * sigquit_handler - The driver program can gracefully terminate the
+ *  child shell by sending it a SIGQUIT signal.
+ *
+ * Requires:
+ *   "signum" is SIGQUIT.
+ *
+ * Effects:
+ *   Terminates the program.
+ */
+static void
+sigquit_handler(int signum)
+{
+
+	// Prevent an "unused parameter" warning.
+	(void)signum;
+	Sio_puts("Terminating after receipt of SIGQUIT signal\n");
+	// Leave the trace file as long as the events in it.
+	if (trace_fd >= 0)
+		ftruncate(trace_fd, trace_len);
+	_exit(1);
+}
+
+/*
+ * This comment marks the end of the signal handlers.
+ */
+
+/*
+ * The following helper routines track changes in the state of jobs.
+ */
+
+/*
+ * Requires:
+ *   "stat_loc" is a status returned by waitpid() for the child "pid",
+ *   and "usage" points to the resources that it used, if it exited.
+ *
+ * Effects:
+ *   Reports a job that stopped or was terminated by a signal and updates
+ *   the jobs list to match.  A job stops when any of its processes does,
+ *   is reported as terminated if the last process in its pipeline was,
+ *   and is deleted once all of its processes have been reaped.  The
+ *   resources used by its processes are added up as they are reaped,
+ *   and are reported when it is deleted if it was timed or the shell was
+ *   started with -r.  Children that are not jobs, such as the zygote, are
+ *   ignored.
+ */
+static void
+notifyjob(pid_t pid, int stat_loc, const struct rusage *usage)
+{
+	ProcP proc;
+	JobP job;
+	int h;
+
+	if ((h = findpid(&jobs, pid)) < 0)
+		return;
+	proc = &jobs.procs[jobs.pidindex[h]];
+	job = &jobs.slots[proc->job];
+	// If a job is stopped, we print it and stop it
+	if (WIFSTOPPED(stat_loc)) {
+		if (job->state == ST)
+			return;
+		Sio_puts("Job [");
+		Sio_putl((long) job->jid);
+		Sio_puts("] (");
+		Sio_putl((long) job->pid);
+		Sio_puts(") stopped by signal SIG");
+		Sio_puts(signame[WSTOPSIG(stat_loc)]);
+		Sio_puts("\n");
+		setjobstate(&jobs, job, ST);
+	} else {
+		// If the job was terminated by signal
+		if (WIFSIGNALED(stat_loc) && proc->next == EMPTY) {
+			Sio_puts("Job [");
+			Sio_putl((long) job->jid);
+			Sio_puts("] (");
+			Sio_putl((long) job->pid);
+			Sio_puts(") terminated by signal SIG");
+			Sio_puts(signame[WTERMSIG(stat_loc)]);
+			Sio_puts("\n");
+		}
+		if (batch != NULL && job->jid == batch->jid)
+			batchexited(pid, stat_loc);
+		if (usage != NULL)
+			addrusage((struct Usage *)&job->usage, usage);
+		// Delete task once its whole pipeline has been reaped
+		if (job->live > 1)
+			deleteproc(&jobs, h);
+		else {
+			if (job->timed || report_usage)
+				reportjob(job);
+			deletejob(&jobs, pid);
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   "info" was filled in by waitid().
+ *
+ * Effects:
+ *   Returns the status that waitpid() would have reported for the same
+ *   change in state of a child.
+ */
+static int
+infostatus(const siginfo_t *info)
+{
+
+	switch (info->si_code) {
+	case CLD_EXITED:
+		return (W_EXITCODE(info->si_status, 0));
+	case CLD_STOPPED:
+	case CLD_TRAPPED:
+		return (W_STOPCODE(info->si_status));
+	case CLD_DUMPED:
+		return (info->si_status | WCOREFLAG);
+	default:
+		return (info->si_status);
+	}
+}
+
+/*
+ * Requires:
+ *   "pidfd" was reported readable by epoll, which means that the job's
+ *   process has exited.
+ *
+ * Effects:
+ *   Reaps that one process, leaving every other child alone.
+ */
+static void
+reappidfd(int pidfd)
+{
+	struct timespec phase;
+	struct rusage usage;
+	siginfo_t info;
+
+	phasebegin(&phase);
+	// Unlike the library's, the system call reports the usage too.
+	info.si_pid = 0;
+	if (syscall(SYS_waitid, P_PIDFD, pidfd, &info, WEXITED | WNOHANG,
+	    &usage) == 0 && info.si_pid != 0) {
+		notifyjob(info.si_pid, infostatus(&info), &usage);
+		phasemark(PHASE_REAP, &phase);
+		tracephases(info.si_pid);
+	}
+}
+
+/*
+ * Requires:
+ *   Exited jobs are reaped through their pidfds.
+ *
+ * Effects:
+ *   Reports every child that has stopped, without reaping any child that
+ *   has exited, which is left to reappidfd().  Also reaps the zygote, the
+ *   only child without a pidfd, if it has exited.
+ */
+static void
+reapstopped(void)
+{
+	struct timespec phase;
+	siginfo_t info;
+
+	while (true) {
+		phasebegin(&phase);
+		info.si_pid = 0;
+		if (waitid(P_ALL, 0, &info, WSTOPPED | WNOHANG) < 0 ||
+		    info.si_pid == 0)
+			break;
+		notifyjob(info.si_pid, infostatus(&info), NULL);
+		phasemark(PHASE_REAP, &phase);
+		tracephases(info.si_pid);
+	}
+	if (zygote_pid > 0 && waitpid(zygote_pid, NULL, WNOHANG) == zygote_pid)
+		zygote_pid = 0;
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Applies, oldest first, every change of state that sigchld_handler()
+ *   has queued.  If the handler left children unreaped because the queue
+ *   was full, raises SIGCHLD so that it reaps them, and applies those
+ *   changes too if the handler runs at once.
+ */
+static void
+applyqueued(void)
+{
+	struct ChildEvent event;
+	struct timespec phase;
+	unsigned int head;
+
+	head = atomic_load_explicit(&chld_queue.head, memory_order_relaxed);
+	do {
+		while (head != atomic_load_explicit(&chld_queue.tail,
+		    memory_order_acquire)) {
+			event = chld_queue.events[head % CHLDQSIZE];
+			// Hand the entry back before acting on the event.
+			atomic_store_explicit(&chld_queue.head, ++head,
+			    memory_order_release);
+			phasebegin(&phase);
+			notifyjob(event.pid, event.stat_loc, &event.usage);
+			phasemark(PHASE_REAP, &phase);
+			tracephases(event.pid);
+		}
+	} while (atomic_exchange(&chld_queue.full, false) &&
+	    raise(SIGCHLD) == 0);
+}
+
+/*
+ * Requires:
+ *   "job" points to a job in the jobs list.
+ *
+ * Effects:
+ *   Sends "sig" to every process in the job's process group.  There is
+ *   no pidfd equivalent of kill() for a process group, so the pidfds of
+ *   the job's processes are used to check that at least one of them has
+ *   not been reaped.  As long as one has not, the group's ID cannot have
+ *   been reused, however many processes have come and gone since.  This
+ *   function can be safely called by a signal handler.
+ */
+static void
+signaljob(JobTableP jobs, JobP job, int sig)
+{
+	ProcP proc;
+	int i;
+
+	for (i = job->procs; i != EMPTY; i = proc->next) {
+		proc = &jobs->procs[i];
+		if (proc->pid != 0 && (proc->pidfd < 0 ||
+		    pidfd_send_signal(proc->pidfd, 0, NULL, 0) == 0)) {
+			kill(-job->pid, sig);
+			return;
+		}
+	}
+}
+
+/*
+ * This comment marks the end of the job state routines.
+ */
+
+/*
+ * The following helper routines manipulate the jobs list.
+ */
+
+/*
+ * Requires:
+ *   "job" points to a job structure.
+ *
+ * Effects:
+ *   Clears the fields in the referenced job structure.
+ */
+static void
+clearjob(JobP job)
+{
+
+	job->pid = 0;
+	job->jid = 0;
+	job->state = UNDEF;
+	job->procs = EMPTY;
+	job->live = 0;
+	job->cmdline = EMPTY;
+	job->cpulist = EMPTY;
+	job->cpu = -1;
+	job->node = -1;
+	job->timed = false;
+	memset((void *)&job->usage, 0, sizeof(job->usage));
+}
+
+/*
+ * Requires:
+ *   "proc" points to the record of a process that has not been reaped.
+ *
+ * Effects:
+ *   Opens a pidfd for the process and, if exited jobs are found through
+ *   their pidfds, adds it to the epoll set.  If no pidfd can be opened,
+ *   falls back to finding exited jobs with waitpid().
+ */
+static void
+openpidfd(ProcP proc)
+{
+	struct epoll_event event;
+
+	if ((proc->pidfd = pidfd_open(proc->pid, 0)) < 0) {
+		pidfd_reaping = false;
+		return;
+	}
+	if (pidfd_reaping) {
+		event.events = EPOLLIN;
+		event.data.fd = proc->pidfd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, proc->pidfd, &event) <
+		    0)
+			pidfd_reaping = false;
+	}
+}
+
+/*
+ * Requires:
+ *   "ptr" is NULL or was returned by an earlier call, and "size" is
+ *   nonzero.
+ *
+ * Effects:
+ *   Resizes the memory at "ptr" like realloc(), but terminates the
+ *   program if memory is exhausted.  The caller blocks every signal.
+ */
+static void *
+growtable(volatile void *ptr, size_t size)
+{
+	void *p;
+
+	if ((p = realloc((void *)ptr, size)) == NULL)
+		Sio_error("Failed allocating memory");
+	return (p);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and "pid" is positive.
+ *
+ * Effects:
+ *   Returns the index in "jobs->pidindex" where the search for "pid"
+ *   begins.
+ */
+static unsigned int
+pidhash(JobTableP jobs, pid_t pid)
+{
+
+	// Fibonacci hashing: keep the well-mixed high bits of the product.
+	return (((unsigned int)pid * 2654435769u) >> (32 - jobs->pidbits));
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and "proc" to a process record in it
+ *   that is not yet in the PID index.
+ *
+ * Effects:
+ *   Adds the record to the PID index, reusing the first entry of a
+ *   deleted PID on the way.
+ */
+static void
+insertpid(JobTableP jobs, int proc)
+{
+	unsigned int h, mask = (1u << jobs->pidbits) - 1;
+
+	for (h = pidhash(jobs, jobs->procs[proc].pid);
+	    jobs->pidindex[h] >= 0; h = (h + 1) & mask)
+		continue;
+	if (jobs->pidindex[h] == EMPTY)
+		jobs->pidused++;
+	jobs->pidindex[h] = proc;
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list.
+ *
+ * Effects:
+ *   Returns the index in "jobs->pidindex" of the entry for "pid", or -1
+ *   if no job has an unreaped process with that PID.
+ */
+static int
+findpid(JobTableP jobs, pid_t pid)
+{
+	unsigned int h, mask = (1u << jobs->pidbits) - 1;
+	int proc;
+
+	if (pid < 1)
+		return (-1);
+	for (h = pidhash(jobs, pid); (proc = jobs->pidindex[h]) != EMPTY;
+	    h = (h + 1) & mask)
+		if (proc >= 0 && jobs->procs[proc].pid == pid)
+			return (h);
+	return (-1);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and every signal is blocked.
+ *
+ * Effects:
+ *   Rebuilds the PID index with room for at least twice the number of
+ *   processes not yet reaped and "extra" more, which also discards the
+ *   entries of deleted PIDs.
+ */
+static void
+rehashpids(JobTableP jobs, int extra)
+{
+	int bits = jobs->pidbits, i, n = extra;
+
+	for (i = 0; i < jobs->nprocs; i++)
+		if (jobs->procs[i].pid != 0)
+			n++;
+	while ((1 << bits) < 2 * (n + 1))
+		bits++;
+	jobs->pidbits = bits;
+	jobs->pidindex = growtable(jobs->pidindex,
+	    sizeof(*jobs->pidindex) << bits);
+	for (i = 0; i < 1 << bits; i++)
+		jobs->pidindex[i] = EMPTY;
+	jobs->pidused = 0;
+	for (i = 0; i < jobs->nprocs; i++)
+		if (jobs->procs[i].pid != 0)
+			insertpid(jobs, i);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and every signal is blocked.
+ *
+ * Effects:
+ *   Doubles the number of job records and pushes the new ones onto the
+ *   stack of free records, lowest index on top.
+ */
+static void
+growslots(JobTableP jobs)
+{
+	int i, n = jobs->nslots == 0 ? MAXJOBS : jobs->nslots * 2;
+
+	jobs->slots = growtable(jobs->slots, n * sizeof(*jobs->slots));
+	jobs->freeslots = growtable(jobs->freeslots,
+	    n * sizeof(*jobs->freeslots));
+	for (i = n - 1; i >= jobs->nslots; i--) {
+		clearjob(&jobs->slots[i]);
+		jobs->freeslots[jobs->nfree++] = i;
+	}
+	jobs->nslots = n;
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and every signal is blocked.
+ *
+ * Effects:
+ *   Grows the process records, by at least doubling them, until at least
+ *   "n" of them are unused, and pushes the new ones onto the stack of
+ *   free records, lowest index on top.
+ */
+static void
+growprocs(JobTableP jobs, int n)
+{
+	int i, size = jobs->nprocs == 0 ? MAXJOBS : jobs->nprocs * 2;
+
+	while (size - jobs->nprocs + jobs->nfreeprocs < n)
+		size *= 2;
+	jobs->procs = growtable(jobs->procs, size * sizeof(*jobs->procs));
+	jobs->freeprocs = growtable(jobs->freeprocs,
+	    size * sizeof(*jobs->freeprocs));
+	for (i = size - 1; i >= jobs->nprocs; i--) {
+		jobs->procs[i].pid = 0;
+		jobs->procs[i].pidfd = -1;
+		jobs->freeprocs[jobs->nfreeprocs++] = i;
+	}
+	jobs->nprocs = size;
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and every signal is blocked.
+ *
+ * Effects:
+ *   Grows the job ID index so that it covers job IDs up to "jid".
+ */
+static void
+growjids(JobTableP jobs, int jid)
+{
+	int i, n = jobs->jidcap == 0 ? MAXJOBS : jobs->jidcap;
+
+	while (n <= jid)
+		n *= 2;
+	jobs->jidindex = growtable(jobs->jidindex,
+	    n * sizeof(*jobs->jidindex));
+	for (i = jobs->jidcap; i < n; i++)
+		jobs->jidindex[i] = EMPTY;
+	jobs->jidcap = n;
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list.
+ *
+ * Effects:
+ *   Initializes the jobs list to an empty state.
+ */
+static void
+initjobs(JobTableP jobs)
+{
+
+	jobs->fg = EMPTY;
+	jobs->maxjid = 0;
+	jobs->njobs = 0;
+	jobs->pidbits = 4;
+	jobs->cmdlines.chainbits = 4;
+	growslots(jobs);
+	growprocs(jobs, 1);
+	growjids(jobs, 0);
+	rehashpids(jobs, 0);
+	rechaincmds(jobs);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list, "pids" to the PIDs of the "npids"
+ *   processes of a pipeline, the first of which leads its process group,
+ *   and "cmdline" is a properly terminated string.
+ *
+ * Effects: 
+ *   Adds a job to the jobs list.  As before, the new job's ID is one more
+ *   than the largest job ID in use.
+ */
+static int
+addjob(JobTableP jobs, const pid_t *pids, int npids, int state,
+    const char *cmdline)
+{
+	sigset_t mask_all, prev_all;
+	ProcP proc;
+	JobP job;
+	int i, jid, slot, *link;
+    
+	if (npids < 1 || pids[0] < 1)
+		return (0);
+	if ((jid = jobs->maxjid + 1) > MAXJID) {
+		printf("Tried to create too many jobs\n");
+		return (0);
+	}
+
+	// Make room, with every signal blocked because the tables may move.
+	if (jobs->nfree == 0 || jobs->nfreeprocs < npids ||
+	    jid >= jobs->jidcap ||
+	    (jobs->pidused + npids) * 4 > (3 << jobs->pidbits)) {
+		sigfillset(&mask_all);
+		sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+		if (jobs->nfree == 0)
+			growslots(jobs);
+		if (jobs->nfreeprocs < npids)
+			growprocs(jobs, npids);
+		if (jid >= jobs->jidcap)
+			growjids(jobs, jid);
+		if ((jobs->pidused + npids) * 4 > (3 << jobs->pidbits))
+			rehashpids(jobs, npids);
+		sigprocmask(SIG_SETMASK, &prev_all, NULL);
+	}
+
+	slot = jobs->freeslots[--jobs->nfree];
+	job = &jobs->slots[slot];
+	// Intern first, since compacting the pool updates every job's offset.
+	job->cmdline = interncmd(jobs, cmdline);
+	job->state = state;
+	job->jid = jid;
+	clock_gettime(CLOCK_MONOTONIC, (struct timespec *)&job->start);
+	job->since = job->start;
+
+	// Link the processes in pipeline order before any can be found.
+	link = (int *)&job->procs;
+	for (i = 0; i < npids; i++) {
+		*link = jobs->freeprocs[--jobs->nfreeprocs];
+		proc = &jobs->procs[*link];
+		proc->pid = pids[i];
+		proc->job = slot;
+		openpidfd(proc);
+		link = (int *)&proc->next;
+	}
+	*link = EMPTY;
+	job->live = npids;
+	job->pid = pids[0];
+	for (i = job->procs; i != EMPTY; i = jobs->procs[i].next)
+		insertpid(jobs, i);
+	jobs->jidindex[jid] = slot;
+	jobs->maxjid = jid;
+	jobs->njobs++;
+	if (state == FG)
+		jobs->fg = slot;
+	if (verbose) {
+		printf("Added job [%d] %d %s\n", job->jid, (int)job->pid,
+		    jobcmdline(jobs, job));
+	}
+	if (trace_fd >= 0)
+		tracejob(job);
+	return (1);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list, "job" to a job in it whose process
+ *   group "pid" has joined, and every signal is blocked.
+ *
+ * Effects:
+ *   Adds the process "pid" to the end of the job.  The records of the
+ *   job's processes that have been reaped are freed first, so that a
+ *   job that is fed new processes, like the parallel builtin's, does not
+ *   grow without bound.
+ */
+static void
+addproc(JobTableP jobs, JobP job, pid_t pid)
+{
+	ProcP proc;
+	int i, tail = EMPTY, *link;
+
+	link = (int *)&job->procs;
+	while ((i = *link) != EMPTY) {
+		proc = &jobs->procs[i];
+		if (proc->pid == 0) {
+			*link = proc->next;
+			jobs->freeprocs[jobs->nfreeprocs++] = i;
+		} else {
+			tail = i;
+			link = (int *)&proc->next;
+		}
+	}
+
+	// Make room.  The records may move, so only indexes are kept.
+	if (jobs->nfreeprocs == 0)
+		growprocs(jobs, 1);
+	if ((jobs->pidused + 1) * 4 > (3 << jobs->pidbits))
+		rehashpids(jobs, 1);
+
+	i = jobs->freeprocs[--jobs->nfreeprocs];
+	proc = &jobs->procs[i];
+	proc->pid = pid;
+	proc->job = job - jobs->slots;
+	proc->next = EMPTY;
+	openpidfd(proc);
+	if (tail == EMPTY)
+		job->procs = i;
+	else
+		jobs->procs[tail].next = i;
+	job->live++;
+	insertpid(jobs, i);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list.
+ *
+ * Effects:
+ *   Deletes a job from the jobs list that has a process whose PID equals
+ *   "pid", along with all of its processes.
+ */
+static int
+deletejob(JobTableP jobs, pid_t pid) 
+{
+	ProcP proc;
+	JobP job;
+	int h, i, slot;
+
+	if ((h = findpid(jobs, pid)) < 0)
+		return (0);
+	slot = jobs->procs[jobs->pidindex[h]].job;
+	job = &jobs->slots[slot];
+	for (i = job->procs; i != EMPTY; i = proc->next) {
+		proc = &jobs->procs[i];
+		if (proc->pid != 0)
+			deleteproc(jobs, findpid(jobs, proc->pid));
+		jobs->freeprocs[jobs->nfreeprocs++] = i;
+	}
+
+	if (job->cpu >= 0)
+		cpu_jobs[job->cpu]--;
+	if (trace_fd >= 0)
+		traceinterval(job);
+	jobs->jidindex[job->jid] = EMPTY;
+	if (jobs->fg == slot)
+		jobs->fg = EMPTY;
+	while (jobs->maxjid > 0 && jobs->jidindex[jobs->maxjid] == EMPTY)
+		jobs->maxjid--;
+	releasecmd(jobs, job->cmdline);
+	if (job->cpulist != EMPTY)
+		releasecmd(jobs, job->cpulist);
+	clearjob(job);
+	jobs->freeslots[jobs->nfree++] = slot;
+	jobs->njobs--;
+	return (1);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and "h" is the index in its PID index of
+ *   a process that has been reaped.
+ *
+ * Effects:
+ *   Removes the process from the PID index and closes its pidfd, but
+ *   leaves its record in its job's pipeline until the job is deleted.
+ */
+static void
+deleteproc(JobTableP jobs, int h)
+{
+	ProcP proc = &jobs->procs[jobs->pidindex[h]];
+
+	if (proc->pidfd >= 0) {
+		if (epoll_fd >= 0)
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, proc->pidfd, NULL);
+		close(proc->pidfd);
+		proc->pidfd = -1;
+	}
+	// Leave a marker in the PID index so that later entries stay found.
+	jobs->pidindex[h] = DELETED;
+	proc->pid = 0;
+	jobs->slots[proc->job].live--;
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and "job" to a job in it.
+ *
+ * Effects:
+ *   Changes the job's state to "state", keeping track of which job, if
+ *   any, is in the foreground.
+ */
+static void
+setjobstate(JobTableP jobs, JobP job, int state)
+{
+	int slot = job - jobs->slots;
+
+	if (trace_fd >= 0 && (state == ST) != (job->state == ST))
+		traceinterval(job);
+	if (state == FG)
+		jobs->fg = slot;
+	else if (jobs->fg == slot)
+		jobs->fg = EMPTY;
+	job->state = state;
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list.
+ *
+ * Effects:
+ *   Returns the PID of the current foreground job or 0 if no foreground
+ *   job exists.
+ */
+static pid_t
+fgpid(JobTableP jobs)
+{
+	int slot = jobs->fg;
+
+	return (slot == EMPTY ? 0 : jobs->slots[slot].pid);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list.
+ *
+ * Effects:
+ *   Returns a pointer to the current foreground job or NULL if no
+ *   foreground job exists.  Unlike fgpid(), this finds the job even if
+ *   the process that leads its process group has been reaped.
+ */
+static JobP
+fgjob(JobTableP jobs)
+{
+	int slot = jobs->fg;
+
+	return (slot == EMPTY ? NULL : &jobs->slots[slot]);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list.
+ *
+ * Effects:
+ *   Returns a pointer to the job structure with an unreaped process whose
+ *   ID is "pid" or NULL if no such job exists.
+ */
+static JobP
+getjobpid(JobTableP jobs, pid_t pid)
+{
+	int h;
+
+	if ((h = findpid(jobs, pid)) < 0)
+		return (NULL);
+	return (&jobs->slots[jobs->procs[jobs->pidindex[h]].job]);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list.
+ *
+ * Effects:
+ *   Returns a pointer to the job structure with job ID "jid" or NULL if no
+ *   such job exists.
+ */
+static JobP
+getjobjid(JobTableP jobs, int jid) 
+{
+	int slot;
+
+	if (jid < 1 || jid > jobs->maxjid ||
+	    (slot = jobs->jidindex[jid]) == EMPTY)
+		return (NULL);
+	return (&jobs->slots[slot]);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the job ID for the job with process ID "pid" or 0 if no such
+ *   job exists.
+ */
+static int
+pid2jid(pid_t pid) 
+{
+	JobP job = getjobpid(&jobs, pid);
+
+	return (job == NULL ? 0 : job->jid);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list.
+ *
+ * Effects:
+ *   Prints the jobs list in order of job ID.  If "usage" is true, follows
+ *   each job with the resources that it has used so far.
+ */
+static void
+listjobs(JobTableP jobs, bool usage) 
+{
+	struct Usage u;
+	char buf[256];
+	JobP job;
+	cpu_set_t cpus;
+	int jid;
+
+	for (jid = 1; jid <= jobs->maxjid; jid++) {
+		if ((job = getjobjid(jobs, jid)) == NULL)
+			continue;
+		printf("[%d] (%d) ", job->jid, (int)job->pid);
+		switch (job->state) {
+		case BG: 
+			printf("Running ");
+			break;
+		case FG: 
+			printf("Foreground ");
+			break;
+		case ST: 
+			printf("Stopped ");
+			break;
+		default:
+			printf("listjobs: Internal error: "
+			    "job[%d].state=%d ", jid, job->state);
+		}
+		if (job->cpu >= 0)
+			printf("cpu=%d ", job->cpu);
+		else if (job->cpu == CPU_NOTFG) {
+			cpus = shell_cpus;
+			CPU_CLR(reserved_cpu, &cpus);
+			printf("cpus=");
+			printcpulist(stdout, &cpus);
+			printf(" ");
+		} else if (jobcpulist(jobs, job) != NULL)
+			printf("cpus=%s ", jobcpulist(jobs, job));
+		if (job->node >= 0)
+			printf("node=%d ", job->node);
+		printf("%s", jobcmdline(jobs, job));
+		if (usage) {
+			jobusage(jobs, job, &u);
+			formatusage(buf, sizeof(buf),
+			    secondssince((struct timespec *)&job->start), &u);
+			printf("    %s", buf);
+		}
+	}
+}
+
+/*
+ * This comment marks the end of the jobs list helper routines.
+ */
+
+/*
+ * The following helper routines manage the pool of command lines.
+ */
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and "offset" is the offset of an entry
+ *   in its pool of command lines.
+ *
+ * Effects:
+ *   Returns a pointer to the entry.
+ */
+static struct CmdLine *
+cmdentry(JobTableP jobs, int offset)
+{
+
+	return ((struct CmdLine *)(jobs->cmdlines.base + offset));
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and "job" to a job in it.
+ *
+ * Effects:
+ *   Returns the job's command line.
+ */
+static const char *
+jobcmdline(JobTableP jobs, JobP job)
+{
+
+	return (cmdentry(jobs, job->cmdline)->text);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and "job" to a job in it.
+ *
+ * Effects:
+ *   Returns the list of CPUs that the job was placed on with --cpus, or
+ *   NULL if it was not.
+ */
+static const char *
+jobcpulist(JobTableP jobs, JobP job)
+{
+
+	if (job->cpulist == EMPTY)
+		return (NULL);
+	return (cmdentry(jobs, job->cpulist)->text);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and every signal is blocked.
+ *
+ * Effects:
+ *   Rebuilds the hash chains of the pool of command lines, with room for
+ *   at least twice as many entries as are in use.
+ */
+static void
+rechaincmds(JobTableP jobs)
+{
+	volatile struct CmdPool *pool = &jobs->cmdlines;
+	struct CmdLine *entry;
+	int bits = pool->chainbits, i, offset;
+
+	while ((1 << bits) < 2 * (pool->count + 1))
+		bits++;
+	if (bits != pool->chainbits || pool->chains == NULL) {
+		pool->chainbits = bits;
+		pool->chains = growtable(pool->chains,
+		    sizeof(*pool->chains) << bits);
+	}
+	for (i = 0; i < 1 << bits; i++)
+		pool->chains[i] = EMPTY;
+	for (offset = 0; offset < pool->used; offset += entry->size) {
+		entry = cmdentry(jobs, offset);
+		if (entry->refs == 0)
+			continue;
+		i = entry->hash >> (32 - bits);
+		entry->next = pool->chains[i];
+		pool->chains[i] = offset;
+	}
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and every signal is blocked.
+ *
+ * Effects:
+ *   Slides the command lines that are in use to the start of the pool,
+ *   reclaiming the space of those that are not, and updates the jobs'
+ *   offsets to match.
+ */
+static void
+compactcmds(JobTableP jobs)
+{
+	volatile struct CmdPool *pool = &jobs->cmdlines;
+	struct CmdLine *entry;
+	int i, offset, size, to;
+
+	// Record each live entry's new offset in its "next" field.
+	to = 0;
+	for (offset = 0; offset < pool->used; offset += entry->size) {
+		entry = cmdentry(jobs, offset);
+		if (entry->refs > 0) {
+			entry->next = to;
+			to += entry->size;
+		}
+	}
+	for (i = 0; i < jobs->nslots; i++) {
+		if (jobs->slots[i].pid == 0)
+			continue;
+		jobs->slots[i].cmdline =
+		    cmdentry(jobs, jobs->slots[i].cmdline)->next;
+		if (jobs->slots[i].cpulist != EMPTY)
+			jobs->slots[i].cpulist =
+			    cmdentry(jobs, jobs->slots[i].cpulist)->next;
+	}
+	for (offset = 0; offset < pool->used; offset += size) {
+		entry = cmdentry(jobs, offset);
+		size = entry->size;
+		if (entry->refs > 0 && entry->next != offset)
+			memmove(pool->base + entry->next, entry, size);
+	}
+	pool->used = to;
+	pool->unused = 0;
+	rechaincmds(jobs);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and "cmdline" is a properly terminated
+ *   string.
+ *
+ * Effects:
+ *   Returns the offset of an entry in the pool of command lines holding
+ *   "cmdline", after adding a reference to it.  Makes a new entry only if
+ *   no entry holds the same string.
+ */
+static int
+interncmd(JobTableP jobs, const char *cmdline)
+{
+	volatile struct CmdPool *pool = &jobs->cmdlines;
+	struct CmdLine *entry;
+	sigset_t mask_all, prev_all;
+	unsigned int hash = 2166136261u;
+	size_t len;
+	int offset, size;
+	const char *c;
+
+	for (c = cmdline; *c != '\0'; c++)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	len = c - cmdline;
+	for (offset = pool->chains[hash >> (32 - pool->chainbits)];
+	    offset != EMPTY; offset = entry->next) {
+		entry = cmdentry(jobs, offset);
+		if (entry->hash == hash && strcmp(entry->text, cmdline) == 0) {
+			entry->refs++;
+			return (offset);
+		}
+	}
+
+	// Make room, with every signal blocked because the pool may move.
+	size = (offsetof(struct CmdLine, text) + len + 1 +
+	    _Alignof(struct CmdLine) - 1) & ~(_Alignof(struct CmdLine) - 1);
+	if (pool->used + size > pool->cap ||
+	    (pool->count + 1) * 4 > (3 << pool->chainbits)) {
+		sigfillset(&mask_all);
+		sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+		if (pool->unused > 0 && pool->unused >= pool->used / 2)
+			compactcmds(jobs);
+		if (pool->used + size > pool->cap) {
+			while (pool->used + size > pool->cap)
+				pool->cap = pool->cap == 0 ? CHUNKSIZE :
+				    pool->cap * 2;
+			pool->base = growtable(pool->base, pool->cap);
+		}
+		if ((pool->count + 1) * 4 > (3 << pool->chainbits))
+			rechaincmds(jobs);
+		sigprocmask(SIG_SETMASK, &prev_all, NULL);
+	}
+
+	offset = pool->used;
+	entry = cmdentry(jobs, offset);
+	entry->hash = hash;
+	entry->refs = 1;
+	entry->size = size;
+	memcpy(entry->text, cmdline, len + 1);
+	entry->next = pool->chains[hash >> (32 - pool->chainbits)];
+	pool->chains[hash >> (32 - pool->chainbits)] = offset;
+	pool->used += size;
+	pool->count++;
+	return (offset);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list and "offset" is the offset of an entry
+ *   in its pool of command lines that has a reference.
+ *
+ * Effects:
+ *   Drops a reference to the entry.  If that was the last one, removes
+ *   the entry from its hash chain and counts its space as unused, to be
+ *   reclaimed by a later compaction.  This function can be safely called
+ *   by a signal handler.
+ */
+static void
+releasecmd(JobTableP jobs, int offset)
+{
+	volatile struct CmdPool *pool = &jobs->cmdlines;
+	struct CmdLine *entry = cmdentry(jobs, offset);
+	volatile int *link;
+
+	if (--entry->refs > 0)
+		return;
+	for (link = &pool->chains[entry->hash >> (32 - pool->chainbits)];
+	    *link != offset; link = &cmdentry(jobs, *link)->next)
+		continue;
+	*link = entry->next;
+	pool->unused += entry->size;
+	pool->count--;
+}
+
+/*
+ * This comment marks the end of the command line pool routines.
+ */
+
+/*
+ * The following helper routines manage arenas.
+ */
+
+/*
+ * Requires:
+ *   "arena" points to an arena, which may be zero-initialized.
+ *
+ * Effects:
+ *   Returns a pointer to "size" bytes of uninitialized memory, suitably
+ *   aligned for any type, that remain valid until the arena is reset.
+ *   Terminates the program if memory is exhausted.
+ */
+static void *
+arena_alloc(struct Arena *arena, size_t size)
+{
+	struct Chunk *chunk;
+	size_t chunksize;
+	void *p;
+
+	// Round the request up so that the next allocation stays aligned.
+	size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+	if (arena->cur == NULL || (size_t)(arena->cur->end - arena->next) <
+	    size) {
+		// Move on to the next chunk, if it exists and is big enough.
+		chunk = arena->cur == NULL ? arena->head : arena->cur->next;
+		if (chunk == NULL ||
+		    (size_t)(chunk->end - (char *)chunk->data) < size) {
+			chunksize = size > CHUNKSIZE ? size : CHUNKSIZE;
+			if ((chunk = malloc(sizeof(*chunk) + chunksize)) ==
+			    NULL)
+				Sio_error("Failed allocating memory");
+			chunk->end = (char *)chunk->data + chunksize;
+			// Insert the new chunk after the current one.
+			if (arena->cur == NULL) {
+				chunk->next = arena->head;
+				arena->head = chunk;
+			} else {
+				chunk->next = arena->cur->next;
+				arena->cur->next = chunk;
+			}
+		}
+		arena->cur = chunk;
+		arena->next = (char *)chunk->data;
+	}
+	p = arena->next;
+	arena->next += size;
+	return (p);
+}
+
+/*
+ * Requires:
+ *   "arena" points to an arena.
+ *
+ * Effects:
+ *   Releases everything allocated from the arena in constant time.  The
+ *   arena's chunks are kept for later allocations.
+ */
+static void
+arena_reset(struct Arena *arena)
+{
+
+	arena->cur = arena->head;
+	if (arena->head != NULL)
+		arena->next = (char *)arena->head->data;
+}
+
+/*
+ * Requires:
+ *   "s" points to at least "len" characters.
+ *
+ * Effects:
+ *   Returns a properly terminated copy of the first "len" characters of
+ *   "s" allocated from "arena".
+ */
+static char *
+arena_strndup(struct Arena *arena, const char *s, size_t len)
+{
+	char *copy = arena_alloc(arena, len + 1);
+
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	return (copy);
+}
+
+/*
+ * This comment marks the end of the arena routines.
+ */
+
+/*
+ * The following helper routines read command lines in batch mode.
+ */
+
+/*
+ * Requires:
+ *   "in" is an input whose fd is STDIN_FILENO, and "filename" is a
+ *   properly terminated string.
+ *
+ * Effects:
+ *   Maps the file "filename" into memory as the contents of "in".  The
+ *   mapping is private, so lines can be terminated in place without
+ *   modifying the file.
+ */
+static void
+mapinput(struct Input *in, const char *filename)
+{
+	struct stat sb;
+	void *addr;
+
+	if ((in->fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0 ||
+	    fstat(in->fd, &sb) < 0)
+		unix_error(filename);
+	in->len = sb.st_size;
+	if (in->len == 0)
+		return;
+	addr = mmap(NULL, in->len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	    in->fd, 0);
+	if (addr == MAP_FAILED)
+		unix_error("mmap error");
+	madvise(addr, in->len, MADV_SEQUENTIAL);
+	in->buf = addr;
+}
+
+/*
+ * Requires:
+ *   "in" is an input that is read with read() rather than mapped.
+ *
+ * Effects:
+ *   Moves any partial line to the front of the buffer, growing the
+ *   buffer if the partial line fills it, and appends the next block of
+ *   input.  Sets "in->fd" to -1 at the end of the input.
+ */
+static void
+readinput(struct Input *in)
+{
+	ssize_t n;
+
+	in->len -= in->pos;
+	if (in->len > 0)
+		memmove(in->buf, in->buf + in->pos, in->len);
+	in->pos = 0;
+	/*
+	 * Always leave room to add a missing '\n' to the final line and
+	 * to terminate that line in place.
+	 */
+	if (in->len + 2 >= in->size) {
+		in->size = in->size == 0 ? INPUTSIZE : in->size * 2;
+		if ((in->buf = realloc(in->buf, in->size)) == NULL)
+			Sio_error("Failed allocating memory");
+	}
+
+	// Make sure that everything printed so far is seen before blocking.
+	fflush(stdout);
+	if (in->fd == STDIN_FILENO && stdin_polled) {
+		while (!stdin_ready)
+			waitevents(-1);
+		stdin_ready = false;
+	}
+	if ((n = read(in->fd, in->buf + in->len, in->size - in->len - 2)) < 0) {
+		// A client that resets its connection has simply gone.
+		if (!in_session || errno != ECONNRESET)
+			unix_error("read error");
+		n = 0;
+	}
+	if (in->fd == STDIN_FILENO && stdin_polled) {
+		// Rearm stdin, which is reported at most once per read().
+		struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT,
+		    .data.fd = STDIN_FILENO };
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, STDIN_FILENO, &event);
+	}
+	if (n == 0)
+		in->fd = -1;
+	in->len += n;
+}
+
+/*
+ * Requires:
+ *   "in" is an initialized input and "lenp" points to a size_t.
+ *
+ * Effects:
+ *   Returns a pointer to the next line of the input, including its
+ *   trailing '\n', and stores its length in "*lenp".  The byte following
+ *   the line may be overwritten by the caller, as long as it is restored
+ *   before the next call or recorded in "in->held".  A final line without
+ *   a '\n' is given one.  Returns NULL at the end of the input.
+ */
+static char *
+nextline(struct Input *in, size_t *lenp)
+{
+	char *line, *nl;
+	size_t avail;
+
+	if (in->held != NULL) {
+		*in->held = in->heldbyte;
+		in->held = NULL;
+	}
+	while (true) {
+		line = in->buf + in->pos;
+		avail = in->len - in->pos;
+		nl = avail > 0 ? memchr(line, '\n', avail) : NULL;
+		if (nl != NULL &&
+		    (in->size != 0 || nl + 1 < in->buf + in->len)) {
+			*lenp = nl + 1 - line;
+			in->pos += *lenp;
+			return (line);
+		}
+		if (in->size == 0 && in->buf != NULL && avail > 0) {
+			/*
+			 * The last line of a mapped script has no byte after
+			 * it that can be overwritten, so copy it.
+			 */
+			free(in->last);
+			if ((in->last = malloc(avail + 2)) == NULL)
+				Sio_error("Failed allocating memory");
+			memcpy(in->last, line, avail);
+			if (nl == NULL)
+				in->last[avail++] = '\n';
+			in->pos = in->len;
+			*lenp = avail;
+			return (in->last);
+		}
+		if (in->size == 0 && in->buf != NULL)
+			return (NULL);
+		if (in->fd < 0) {
+			if (avail == 0)
+				return (NULL);
+			// Terminate the final line.
+			line[avail] = '\n';
+			in->len++;
+			continue;
+		}
+		readinput(in);
+	}
+}
+
+/*
+ * Requires:
+ *   "buf" points to "len" bytes.
+ *
+ * Effects:
+ *   Writes all of "buf" to "fd", retrying after short writes.  Returns 0
+ *   on success and -1 with errno set on failure.
+ */
+static int
+writeall(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		buf += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * This comment marks the end of the batch mode input routines.
+ */
+
+/*
+ * The following helper routines manage the executable lookup cache.
+ */
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Starts watching every directory in search_path for changes, so that
+ *   cached lookups can be discarded when they may have become stale.  For
+ *   each directory that inotify cannot watch, because it is unavailable,
+ *   the directory does not exist yet, or there are no watches left,
+ *   records the directory's modification time instead.
+ */
+static void
+watchpath(void)
+{
+	struct stat sb;
+	int i, n;
+
+	for (n = 0; search_path[n] != NULL; n++)
+		continue;
+	path_mtime = arena_alloc(&path_arena, n * sizeof(*path_mtime));
+	memset(path_mtime, 0, n * sizeof(*path_mtime));
+	path_wd = arena_alloc(&path_arena, n * sizeof(*path_wd));
+	path_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	for (i = 0; i < n; i++)
+		if ((path_wd[i] = watchdir(watchname(i))) < 0 &&
+		    stat(watchname(i), &sb) == 0)
+			path_mtime[i] = sb.st_mtim;
+}
+
+/*
+ * Requires:
+ *   "i" is the index of a directory in search_path.
+ *
+ * Effects:
+ *   Returns the name under which the directory is watched.  The first is
+ *   the current directory, whose executables keep a bare name from being
+ *   found at all, so it is watched as "." to follow the directory itself.
+ */
+static const char *
+watchname(int i)
+{
+
+	return (i == 0 ? "." : search_path[i]);
+}
+
+/*
+ * Requires:
+ *   "dir" is a properly terminated string.
+ *
+ * Effects:
+ *   Adds an inotify watch for the changes to the directory "dir" that
+ *   can change which executables it holds, and for its removal, and
+ *   returns the watch.  Returns -1 if it cannot be watched.
+ */
+static int
+watchdir(const char *dir)
+{
+
+	if (path_watch_fd < 0)
+		return (-1);
+	return (inotify_add_watch(path_watch_fd, dir, IN_ONLYDIR | IN_CREATE |
+	    IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+	    IN_DELETE_SELF | IN_MOVE_SELF));
+}
+
+/*
+ * Requires:
+ *   path_watch_fd is open.
+ *
+ * Effects:
+ *   Reads every pending inotify event without blocking, and returns true
+ *   if there were any, since any event at all means a change.  A
+ *   directory that has been removed or moved away is no longer watched
+ *   under its name, so its watch is dropped and it falls back to having
+ *   its modification time checked until it can be watched again.
+ */
+static bool
+readpathevents(void)
+{
+	char events[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	bool changed = false;
+	ssize_t n;
+	char *p;
+	int i;
+
+	while ((n = read(path_watch_fd, events, sizeof(events))) > 0) {
+		changed = true;
+		for (p = events; p < events + n; p += sizeof(*event) +
+		    event->len) {
+			event = (const struct inotify_event *)p;
+			if ((event->mask & (IN_IGNORED | IN_DELETE_SELF |
+			    IN_MOVE_SELF)) == 0)
+				continue;
+			for (i = 0; search_path[i] != NULL; i++) {
+				if (path_wd[i] != event->wd)
+					continue;
+				path_wd[i] = -1;
+				memset(&path_mtime[i], 0, sizeof(path_mtime[i]));
+			}
+			// A moved directory would still be watched.
+			if ((event->mask & IN_MOVE_SELF) != 0)
+				inotify_rm_watch(path_watch_fd, event->wd);
+		}
+	}
+	return (changed);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns true if a directory in search_path may have changed since
+ *   the last call, and false otherwise.  Unless the inotify events are
+ *   read by waitevents(), they are read here.
+ */
+static bool
+pathchanged(void)
+{
+	struct stat sb;
+	bool changed;
+	int i;
+
+	if (path_watch_fd >= 0 && !path_polled && readpathevents())
+		path_stale = true;
+	changed = path_stale;
+	path_stale = false;
+	/*
+	 * A directory that is not watched changes when it is created or its
+	 * modification time changes, and is watched again once it can be.
+	 */
+	for (i = 0; search_path[i] != NULL; i++) {
+		if (path_wd[i] >= 0 || stat(watchname(i), &sb) != 0)
+			continue;
+		if ((path_wd[i] = watchdir(watchname(i))) >= 0 ||
+		    sb.st_mtim.tv_sec != path_mtime[i].tv_sec ||
+		    sb.st_mtim.tv_nsec != path_mtime[i].tv_nsec) {
+			path_mtime[i] = sb.st_mtim;
+			changed = true;
+		}
+	}
+	return (changed);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Removes every entry from the executable lookup cache.
+ */
+static void
+clearpathcache(void)
+{
+	int i;
+
+	for (i = 0; i < HASHSIZE; i++) {
+		free(path_cache[i].name);
+		free(path_cache[i].path);
+		path_cache[i].name = NULL;
+		path_cache[i].path = NULL;
+		path_cache[i].hits = 0;
+	}
+	path_cache_count = 0;
+}
+
+/*
+ * Requires:
+ *   "name" is a properly terminated string and "buf" points to at least
+ *   PATH_MAX bytes.
+ *
+ * Effects:
+ *   Searches for the executable named by "name" without consulting the
+ *   cache.  Returns "name" itself if it is a path, "buf" holding the
+ *   absolute path if it was found in search_path, or NULL if no such
+ *   executable exists.  A bare name that is executable in the current
+ *   directory is deliberately not found.  The current directory is
+ *   watched with the rest of search_path, so that the cached results of
+ *   this rule are discarded when it changes.
+ */
+static const char *
+findexe(const char *name, char *buf)
+{
+	int i;
+
+	if (name[0] == '/' || name[0] == '.' || search_path == NULL)
+		return (access(name, X_OK) == 0 ? name : NULL);
+	if (strchr(name, '/') == NULL && access(name, X_OK) == 0)
+		return (NULL);
+	for (i = 0; search_path[i] != NULL; i++) {
+		if (snprintf(buf, PATH_MAX, "%s/%s", search_path[i], name) >=
+		    PATH_MAX)
+			continue;
+		if (access(buf, X_OK) == 0)
+			return (buf);
+	}
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "name" is a properly terminated string and "buf" points to at least
+ *   PATH_MAX bytes.
+ *
+ * Effects:
+ *   Like findexe(), but answers repeated lookups of a bare command name,
+ *   including lookups that failed, from the executable lookup cache.  The
+ *   returned string remains valid until the cache is next modified.
+ */
+static const char *
+lookupexe(const char *name, char *buf)
+{
+	struct PathEntry *entry;
+	const char *path;
+	unsigned int h = 2166136261u;
+	const char *c;
+
+	if (name[0] == '/' || name[0] == '.' || search_path == NULL ||
+	    strchr(name, '/') != NULL)
+		return (findexe(name, buf));
+	if (pathchanged())
+		clearpathcache();
+
+	// Find the name's slot using FNV-1a hashing and linear probing.
+	for (c = name; *c != '\0'; c++)
+		h = (h ^ (unsigned char)*c) * 16777619u;
+	for (h &= HASHSIZE - 1; path_cache[h].name != NULL;
+	    h = (h + 1) & (HASHSIZE - 1)) {
+		entry = &path_cache[h];
+		if (!strcmp(entry->name, name)) {
+			entry->hits++;
+			return (entry->path);
+		}
+	}
+
+	path = findexe(name, buf);
+
+	// Keep the table sparse by starting over when it fills up.
+	if (path_cache_count >= HASHSIZE * 3 / 4) {
+		clearpathcache();
+		return (path);
+	}
+	entry = &path_cache[h];
+	if ((entry->name = strdup(name)) == NULL ||
+	    (path != NULL && (entry->path = strdup(path)) == NULL))
+		Sio_error("Failed allocating memory");
+	entry->hits = 1;
+	path_cache_count++;
+	return (path);
+}
+
+/*
+ * This comment marks the end of the executable lookup cache routines.
+ */
+
+/*
+ * The following helper routines place jobs on CPUs and NUMA nodes.
+ */
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Reads the CPUs that the shell may run on, the NUMA node of each CPU,
+ *   and the shell's own memory policy, once.  Without NUMA information,
+ *   every CPU is taken to be on node 0.
+ */
+static void
+readtopology(void)
+{
+	char path[64];
+	cpu_set_t cpus, nodes;
+	int cpu, node;
+
+	if (topology_read)
+		return;
+	topology_read = true;
+	if (sched_getaffinity(0, sizeof(shell_cpus), &shell_cpus) < 0) {
+		CPU_ZERO(&shell_cpus);
+		CPU_SET(0, &shell_cpus);
+	}
+	ncpus = CPU_COUNT(&shell_cpus);
+	CPU_ZERO(&online_nodes);
+	CPU_SET(0, &online_nodes);
+	if (readcpulist("/sys/devices/system/node/online", &nodes)) {
+		online_nodes = nodes;
+		for (node = 0; node < CPU_SETSIZE; node++) {
+			if (!CPU_ISSET(node, &online_nodes))
+				continue;
+			snprintf(path, sizeof(path),
+			    "/sys/devices/system/node/node%d/cpulist", node);
+			if (!readcpulist(path, &cpus))
+				continue;
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &cpus))
+					cpu_node[cpu] = node;
+		}
+	}
+	if (syscall(SYS_get_mempolicy, &shell_mempolicy, &shell_nodemask,
+	    sizeof(shell_nodemask) * 8 + 1, NULL, 0) < 0) {
+		shell_mempolicy = MPOL_DEFAULT;
+		shell_nodemask = 0;
+	}
+	ordercpus();
+}
+
+/*
+ * Requires:
+ *   "path" is the name of a file holding a list like "0-3,8", and "set"
+ *   points to a set.
+ *
+ * Effects:
+ *   Reads the list into "set" and returns true, or returns false if the
+ *   file cannot be read or does not hold a list.
+ */
+static bool
+readcpulist(const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return (false);
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return (false);
+	buf[n] = '\0';
+	if (buf[n - 1] == '\n')
+		buf[n - 1] = '\0';
+	return (parsecpulist(buf, set));
+}
+
+/*
+ * Requires:
+ *   "list" is a string and "set" points to a set.
+ *
+ * Effects:
+ *   Parses a list of numbers and ranges, like "0-3,8", into "set" and
+ *   returns true.  Returns false if "list" is not such a list or names a
+ *   number that does not fit in a cpu_set_t.
+ */
+static bool
+parsecpulist(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (true) {
+		if (!isdigit((unsigned char)*p))
+			return (false);
+		lo = hi = strtol(p, &end, 10);
+		if (*end == '-') {
+			p = end + 1;
+			if (!isdigit((unsigned char)*p))
+				return (false);
+			hi = strtol(p, &end, 10);
+		}
+		if (lo > hi || hi >= CPU_SETSIZE)
+			return (false);
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, set);
+		if (*end == '\0')
+			return (true);
+		if (*end != ',')
+			return (false);
+		p = end + 1;
+	}
+}
+
+/*
+ * Requires:
+ *   "set" points to a set.
+ *
+ * Effects:
+ *   Prints the set to "f" as a list of numbers and ranges, like "0-3,8".
+ */
+static void
+printcpulist(FILE *f, const cpu_set_t *set)
+{
+	const char *sep = "";
+	int lo, hi;
+
+	for (lo = 0; lo < CPU_SETSIZE; lo = hi + 1) {
+		if (!CPU_ISSET(lo, set)) {
+			hi = lo;
+			continue;
+		}
+		for (hi = lo; hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set);
+		    hi++)
+			continue;
+		if (hi == lo)
+			fprintf(f, "%s%d", sep, lo);
+		else
+			fprintf(f, "%s%d-%d", sep, lo, hi);
+		sep = ",";
+	}
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to CPU numbers.
+ *
+ * Effects:
+ *   Orders CPUs by NUMA node and then by number, for qsort().
+ */
+static int
+cpucmp(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+
+	if (cpu_node[x] != cpu_node[y])
+		return (cpu_node[x] - cpu_node[y]);
+	return (x - y);
+}
+
+/*
+ * Requires:
+ *   readtopology() has been called.
+ *
+ * Effects:
+ *   Lists the shell's CPUs in cpu_order in the order that place_policy
+ *   fills them: node by node for PLACE_COMPACT, and taking one CPU from
+ *   each node in turn otherwise.  Chooses the CPU kept for foreground
+ *   jobs, the first one, if there is more than one.
+ */
+static void
+ordercpus(void)
+{
+	int bynode[CPU_SETSIZE];
+	int cpu, i, j, n, round;
+
+	for (n = cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &shell_cpus))
+			bynode[n++] = cpu;
+	qsort(bynode, n, sizeof(*bynode), cpucmp);
+	reserved_cpu = n > 1 ? bynode[0] : -1;
+	if (place_policy == PLACE_COMPACT) {
+		memcpy(cpu_order, bynode, n * sizeof(*bynode));
+		return;
+	}
+	// Deal the CPUs out one node at a time, like cards.
+	for (n = round = 0; n < ncpus; round++) {
+		for (i = 0; i < ncpus; i = j) {
+			for (j = i + 1; j < ncpus &&
+			    cpu_node[bynode[j]] == cpu_node[bynode[i]]; j++)
+				continue;
+			if (i + round < j)
+				cpu_order[n++] = bynode[i + round];
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   "cpus" and "node" are the arguments of a job's --cpus and --node
+ *   prefixes, or NULL if it has none, "bg" is true if the job runs in the
+ *   background, and "placep" and "cpup" point to where to store the
+ *   result.
+ *
+ * Effects:
+ *   Decides where the job runs: on the CPUs listed by "cpus", on the CPUs
+ *   and memory of "node", or else, for a background job, where the
+ *   policy places it.  Stores the placement, allocated from cmd_arena,
+ *   or NULL if the job runs wherever the shell does, in "*placep", and
+ *   the CPU that the policy chose, CPU_NOTFG or -1 in "*cpup".  Returns
+ *   true on success.  Otherwise, prints an error message and returns
+ *   false.
+ */
+static bool
+placejob(const char *cpus, const char *node, bool bg,
+    struct Placement **placep, int *cpup)
+{
+	struct Placement *place;
+	cpu_set_t set;
+	char *end;
+	int cpu, i;
+	long n;
+
+	*placep = NULL;
+	*cpup = -1;
+	if (cpus == NULL && node == NULL &&
+	    (!bg || place_policy == PLACE_NONE))
+		return (true);
+	readtopology();
+	place = arena_alloc(&cmd_arena, sizeof(*place));
+	place->cpus = shell_cpus;
+	place->node = -1;
+	if (node != NULL) {
+		n = strtol(node, &end, 10);
+		// A node mask for set_mempolicy() is a single long.
+		if (!isdigit((unsigned char)*node) || *end != '\0' ||
+		    n >= (long)(sizeof(unsigned long) * 8) ||
+		    !CPU_ISSET(n, &online_nodes)) {
+			printf("--node: %s: No such node\n", node);
+			return (false);
+		}
+		place->node = n;
+		place->mempolicy = MPOL_BIND;
+		// A node may have memory but no CPUs of its own.
+		CPU_ZERO(&set);
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &shell_cpus) && cpu_node[cpu] == n)
+				CPU_SET(cpu, &set);
+		if (CPU_COUNT(&set) > 0)
+			place->cpus = set;
+	}
+	if (cpus != NULL) {
+		if (!parsecpulist(cpus, &set)) {
+			printf("--cpus: %s: Invalid CPU list\n", cpus);
+			return (false);
+		}
+		CPU_AND(&place->cpus, &set, &shell_cpus);
+		if (CPU_COUNT(&place->cpus) == 0) {
+			printf("--cpus: %s: No such CPU\n", cpus);
+			return (false);
+		}
+	}
+	if (cpus == NULL && node == NULL) {
+		if (place_policy == PLACE_RESERVE) {
+			if (reserved_cpu < 0)
+				return (true);
+			CPU_CLR(reserved_cpu, &place->cpus);
+			*cpup = CPU_NOTFG;
+		} else {
+			// Take the CPU with the fewest jobs, earliest first.
+			for (cpu = cpu_order[0], i = 1; i < ncpus; i++)
+				if (cpu_jobs[cpu_order[i]] < cpu_jobs[cpu])
+					cpu = cpu_order[i];
+			CPU_ZERO(&place->cpus);
+			CPU_SET(cpu, &place->cpus);
+			*cpup = cpu;
+			if (cpu_node[cpu] < (int)(sizeof(unsigned long) * 8)) {
+				place->node = cpu_node[cpu];
+				place->mempolicy = MPOL_PREFERRED;
+			}
+		}
+	}
+	*placep = place;
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "place" is a placement.
+ *
+ * Effects:
+ *   Moves the calling process to the placement's CPUs and sets its
+ *   memory policy.  This function can be safely called by a child
+ *   between fork() and execve().
+ */
+static void
+applyplacement(const struct Placement *place)
+{
+	unsigned long nodemask;
+
+	sched_setaffinity(0, sizeof(place->cpus), &place->cpus);
+	if (place->node >= 0) {
+		nodemask = 1UL << place->node;
+		syscall(SYS_set_mempolicy, place->mempolicy, &nodemask,
+		    sizeof(nodemask) * 8 + 1);
+	}
+}
+
+/*
+ * Requires:
+ *   readtopology() has been called.
+ *
+ * Effects:
+ *   Undoes applyplacement() in the shell, putting back its own CPUs and
+ *   memory policy.
+ */
+static void
+restoreplacement(void)
+{
+
+	sched_setaffinity(0, sizeof(shell_cpus), &shell_cpus);
+	syscall(SYS_set_mempolicy, shell_mempolicy,
+	    shell_mempolicy == MPOL_DEFAULT ? NULL : &shell_nodemask,
+	    sizeof(shell_nodemask) * 8 + 1);
+}
+
+/*
+ * This comment marks the end of the CPU placement routines.
+ */
+
+/*
+ * The following helper routines account for and limit the resources
+ * that jobs use.
+ */
+
+/*
+ * Requires:
+ *   "u" points to a usage and "ru" to one returned by wait4() or
+ *   getrusage().
+ *
+ * Effects:
+ *   Adds the resources in "ru" to "u".  The largest resident set is the
+ *   larger of the two.
+ */
+static void
+addrusage(struct Usage *u, const struct rusage *ru)
+{
+
+	u->utime += ru->ru_utime.tv_sec * 1000000L + ru->ru_utime.tv_usec;
+	u->stime += ru->ru_stime.tv_sec * 1000000L + ru->ru_stime.tv_usec;
+	if (ru->ru_maxrss > u->maxrss)
+		u->maxrss = ru->ru_maxrss;
+	u->nvcsw += ru->ru_nvcsw;
+	u->nivcsw += ru->ru_nivcsw;
+}
+
+/*
+ * Requires:
+ *   "u" points to a usage.
+ *
+ * Effects:
+ *   Adds the resources used so far by the running process "pid", as read
+ *   from /proc, to "u".  Adds nothing for a process that has exited.
+ */
+static void
+procusage(pid_t pid, struct Usage *u)
+{
+	static long ticks;
+	char buf[8192], path[64], *cp;
+	unsigned long utime, stime;
+	long n;
+	ssize_t len;
+	int fd;
+
+	if (ticks == 0 && (ticks = sysconf(_SC_CLK_TCK)) <= 0)
+		ticks = 100;
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
+	// The command name may hold anything, even a ')'.
+	if ((cp = strrchr(buf, ')')) == NULL || sscanf(cp + 1,
+	    " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+	    &utime, &stime) != 2)
+		return;
+	u->utime += utime * (1000000L / ticks);
+	u->stime += stime * (1000000L / ticks);
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
+	if ((cp = strstr(buf, "\nVmHWM:")) != NULL &&
+	    (n = strtol(cp + 7, NULL, 10)) > u->maxrss)
+		u->maxrss = n;
+	if ((cp = strstr(buf, "\nvoluntary_ctxt_switches:")) != NULL)
+		u->nvcsw += strtol(cp + 25, NULL, 10);
+	if ((cp = strstr(buf, "\nnonvoluntary_ctxt_switches:")) != NULL)
+		u->nivcsw += strtol(cp + 28, NULL, 10);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to a jobs list, "job" to a job in it, and "u" to a
+ *   usage.
+ *
+ * Effects:
+ *   Stores in "u" the resources used so far by the job: those of its
+ *   processes that have been reaped, and those of the rest so far.
+ */
+static void
+jobusage(JobTableP jobs, JobP job, struct Usage *u)
+{
+	ProcP proc;
+	int i;
+
+	*u = *(struct Usage *)&job->usage;
+	for (i = job->procs; i != EMPTY; i = proc->next) {
+		proc = &jobs->procs[i];
+		if (proc->pid != 0)
+			procusage(proc->pid, u);
+	}
+}
+
+/*
+ * Requires:
+ *   "u" points to a usage.
+ *
+ * Effects:
+ *   Stores in "u" the resources used by the shell and by the children
+ *   that it has reaped.
+ */
+static void
+shellusage(struct Usage *u)
+{
+	struct rusage ru;
+
+	memset(u, 0, sizeof(*u));
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		addrusage(u, &ru);
+	if (getrusage(RUSAGE_CHILDREN, &ru) == 0)
+		addrusage(u, &ru);
+}
+
+/*
+ * Requires:
+ *   "buf" has room for "size" bytes, and "u" points to a usage.
+ *
+ * Effects:
+ *   Formats "real" seconds of elapsed time and the resources in "u" as a
+ *   line in "buf", and returns its length.
+ */
+static int
+formatusage(char *buf, size_t size, double real, const struct Usage *u)
+{
+
+	return (snprintf(buf, size, "real %.3fs user %.3fs sys %.3fs "
+	    "maxrss %ldKB vcsw %ld ivcsw %ld\n", real, u->utime / 1e6,
+	    u->stime / 1e6, u->maxrss, u->nvcsw, u->nivcsw));
+}
+
+/*
+ * Requires:
+ *   "job" points to a job whose processes have all been reaped.
+ *
+ * Effects:
+ *   Reports the resources that the job used and how long it ran.  A
+ *   timed job in the foreground is reported like the time command of
+ *   other shells; any other job is named, since the report may come at
+ *   any time.
+ */
+static void
+reportjob(JobP job)
+{
+	char buf[256];
+
+	if (!job->timed || job->state != FG) {
+		Sio_puts("Job [");
+		Sio_putl((long) job->jid);
+		Sio_puts("] (");
+		Sio_putl((long) job->pid);
+		Sio_puts(") ");
+	}
+	formatusage(buf, sizeof(buf),
+	    secondssince((struct timespec *)&job->start),
+	    (struct Usage *)&job->usage);
+	Sio_puts(buf);
+}
+
+/*
+ * Requires:
+ *   "start" and "before" are the time and the usage returned by
+ *   shellusage() before a built-in command ran.
+ *
+ * Effects:
+ *   Reports the resources that the built-in command used, including
+ *   those of any jobs that it ran and reaped, and how long it ran.  The
+ *   largest resident set is the shell's or its children's, whichever is
+ *   larger, since the system keeps only the largest ever.
+ */
+static void
+reportbuiltin(const struct timespec *start, const struct Usage *before)
+{
+	struct Usage u;
+	char buf[256];
+
+	shellusage(&u);
+	u.utime -= before->utime;
+	u.stime -= before->stime;
+	u.nvcsw -= before->nvcsw;
+	u.nivcsw -= before->nivcsw;
+	formatusage(buf, sizeof(buf), secondssince(start), &u);
+	printf("%s", buf);
+}
+
+/*
+ * Requires:
+ *   "spec" is the argument of a --limit prefix, and "limitsp" points to
+ *   where to store the result.
+ *
+ * Effects:
+ *   Parses a list of limits like "cpu=10,as=1G,nofile=64", where a value
+ *   may be followed by K, M or G to multiply it by 2^10, 2^20 or 2^30,
+ *   into limits allocated from cmd_arena, stores them in "*limitsp", and
+ *   returns true.  Otherwise, prints an error message and returns false.
+ */
+static bool
+parselimits(const char *spec, struct Limits **limitsp)
+{
+	struct Limits *limits;
+	const char *p = spec, *eq;
+	char *end;
+	unsigned long long value;
+	int i, shift;
+
+	limits = arena_alloc(&cmd_arena, sizeof(*limits));
+	for (i = 0; i < NLIMITS; i++)
+		limits->max[i] = RLIM_INFINITY;
+	while (true) {
+		if ((eq = strchr(p, '=')) == NULL)
+			break;
+		for (i = 0; i < NLIMITS; i++)
+			if (strlen(limit_names[i].name) == (size_t)(eq - p) &&
+			    !strncmp(p, limit_names[i].name, eq - p))
+				break;
+		if (i == NLIMITS || !isdigit((unsigned char)eq[1]))
+			break;
+		errno = 0;
+		value = strtoull(eq + 1, &end, 10);
+		shift = *end == 'K' ? 10 : *end == 'M' ? 20 :
+		    *end == 'G' ? 30 : 0;
+		if (shift != 0)
+			end++;
+		if (errno != 0 || value > (RLIM_INFINITY - 1) >> shift)
+			break;
+		limits->max[i] = value << shift;
+		if (*end == '\0') {
+			*limitsp = limits;
+			return (true);
+		}
+		if (*end != ',')
+			break;
+		p = end + 1;
+	}
+	printf("--limit: %s: Invalid limit\n", spec);
+	return (false);
+}
+
+/*
+ * Requires:
+ *   "limits" points to limits.
+ *
+ * Effects:
+ *   Sets the calling process's limits, never above the hard limits that
+ *   it already has.  The hard limit on CPU time is left one second above
+ *   the soft limit, so that the process is sent SIGXCPU rather than
+ *   SIGKILL.  This function can be safely called by a child between
+ *   fork() and execve().
+ */
+static void
+applylimits(const struct Limits *limits)
+{
+	struct rlimit rl;
+	int i;
+
+	for (i = 0; i < NLIMITS; i++) {
+		if (limits->max[i] == RLIM_INFINITY ||
+		    getrlimit(limit_names[i].resource, &rl) < 0)
+			continue;
+		if (limits->max[i] < rl.rlim_max) {
+			rl.rlim_cur = limits->max[i];
+			if (limit_names[i].resource != RLIMIT_CPU)
+				rl.rlim_max = rl.rlim_cur;
+			else if (rl.rlim_cur + 1 < rl.rlim_max)
+				rl.rlim_max = rl.rlim_cur + 1;
+		} else
+			rl.rlim_cur = rl.rlim_max;
+		setrlimit(limit_names[i].resource, &rl);
+	}
+}
+
+/*
+ * This comment marks the end of the resource accounting routines.
+ */
+
+/*
+ * The following helper routines time the phases of evaluating commands.
+ */
+
+/*
+ * Requires:
+ *   "t" points to the start of a phase.
+ *
+ * Effects:
+ *   If phases are being timed or traced, reads the clock into "*t".
+ *   Otherwise, clears "*t", so that the phase is not counted even if
+ *   timing starts before it ends.
+ */
+static void
+phasebegin(struct timespec *t)
+{
+
+	if (stats_enabled || trace_fd >= 0)
+		clock_gettime(CLOCK_MONOTONIC, t);
+	else
+		t->tv_sec = t->tv_nsec = 0;
+}
+
+/*
+ * Requires:
+ *   "t" points to a time set by phasebegin() or phasemark().
+ *
+ * Effects:
+ *   If phases are being timed, counts the time since "*t" as a time that
+ *   "phase" took.  If they are being traced, keeps that span of time for
+ *   tracephases().  Sets "*t" to now, the start of the next phase.
+ */
+static void
+phasemark(int phase, struct timespec *t)
+{
+	struct Histogram *h = &phase_hists[phase];
+	struct timespec now;
+	uint64_t ns;
+
+	if ((!stats_enabled && trace_fd < 0) ||
+	    (t->tv_sec == 0 && t->tv_nsec == 0))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - t->tv_sec) * 1000000000ULL + now.tv_nsec -
+	    t->tv_nsec;
+	if (trace_fd >= 0) {
+		trace_phases[phase].start = *t;
+		trace_phases[phase].ns = ns;
+		trace_pending |= 1 << phase;
+	}
+	*t = now;
+	if (!stats_enabled)
+		return;
+	h->counts[histbucket(ns)]++;
+	h->n++;
+	h->sum += ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the bucket that a time of "ns" nanoseconds is counted in.
+ *   Times below 2^HISTSUBBITS have a bucket each.  Above that, each
+ *   power of two is split into 2^HISTSUBBITS buckets by the bits that
+ *   follow the leading one.
+ */
+static int
+histbucket(uint64_t ns)
+{
+	int shift;
+
+	if (ns < (1 << HISTSUBBITS))
+		return (ns);
+	shift = 63 - __builtin_clzll(ns) - HISTSUBBITS;
+	return (((shift + 1) << HISTSUBBITS) |
+	    ((ns >> shift) & ((1 << HISTSUBBITS) - 1)));
+}
+
+/*
+ * Requires:
+ *   "h" points to a histogram in which at least one time was counted,
+ *   and "fraction" is between 0 and 1.
+ *
+ * Effects:
+ *   Returns a time that at least "fraction" of the counted times do not
+ *   exceed: the largest time in the bucket that holds that percentile,
+ *   or the largest time counted if that is smaller.
+ */
+static uint64_t
+histpercentile(const struct Histogram *h, double fraction)
+{
+	uint64_t rank, seen = 0, top;
+	int i, shift;
+
+	rank = fraction * h->n;
+	if (rank < fraction * h->n || rank == 0)
+		rank++;
+	for (i = 0; i < HISTBUCKETS - 1; i++)
+		if ((seen += h->counts[i]) >= rank)
+			break;
+	if (i < (1 << HISTSUBBITS))
+		top = i;
+	else {
+		shift = (i >> HISTSUBBITS) - 1;
+		top = ((((uint64_t)1 << HISTSUBBITS) |
+		    (i & ((1 << HISTSUBBITS) - 1))) << shift) +
+		    ((uint64_t)1 << shift) - 1;
+	}
+	return (top < h->max ? top : h->max);
+}
+
+/*
+ * Requires:
+ *   "buf" has room for "size" bytes.
+ *
+ * Effects:
+ *   Formats a time of "ns" nanoseconds in "buf", in the unit that suits
+ *   it, and returns the length.
+ */
+static int
+formatduration(char *buf, size_t size, uint64_t ns)
+{
+
+	if (ns < 1000)
+		return (snprintf(buf, size, "%dns", (int)ns));
+	if (ns < 1000000)
+		return (snprintf(buf, size, "%.1fus", ns / 1e3));
+	if (ns < 1000000000)
+		return (snprintf(buf, size, "%.1fms", ns / 1e6));
+	return (snprintf(buf, size, "%.2fs", ns / 1e9));
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Prints, for each phase, how many times it was timed and the mean,
+ *   median, 99th and 99.9th percentile and largest of those times.
+ */
+static void
+printstats(void)
+{
+	static const double fractions[] = { 0.5, 0.99, 0.999 };
+	const struct Histogram *h;
+	char buf[32];
+	int i, phase;
+
+	printf("%-8s %10s %10s %10s %10s %10s %10s\n", "phase", "count",
+	    "mean", "p50", "p99", "p999", "max");
+	for (phase = 0; phase < NPHASES; phase++) {
+		h = &phase_hists[phase];
+		printf("%-8s %10llu", phase_names[phase],
+		    (unsigned long long)h->n);
+		if (h->n == 0) {
+			printf("\n");
+			continue;
+		}
+		formatduration(buf, sizeof(buf), h->sum / h->n);
+		printf(" %10s", buf);
+		for (i = 0; i < 3; i++) {
+			formatduration(buf, sizeof(buf),
+			    histpercentile(h, fractions[i]));
+			printf(" %10s", buf);
+		}
+		formatduration(buf, sizeof(buf), h->max);
+		printf(" %10s\n", buf);
+	}
+}
+
+/*
+ * This comment marks the end of the phase timing routines.
+ */
+
+/*
+ * The following helper routines record a trace of the jobs for -T.
+ */
+
+/*
+ * Requires:
+ *   "path" is the name of the file to write the trace to.
+ *
+ * Effects:
+ *   Creates the file, maps it into memory, and begins the trace with the
+ *   names of the shell's process and row.  Terminates the program if the
+ *   file cannot be created.
+ */
+static void
+traceopen(const char *path)
+{
+
+	if ((trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0666)) < 0)
+		unix_error("Failed opening trace");
+	trace_cap = TRACESIZE;
+	if (ftruncate(trace_fd, trace_cap) < 0 ||
+	    (trace_buf = mmap(NULL, trace_cap, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, trace_fd, 0)) == MAP_FAILED)
+		unix_error("Failed mapping trace");
+	shell_pid = getpid();
+	clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+	tracecat("[\n", 2);
+	traceprintf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	    "\"args\":{\"name\":\"tsh\"}}", (int)shell_pid);
+	traceprintf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+	    "\"tid\":%d,\"args\":{\"name\":\"shell\"}}", (int)shell_pid,
+	    (int)shell_pid);
+	trace_events = 2;
 }
 
 /*
- * The signal handlers follow.
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   If a trace is being recorded, ends the rows of the jobs that remain,
+ *   ends the trace, which leaves the file holding a JSON array of the
+ *   events, and stops tracing.
  */
+static void
+traceclose(void)
+{
+	JobP job;
+	int jid;
 
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *  a child job terminates (becomes a zombie), or stops because it
- *  received a SIGSTOP or SIGTSTP signal.  The handler reaps all
- *  available zombie children, but doesn't wait for any other
- *  currently running children to terminate.  
- *
+	if (trace_fd < 0)
+		return;
+	for (jid = 1; jid <= jobs.maxjid; jid++)
+		if ((job = getjobjid(&jobs, jid)) != NULL)
+			traceinterval(job);
+	tracesignals();
+	tracecat("\n]\n", 3);
+	munmap(trace_buf, trace_cap);
+	if (ftruncate(trace_fd, trace_len) < 0)
+		perror("Failed truncating trace");
+	close(trace_fd);
+	trace_fd = -1;
+	trace_buf = NULL;
+}
+
+/*
  * Requires:
- *   An integer corresponding to the type of signal.
+ *   A trace is being recorded.
  *
  * Effects:
- *   Reaps all of the zombie children and delets their corresponding 
- *   job structs from jobs.
+ *   Appends "len" bytes at "s" to the trace, first growing the file and
+ *   its mapping if they are full.  Stops tracing if they cannot grow,
+ *   leaving the file without the closing bracket, which the format
+ *   allows.
  */
 static void
-sigchld_handler(int signum)
+tracecat(const char *s, size_t len)
 {
-	(void)signum;
-        int olderrno = errno;
-	sigset_t mask_all, prev_all;
-	pid_t pid;
-	int stat_loc;
+	size_t cap;
+	char *buf;
 
-	sigfillset(&mask_all);
-	while ((pid = waitpid(-1, &stat_loc, WNOHANG | WUNTRACED)) > 0) {
-		// If a job is stopped, we print it and stop it
-		if (WIFSTOPPED(stat_loc)) {
-			Sio_puts("Job [");
-			Sio_putl((long) pid2jid(pid));
-			Sio_puts("] (");
-			Sio_putl((long) pid);
-			Sio_puts(") stopped by signal SIGTSTP\n");
-			sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-			JobP job = getjobpid(jobs, pid);
-			job->state = ST;
-			sigprocmask(SIG_SETMASK, &prev_all, NULL);
-		} else {
-			// If the job was terminated by signal
-			if (WIFSIGNALED(stat_loc)) {
-				Sio_puts("Job [");
-				Sio_putl((long) pid2jid(pid));
-				Sio_puts("] (");
-				Sio_putl((long) pid);
-				Sio_puts(") terminated by signal SIGINT\n");
-			}
-			// Delete task
-			sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-			deletejob(jobs, pid);
-			sigprocmask(SIG_SETMASK, &prev_all, NULL);
+	if (trace_fd < 0)
+		return;
+	if (trace_len + len > trace_cap) {
+		for (cap = trace_cap * 2; trace_len + len > cap; cap *= 2)
+			continue;
+		if (ftruncate(trace_fd, cap) < 0 || (buf = mremap(trace_buf,
+		    trace_cap, cap, MREMAP_MAYMOVE)) == MAP_FAILED) {
+			perror("Failed growing trace");
+			munmap(trace_buf, trace_cap);
+			if (ftruncate(trace_fd, trace_len) < 0)
+				perror("Failed truncating trace");
+			close(trace_fd);
+			trace_fd = -1;
+			trace_buf = NULL;
+			return;
 		}
+		trace_buf = buf;
+		trace_cap = cap;
 	}
+	memcpy(trace_buf + trace_len, s, len);
+	trace_len += len;
+}
 
-	errno = olderrno;
+/*
+ * Requires:
+ *   A trace is being recorded, and "fmt" is a printf() format whose
+ *   result is not too long for a line of the trace.
+ *
+ * Effects:
+ *   Appends the formatted arguments to the trace.
+ */
+static void
+traceprintf(const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(buf))
+		len = sizeof(buf) - 1;
+	if (len > 0)
+		tracecat(buf, len);
 }
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenever the
- *  user types ctrl-c at the keyboard.  Catch it and send it along
- *  to the foreground job.  
+/*
+ * Requires:
+ *   "t" is a time read from CLOCK_MONOTONIC.
  *
+ * Effects:
+ *   Returns the time of the trace, in microseconds, that "t" is.
+ */
+static double
+tracetime(const struct timespec *t)
+{
+
+	return ((t->tv_sec - trace_epoch.tv_sec) * 1e6 +
+	    (t->tv_nsec - trace_epoch.tv_nsec) / 1e3);
+}
+
+/*
  * Requires:
- *   An integer corresponding to the type of signal.
+ *   A trace is being recorded, and "job" points to a job that has just
+ *   been added to the jobs list.
  *
  * Effects:
- *   Terminates each process in the foregound by sending a SIGINT signal 
- *   and then displays information about the job that was terminated. 
+ *   Names the job's row of the trace by its job ID and command line.
  */
 static void
-sigint_handler(int signum)
+tracejob(JobP job)
 {
-        pid_t pid = fgpid(jobs);
-	if (pid == 0) {
-		return;
+	const char *cp;
+	char c;
+
+	tracesignals();
+	traceprintf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+	    "\"tid\":%d,\"args\":{\"name\":\"[%d] ", (int)shell_pid,
+	    (int)job->pid, job->jid);
+	// Quote the command line as a JSON string, without its newline.
+	for (cp = jobcmdline(&jobs, job); (c = *cp) != '\0' && c != '\n';
+	    cp++) {
+		if (c == '"' || c == '\\')
+			tracecat("\\", 1);
+		if ((unsigned char)c < 0x20)
+			traceprintf("\\u%04x", c);
+		else
+			tracecat(&c, 1);
 	}
-	// send signal to every process in pid process group
-	kill(-pid, signum);
+	tracecat("\"}}", 3);
+	trace_events++;
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *  the user types ctrl-z at the keyboard.  Catch it and suspend the
- *  foreground job by sending it a SIGTSTP.  
+ * Requires:
+ *   A trace is being recorded, and "job" points to a job whose state
+ *   is about to change between stopped and not, or that is about to be
+ *   deleted.
  *
+ * Effects:
+ *   Adds to the job's row the span since it last stopped or continued,
+ *   labeled with whether it was running or stopped.
+ */
+static void
+traceinterval(JobP job)
+{
+	struct timespec now;
+
+	tracesignals();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	traceprintf(",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+	    "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+	    job->state == ST ? "stopped" : "running",
+	    tracetime((struct timespec *)&job->since),
+	    tracetime(&now) - tracetime((struct timespec *)&job->since),
+	    (int)shell_pid, (int)job->pid);
+	job->since = now;
+	trace_events++;
+}
+
+/*
  * Requires:
- *   An integer corresponding to the type of signal.
+ *   "pid" is the process that the phases were for, or 0 if none.
  *
  * Effects:
- *   Places each process in the foreground in the stopped state by sending 
- *   a SIGSTP signal.
+ *   If a trace is being recorded, adds to the shell's row the phases
+ *   that phasemark() has timed since this was last called, each noting
+ *   "pid".
  */
 static void
-sigtstp_handler(int signum)
+tracephases(pid_t pid)
 {
-	pid_t pid = fgpid(jobs);
-	if (pid == 0) {
+	int phase;
+
+	if (trace_fd < 0)
 		return;
+	tracesignals();
+	for (phase = 0; phase < NPHASES; phase++) {
+		if ((trace_pending & (1 << phase)) == 0)
+			continue;
+		traceprintf(",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+		    "\"dur\":%.3f,\"pid\":%d,\"tid\":%d", phase_names[phase],
+		    tracetime(&trace_phases[phase].start),
+		    trace_phases[phase].ns / 1e3, (int)shell_pid,
+		    (int)shell_pid);
+		if (pid != 0)
+			traceprintf(",\"args\":{\"pid\":%d}}", (int)pid);
+		else
+			tracecat("}", 1);
+		trace_events++;
 	}
-	// send signal to every process in pid process group
-	kill(-pid, signum);
+	trace_pending = 0;
 }
 
 /*
- * sigquit_handler - The driver program can gracefully terminate the
- *  child shell by sending it a SIGQUIT signal.
+ * Requires:
+ *   "sig" was just sent to the process group "pgid".
  *
+ * Effects:
+ *   If a trace is being recorded, queues the signal for tracesignals()
+ *   to add to the trace, unless the queue is full.  This function can be
+ *   safely called by a signal handler, as long as it cannot interrupt
+ *   another call, so sigint_handler() and sigtstp_handler() block each
+ *   other.
+ */
+static void
+tracesignal(int sig, pid_t pgid)
+{
+	struct TraceSignal *event;
+	unsigned int tail;
+
+	if (trace_fd < 0)
+		return;
+	tail = atomic_load_explicit(&trace_sigs.tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&trace_sigs.head,
+	    memory_order_acquire) == TRACESIGQSIZE)
+		return;
+	event = &trace_sigs.events[tail % TRACESIGQSIZE];
+	event->sig = sig;
+	event->pgid = pgid;
+	clock_gettime(CLOCK_MONOTONIC, &event->time);
+	atomic_store_explicit(&trace_sigs.tail, tail + 1,
+	    memory_order_release);
+}
+
+/*
  * Requires:
- *   "signum" is SIGQUIT.
+ *   A trace is being recorded.
  *
  * Effects:
- *   Terminates the program.
+ *   Adds every signal that tracesignal() has queued to the row of the job
+ *   that it was sent to, as an instant event.
  */
 static void
-sigquit_handler(int signum)
+tracesignals(void)
 {
+	struct TraceSignal event;
+	unsigned int head;
 
-	// Prevent an "unused parameter" warning.
-	(void)signum;
-	Sio_puts("Terminating after receipt of SIGQUIT signal\n");
-	_exit(1);
+	head = atomic_load_explicit(&trace_sigs.head, memory_order_relaxed);
+	while (head != atomic_load_explicit(&trace_sigs.tail,
+	    memory_order_acquire)) {
+		event = trace_sigs.events[head % TRACESIGQSIZE];
+		atomic_store_explicit(&trace_sigs.head, ++head,
+		    memory_order_release);
+		traceprintf(",\n{\"name\":\"SIG%s\",\"ph\":\"i\",\"s\":\"t\","
+		    "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", signame[event.sig],
+		    tracetime(&event.time), (int)shell_pid, (int)event.pgid);
+		trace_events++;
+	}
 }
 
 /*
- * This comment marks the end of the signal handlers.
+ * This comment marks the end of the trace routines.
  */
 
 /*
- * The following helper routines manipulate the jobs list.
+ * The following helper routines manage the output cache.
  */
 
 /*
  * Requires:
- *   "job" points to a job structure.
+ *   Nothing.
  *
  * Effects:
- *   Clears the fields in the referenced job structure.
+ *   Returns the directory of the output cache, which is "tsh" in
+ *   $XDG_CACHE_HOME or in $HOME/.cache unless the cache built-in command
+ *   has moved it.  If "create" is true, first creates the directory and
+ *   any missing parents, and returns NULL after printing an error message
+ *   if that fails.
  */
-static void
-clearjob(JobP job)
+static const char *
+cachedir(bool create)
 {
+	char path[PATH_MAX], *p, c;
+	const char *base;
 
-	job->pid = 0;
-	job->jid = 0;
-	job->state = UNDEF;
-	job->cmdline[0] = '\0';
+	if (cache_dir == NULL) {
+		if ((base = getenv("XDG_CACHE_HOME")) != NULL &&
+		    base[0] == '/')
+			snprintf(path, sizeof(path), "%s/tsh", base);
+		else if ((base = getenv("HOME")) != NULL)
+			snprintf(path, sizeof(path), "%s/.cache/tsh", base);
+		else
+			snprintf(path, sizeof(path), "/tmp/tsh-cache-%d",
+			    (int)getuid());
+		if ((cache_dir = strdup(path)) == NULL)
+			Sio_error("Failed allocating memory");
+	}
+	if (!create || mkdir(cache_dir, 0700) == 0 || errno == EEXIST)
+		return (cache_dir);
+
+	// Create each missing directory along the way.
+	snprintf(path, sizeof(path), "%s", cache_dir);
+	for (p = path + 1; ; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		c = *p;
+		*p = '\0';
+		if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+			printf("%s: %s\n", path, strerror(errno));
+			return (NULL);
+		}
+		if ((*p = c) == '\0')
+			break;
+	}
+	return (cache_dir);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "b" is the running batch, whose next command is "stage", with its
+ *   stdout set, and "vars" and "files" are the arguments of the
+ *   command's "cached" prefix, or NULL.
  *
  * Effects:
- *   Initializes the jobs list to an empty state.
+ *   If the output cache has an entry for the command, replays its output
+ *   and records the command as the batch's next, finished with the exit
+ *   status saved in the entry, and returns true.  Otherwise, has the
+ *   command's output saved when it is launched and returns false.
  */
-static void
-initjobs(JobP jobs)
+static bool
+batchcached(struct Batch *b, struct Stage *stage, const char *vars,
+    const char *files)
 {
-	int i;
+	struct BatchCmd *cmd = &b->cmds[b->ncmds];
+	struct Stage keyed = *stage;
+	const struct CacheKey *key;
+	int status;
 
-	for (i = 0; i < MAXJOBS; i++)
-		clearjob(&jobs[i]);
+	// Every command's stdin is /dev/null, which is no input to key.
+	keyed.fds[STDIN_FILENO] = -1;
+	if (cachedir(false) == NULL || (key = cachekey(&keyed, vars, files,
+	    &batch_arena)) == NULL)
+		return (false);
+	if ((status = cachereplay(stage, key)) >= 0) {
+		cmd->pid = 0;
+		cmd->done = true;
+		cmd->status = W_EXITCODE(status, 0);
+		if (status != 0)
+			b->failed++;
+		return (true);
+	}
+	if (cachedir(true) != NULL) {
+		stage->cache = key;
+		cache_misses++;
+	}
+	return (false);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "stage" is the only stage of a command, whose executable has been
+ *   found and whose redirections have been applied.  "vars" and
+ *   "files", if not NULL, are lists separated by commas of the
+ *   environment variables and files that the command depends on.
  *
  * Effects:
- *   Returns the largest allocated job ID.
+ *   Returns the key of the command's entry in the output cache,
+ *   allocated from "arena".  The key records the arguments, the
+ *   identity and modification time of the executable, the current
+ *   directory, the values of "vars", the identity and modification time
+ *   of "files" and of the file redirected to stdin, or the body of a
+ *   here-document.  Returns NULL if the key could not be made.
  */
-static int
-maxjid(JobP jobs) 
+static struct CacheKey *
+cachekey(const struct Stage *stage, const char *vars, const char *files,
+    struct Arena *arena)
+{
+	static const uint64_t fnv_offset = 14695981039346656037ULL;
+	static const uint64_t fnv_prime = 1099511628211ULL;
+	struct CacheKey *key;
+	struct stat sb;
+	char cwd[PATH_MAX], *buf, *name, data[4096];
+	const char *list, *value;
+	uint64_t hash;
+	size_t i, len, n;
+	ssize_t got;
+	off_t off;
+	FILE *f;
+	int in = stage->fds[STDIN_FILENO];
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL ||
+	    (f = open_memstream(&buf, &len)) == NULL)
+		return (NULL);
+	for (i = 0; stage->argv[i] != NULL; i++)
+		fprintf(f, "arg %s%c", stage->argv[i], '\0');
+	keystat(f, "exe", stage->executable, -1);
+	fprintf(f, "cwd %s%c", cwd, '\0');
+	for (list = vars; list != NULL && *list != '\0'; list += n) {
+		n = strcspn(list, ",");
+		name = arena_strndup(arena, list, n);
+		if ((value = getenv(name)) != NULL)
+			fprintf(f, "env %s=%s%c", name, value, '\0');
+		else
+			fprintf(f, "unset %s%c", name, '\0');
+		if (list[n] == ',')
+			n++;
+	}
+	for (list = files; list != NULL && *list != '\0'; list += n) {
+		n = strcspn(list, ",");
+		keystat(f, "file", arena_strndup(arena, list, n), -1);
+		if (list[n] == ',')
+			n++;
+	}
+	// A here-document, unlike a file, is only known by its body.
+	if (in >= 0 && fstat(in, &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    sb.st_nlink == 0) {
+		fprintf(f, "body ");
+		for (off = 0; (got = pread(in, data, sizeof(data), off)) > 0;
+		    off += got)
+			fwrite(data, 1, got, f);
+		fputc('\0', f);
+	} else if (in >= 0)
+		keystat(f, "stdin", NULL, in);
+	if (fclose(f) != 0) {
+		free(buf);
+		return (NULL);
+	}
+
+	key = arena_alloc(arena, sizeof(*key));
+	key->key = arena_alloc(arena, len);
+	memcpy(key->key, buf, len);
+	key->len = len;
+	free(buf);
+	hash = fnv_offset;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)key->key[i]) * fnv_prime;
+	snprintf(key->name, sizeof(key->name), "%016llx",
+	    (unsigned long long)hash);
+	return (key);
+}
+
+/*
+ * Requires:
+ *   "f" is a stream open for writing, and either "path" is the name of a
+ *   file or "fd" is a descriptor for one.
+ *
+ * Effects:
+ *   Writes a field of a cache key to "f" that is labeled "what" and holds
+ *   the path, device, inode, size and modification and change times of
+ *   the file, or the path and "-" if it does not exist.
+ */
+static void
+keystat(FILE *f, const char *what, const char *path, int fd)
 {
-	int i, max = 0;
+	struct stat sb;
 
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].jid > max)
-			max = jobs[i].jid;
-	return (max);
+	if ((path != NULL ? stat(path, &sb) : fstat(fd, &sb)) < 0)
+		fprintf(f, "%s %s -%c", what, path != NULL ? path : "", '\0');
+	else
+		fprintf(f, "%s %s %ju:%ju %jd %jd.%09ld %jd.%09ld%c", what,
+		    path != NULL ? path : "", (uintmax_t)sb.st_dev,
+		    (uintmax_t)sb.st_ino, (intmax_t)sb.st_size,
+		    (intmax_t)sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec,
+		    (intmax_t)sb.st_ctim.tv_sec, sb.st_ctim.tv_nsec, '\0');
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures, and "cmdline" is
- *   a properly terminated string.
+ *   "argv[*ip]" is "cached", and "varsp" and "filesp" point to the
+ *   prefix's variables and files, or to NULL.
  *
- * Effects: 
- *   Adds a job to the jobs list. 
+ * Effects:
+ *   Advances "*ip" past the "cached" prefix and its "-e" and "-i"
+ *   options, storing the variables and files that the command depends on
+ *   in "*varsp" and "*filesp", and returns true.  Returns false and
+ *   prints an error message if an option is missing its argument.
  */
-static int
-addjob(JobP jobs, pid_t pid, int state, const char *cmdline)
+static bool
+parsecached(char **argv, int *ip, const char **varsp, const char **filesp)
 {
-	int i;
-    
-	if (pid < 1)
-		return (0);
-	for (i = 0; i < MAXJOBS; i++) {
-		if (jobs[i].pid == 0) {
-			jobs[i].pid = pid;
-			jobs[i].state = state;
-			jobs[i].jid = nextjid++;
-			if (nextjid > MAXJOBS)
-				nextjid = 1;
-			// Remove the "volatile" qualifier using a cast.
-			strcpy((char *)jobs[i].cmdline, cmdline);
-			if (verbose) {
-				printf("Added job [%d] %d %s\n", jobs[i].jid,
-				    (int)jobs[i].pid, jobs[i].cmdline);
-			}
-			return (1);
+	int i = *ip + 1;
+
+	while (argv[i] != NULL && (!strcmp(argv[i], "-e") ||
+	    !strcmp(argv[i], "-i"))) {
+		if (argv[i + 1] == NULL) {
+			printf("cached %s requires an argument\n", argv[i]);
+			return (false);
 		}
+		if (argv[i][1] == 'e')
+			*varsp = argv[i + 1];
+		else
+			*filesp = argv[i + 1];
+		i += 2;
 	}
-	printf("Tried to create too many jobs\n");
-	return (0);
+	*ip = i;
+	return (true);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "stage" is the stage whose key is "key", with its redirections
+ *   applied, and cachedir() has been called.
  *
  * Effects:
- *   Deletes a job from the jobs list whose PID equals "pid".
+ *   If the output cache has an entry for "key", writes the stdout and
+ *   then the stderr saved in the entry to the stage's descriptors or to
+ *   the shell's own, marks the entry as the most recently used, and
+ *   returns the exit status saved in it.  Otherwise, returns -1.
  */
 static int
-deletejob(JobP jobs, pid_t pid) 
+cachereplay(const struct Stage *stage, const struct CacheKey *key)
 {
-	int i;
+	const struct CacheHeader *header;
+	const char *data;
+	struct stat sb;
+	char path[PATH_MAX];
+	uint64_t size;
+	int fd, status = -1;
 
-	if (pid < 1)
-		return (0);
-	for (i = 0; i < MAXJOBS; i++) {
-		if (jobs[i].pid == pid) {
-			clearjob(&jobs[i]);
-			nextjid = maxjid(jobs) + 1;
-			return (1);
+	snprintf(path, sizeof(path), "%s/%s", cache_dir, key->name);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return (-1);
+	size = fstat(fd, &sb) == 0 ? (uint64_t)sb.st_size : 0;
+	if (size >= sizeof(*header) && (header = mmap(NULL, size, PROT_READ,
+	    MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+		data = (const char *)(header + 1);
+		// The key is compared in full, so hashes may collide.
+		if (!memcmp(header->magic, CACHEMAGIC,
+		    sizeof(header->magic)) && header->keylen == key->len &&
+		    header->outlen <= size && header->errlen <= size &&
+		    sizeof(*header) + header->keylen + header->outlen +
+		    header->errlen == size &&
+		    !memcmp(data, key->key, key->len)) {
+			data += header->keylen;
+			fflush(stdout);
+			writeall(stage->fds[STDOUT_FILENO] >= 0 ?
+			    stage->fds[STDOUT_FILENO] : STDOUT_FILENO, data,
+			    header->outlen);
+			writeall(stage->fds[STDERR_FILENO] >= 0 ?
+			    stage->fds[STDERR_FILENO] : STDERR_FILENO,
+			    data + header->outlen, header->errlen);
+			futimens(fd, NULL);
+			cache_hits++;
+			status = header->status;
 		}
+		munmap((void *)header, size);
 	}
-	return (0);
+	close(fd);
+	return (status);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "stage" has an entry of the output cache to fill, and the calling
+ *   process is a child created to run it, with its process group,
+ *   descriptors and signal mask in place.
  *
  * Effects:
- *   Returns the PID of the current foreground job or 0 if no foreground
- *   job exists.
+ *   Runs the stage's command in a child of its own, copying what it
+ *   writes to its stdout and stderr both to the calling process's and to
+ *   a new entry, which is added to the cache if the command exits
+ *   normally and the entry fits.  Then ends the calling process the way
+ *   that the command ended, so that the shell sees the job as it would
+ *   have seen the command.  Does not return.
  */
-static pid_t
-fgpid(JobP jobs)
+static void
+runcached(const struct Stage *stage)
 {
-	int i;
+	const struct CacheKey *key = stage->cache;
+	struct CacheHeader header;
+	struct pollfd fds[2];
+	char buf[8192], from[PATH_MAX], to[PATH_MAX], *err = NULL, *grown;
+	size_t errcap = 0;
+	uint64_t total;
+	ssize_t n;
+	pid_t pid;
+	int fd, i, nopen, out[2], errout[2], status;
+	bool keep;
 
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].state == FG)
-			return (jobs[i].pid);
-	return (0);
+	// The shell's handler must not reap the command.
+	signal(SIGCHLD, SIG_DFL);
+	if ((fd = open(cache_dir, O_TMPFILE | O_WRONLY | O_CLOEXEC,
+	    0600)) < 0 || pipe2(out, O_CLOEXEC) < 0 ||
+	    pipe2(errout, O_CLOEXEC) < 0) {
+		// Just run the command.
+		execve(stage->executable, stage->argv, environ);
+		printf("%s: Command not found\n", stage->argv[0]);
+		exit(0);
+	}
+	if ((pid = fork()) == 0) {
+		dup2(out[1], STDOUT_FILENO);
+		dup2(errout[1], STDERR_FILENO);
+		execve(stage->executable, stage->argv, environ);
+		printf("%s: Command not found\n", stage->argv[0]);
+		exit(0);
+	} else if (pid < 0) {
+		printf("Task creation failed.\n");
+		exit(1);
+	}
+	close(out[1]);
+	close(errout[1]);
+
+	// Fill in the header once the lengths are known.
+	memset(&header, 0, sizeof(header));
+	keep = writeall(fd, (char *)&header, sizeof(header)) == 0 &&
+	    writeall(fd, key->key, key->len) == 0;
+	total = sizeof(header) + key->len;
+	fds[0].fd = out[0];
+	fds[1].fd = errout[0];
+	fds[0].events = fds[1].events = POLLIN;
+	for (nopen = 2; nopen > 0; ) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			keep = false;
+			break;
+		}
+		for (i = 0; i < 2; i++) {
+			if (fds[i].revents == 0)
+				continue;
+			if ((n = read(fds[i].fd, buf, sizeof(buf))) <= 0) {
+				if (n < 0 && errno == EINTR)
+					continue;
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				nopen--;
+				continue;
+			}
+			writeall(i == 0 ? STDOUT_FILENO : STDERR_FILENO, buf,
+			    n);
+			if (!keep || (total += n) > cache_size) {
+				keep = false;
+				continue;
+			}
+			// stdout goes straight to the entry, stderr after it.
+			if (i == 0) {
+				keep = writeall(fd, buf, n) == 0;
+				header.outlen += n;
+				continue;
+			}
+			if (header.errlen + n > errcap) {
+				errcap = 2 * (header.errlen + n);
+				if ((grown = realloc(err, errcap)) == NULL) {
+					keep = false;
+					continue;
+				}
+				err = grown;
+			}
+			memcpy(err + header.errlen, buf, n);
+			header.errlen += n;
+		}
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			_exit(1);
+
+	if (keep && WIFEXITED(status)) {
+		memcpy(header.magic, CACHEMAGIC, sizeof(header.magic));
+		header.keylen = key->len;
+		header.status = WEXITSTATUS(status);
+		// Give the finished entry its name in one step.
+		snprintf(from, sizeof(from), "/proc/self/fd/%d", fd);
+		snprintf(to, sizeof(to), "%s/.%s.%d", cache_dir, key->name,
+		    (int)getpid());
+		if (writeall(fd, err, header.errlen) == 0 &&
+		    pwrite(fd, &header, sizeof(header), 0) ==
+		    (ssize_t)sizeof(header) &&
+		    linkat(AT_FDCWD, from, AT_FDCWD, to,
+		    AT_SYMLINK_FOLLOW) == 0) {
+			snprintf(from, sizeof(from), "%s/%s", cache_dir,
+			    key->name);
+			if (rename(to, from) < 0)
+				unlink(to);
+			else
+				evictcache();
+		}
+	}
+	if (WIFSIGNALED(status)) {
+		signal(WTERMSIG(status), SIG_DFL);
+		kill(getpid(), WTERMSIG(status));
+	}
+	_exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   cachedir() has been called.
  *
  * Effects:
- *   Returns a pointer to the job structure with process ID "pid" or NULL if
- *   no such job exists.
+ *   Removes the least recently used entries of the output cache until
+ *   the rest fit within its size.
  */
-static JobP
-getjobpid(JobP jobs, pid_t pid)
+static void
+evictcache(void)
 {
-	int i;
+	struct CacheUse *uses;
+	unsigned long long total;
+	char path[PATH_MAX];
+	int i, n;
 
-	if (pid < 1)
-		return (NULL);
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].pid == pid)
-			return (&jobs[i]);
-	return (NULL);
+	if ((n = scancache(&uses, &total)) < 0)
+		return;
+	if (total > cache_size) {
+		qsort(uses, n, sizeof(*uses), cacheusecmp);
+		for (i = 0; i < n && total > cache_size; i++) {
+			snprintf(path, sizeof(path), "%s/%s", cache_dir,
+			    uses[i].name);
+			if (unlink(path) == 0)
+				total -= uses[i].size;
+		}
+	}
+	free(uses);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   cachedir() has been called, and "usesp" and "totalp" point to where
+ *   the results should be stored.
  *
  * Effects:
- *   Returns a pointer to the job structure with job ID "jid" or NULL if no
- *   such job exists.
+ *   Stores an array of the entries of the output cache, allocated with
+ *   malloc(), in "*usesp" and their total size in "*totalp", and returns
+ *   the number of entries.  Returns -1 if the cache cannot be read.
  */
-static JobP
-getjobjid(JobP jobs, int jid) 
+static int
+scancache(struct CacheUse **usesp, unsigned long long *totalp)
 {
-	int i;
+	struct CacheUse *uses = NULL, *grown;
+	struct dirent *ent;
+	struct stat sb;
+	DIR *dir;
+	int cap = 0, n = 0;
 
-	if (jid < 1)
-		return (NULL);
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].jid == jid)
-			return (&jobs[i]);
-	return (NULL);
+	*totalp = 0;
+	if ((dir = opendir(cache_dir)) == NULL)
+		return (-1);
+	while ((ent = readdir(dir)) != NULL) {
+		// Entries are named by 16 hex digits; nothing else is one.
+		if (strlen(ent->d_name) != 16 ||
+		    strspn(ent->d_name, "0123456789abcdef") != 16 ||
+		    fstatat(dirfd(dir), ent->d_name, &sb, 0) < 0)
+			continue;
+		if (n == cap) {
+			cap = cap > 0 ? 2 * cap : 64;
+			if ((grown = realloc(uses, cap * sizeof(*uses))) ==
+			    NULL)
+				break;
+			uses = grown;
+		}
+		uses[n].used = sb.st_mtim;
+		uses[n].size = sb.st_size;
+		memcpy(uses[n].name, ent->d_name, sizeof(uses[n].name));
+		*totalp += sb.st_size;
+		n++;
+	}
+	closedir(dir);
+	*usesp = uses;
+	return (n);
 }
 
 /*
  * Requires:
- *   Nothing.
+ *   "a" and "b" point to entries of the output cache.
  *
  * Effects:
- *   Returns the job ID for the job with process ID "pid" or 0 if no such
- *   job exists.
+ *   Orders entries from the least to the most recently used.
  */
 static int
-pid2jid(pid_t pid) 
+cacheusecmp(const void *a, const void *b)
 {
-	int i;
+	const struct timespec *x = &((const struct CacheUse *)a)->used;
+	const struct timespec *y = &((const struct CacheUse *)b)->used;
 
-	if (pid < 1)
-		return (0);
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].pid == pid)
-			return (jobs[i].jid);
-	return (0);
+	if (x->tv_sec != y->tv_sec)
+		return (x->tv_sec < y->tv_sec ? -1 : 1);
+	return ((x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec));
 }
 
 /*
+ * This comment marks the end of the output cache routines.
+ */
+
+/*
+ * The following helper routines serve clients over a socket.
+ */
+
+/*
+ * serve - Serve clients over a Unix domain socket.
+ *
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "path" is a properly terminated string, and the signal handlers,
+ *   search path and jobs list have been initialized.
  *
  * Effects:
- *   Prints the jobs list.
+ *   Listens on the socket "path", replacing one that no server answers
+ *   on, and waits with epoll for clients and for signals.  For each
+ *   client that connects, forks a session that returns from serve() in
+ *   a new session of its own, with the connection as its stdin, stdout
+ *   and stderr and with the signal mask that serve() was called with.
+ *   The server itself never returns.  It reaps sessions as they end, and
+ *   on SIGINT, SIGTERM or SIGHUP removes the socket and exits, leaving
+ *   the sessions to serve their clients until they are done.
  */
 static void
-listjobs(JobP jobs) 
+serve(const char *path)
 {
-	int i;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct epoll_event event, events[16];
+	struct signalfd_siginfo info[16];
+	struct stat sb;
+	sigset_t mask, prev;
+	ssize_t len;
+	pid_t pid;
+	int client, efd, lfd, probe, sfd, i, j, n;
 
-	for (i = 0; i < MAXJOBS; i++) {
-		if (jobs[i].pid != 0) {
-			printf("[%d] (%d) ", jobs[i].jid, (int)jobs[i].pid);
-			switch (jobs[i].state) {
-			case BG: 
-				printf("Running ");
-				break;
-			case FG: 
-				printf("Foreground ");
-				break;
-			case ST: 
-				printf("Stopped ");
-				break;
-			default:
-				printf("listjobs: Internal error: "
-				    "job[%d].state=%d ", i, jobs[i].state);
+	if (strlen(path) >= sizeof(addr.sun_path))
+		app_error("--serve: Socket path too long");
+	strcpy(addr.sun_path, path);
+	if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode) &&
+	    (probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0) {
+		if (connect(probe, (struct sockaddr *)&addr, sizeof(addr)) <
+		    0 && errno == ECONNREFUSED)
+			unlink(path);
+		close(probe);
+	}
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0)) < 0)
+		unix_error("socket error");
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		unix_error(path);
+	if (listen(lfd, SOMAXCONN) < 0)
+		unix_error("listen error");
+
+	// The handlers are for the sessions' jobs, so read signals instead.
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	if ((sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		unix_error("signalfd error");
+	if ((efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		unix_error("epoll_create1 error");
+	event.events = EPOLLIN;
+	event.data.fd = lfd;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &event) < 0)
+		unix_error("epoll_ctl error");
+	event.data.fd = sfd;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &event) < 0)
+		unix_error("epoll_ctl error");
+
+	while (true) {
+		if ((n = epoll_wait(efd, events, 16, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			unix_error("epoll_wait error");
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == sfd) {
+				while ((len = read(sfd, info, sizeof(info))) > 0)
+					for (j = 0; j < len /
+					    (ssize_t)sizeof(info[0]); j++)
+						if (info[j].ssi_signo !=
+						    SIGCHLD) {
+							unlink(path);
+							exit(0);
+						}
+				while (waitpid(-1, NULL, WNOHANG) > 0)
+					;
+				continue;
+			}
+			while ((client = accept4(lfd, NULL, NULL,
+			    SOCK_CLOEXEC)) >= 0) {
+				fflush(stdout);
+				if ((pid = fork()) == 0) {
+					close(lfd);
+					close(sfd);
+					close(efd);
+					sigprocmask(SIG_SETMASK, &prev, NULL);
+					setsid();
+					for (j = 0; j < 3; j++)
+						dup2(client, j);
+					close(client);
+					in_session = true;
+					if (launch_mode == LAUNCH_ZYGOTE)
+						startzygote();
+					return;
+				}
+				if (pid < 0)
+					printf("fork error: %s\n",
+					    strerror(errno));
+				close(client);
 			}
-			printf("%s", jobs[i].cmdline);
 		}
 	}
 }
 
 /*
- * This comment marks the end of the jobs list helper routines.
+ * Requires:
+ *   This process is a session serving one client.
+ *
+ * Effects:
+ *   Ends the jobs that are left when the client quits or hangs up.  Each
+ *   job is sent SIGHUP, as the jobs of a terminal that hangs up are, and
+ *   then SIGCONT if it is stopped.  If the server was started with
+ *   --orphan, stopped jobs are only continued, and every job is left to
+ *   run on without the shell.
+ */
+static void
+endsession(void)
+{
+	JobP job;
+	int jid;
+
+	for (jid = 1; jid <= jobs.maxjid; jid++) {
+		if ((job = getjobjid(&jobs, jid)) == NULL)
+			continue;
+		if (!orphan_jobs)
+			signaljob(&jobs, job, SIGHUP);
+		if (job->state == ST)
+			signaljob(&jobs, job, SIGCONT);
+	}
+}
+
+/*
+ * This comment marks the end of the socket server routines.
  */
 
 /*
  * Other helper routines follow.
  */
 
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Terminates the shell normally, first printing how long the phases of
+ *   commands took if -v was given and ending any trace.  A session first
+ *   ends its client's jobs, or leaves them, as endsession() does.
+ */
+static void
+quitshell(void)
+{
+
+	if (verbose)
+		printstats();
+	if (in_session)
+		endsession();
+	traceclose();
+	fflush(stdout);
+	exit(0);
+}
+
 /*
  * Requires:
  *   Nothing.
@@ -1040,10 +7713,23 @@ static void
 usage(void) 
 {
 
-	printf("Usage: shell [-hvp]\n");
+	printf("Usage: shell [-hvpszar] [-f <script>] [-T <trace>]\n");
+	printf("       shell [-hvpszar] --serve <socket> [--orphan]\n");
 	printf("   -h   print this message\n");
-	printf("   -v   print additional diagnostic information\n");
+	printf("   -v   print additional diagnostic information and,\n");
+	printf("        on exit, how long each phase of a command took\n");
 	printf("   -p   do not emit a command prompt\n");
+	printf("   -s   launch jobs with posix_spawn instead of fork\n");
+	printf("   -z   launch jobs from a pre-forked zygote process\n");
+	printf("   -a   handle signals asynchronously instead of with epoll\n");
+	printf("   -r   report the resources used by each job as it ends\n");
+	printf("   -f   read commands from <script> instead of stdin\n");
+	printf("   -T   write a timeline of the jobs to <trace>, in the\n");
+	printf("        Chrome Trace Event format\n");
+	printf("   --serve   serve each client that connects to the Unix\n");
+	printf("        domain socket <socket> from a session of its own\n");
+	printf("   --orphan  leave a session's jobs running when its client\n");
+	printf("        quits or hangs up, instead of sending them SIGHUP\n");
 	exit(1);
 }
 
@@ -1243,4 +7929,4 @@ Sio_error(const char s[])
 // Prevent "unused function" and "unused variable" warnings.
 static const void *dummy_ref[] = { Sio_error, Sio_putl, addjob, builtin_cmd,
     deletejob, do_bgfg, dummy_ref, fgpid, getjobjid, getjobpid, listjobs,
-    parseline, pid2jid, signame, waitfg };
+    pid2jid, signame, waitfg };
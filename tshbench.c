@@ -0,0 +1,1453 @@
+/*
+ * tshbench.c - Benchmarks for the tiny shell's hot paths
+ *
+ * usage: tshbench spawn [-n <count>] [-m <megabytes>]
+ *        tshbench prompt [-n <count>] [-s <shell>] [-a <args>]
+ *        tshbench jobs [-n <count>] [-m <lookups>] [-s <shell>] [-a <args>]
+ *        tshbench tokens [-n <lines>] [-a <arguments>] [-r <rounds>]
+ *        tshbench pipe [-n <count>] [-k <stages>] [-s <shell>] [-a <args>]
+ *        tshbench compare [-n <count>] [-s <shell>] [-r <refshell>]
+ *                         [-a <args>]
+ *        tshbench builtins [-n <count>] [-s <shell>] [-a <args>]
+ *        tshbench cache [-n <count>] [-s <shell>] [-a <args>]
+ *        tshbench serve [-n <count>] [-k <commands>] [-s <shell>]
+ *                       [-a <args>]
+ *
+ * spawn: Starts and reaps <count> instances of /bin/true, first with
+ *   fork() and execve() and then with posix_spawn(), after touching
+ *   <megabytes> of memory so that the cost of copying a large parent's
+ *   page tables is visible.  Reports processes launched per second.
+ *
+ * prompt: Runs <shell> (./tsh by default) with the extra arguments
+ *   <args> and has it run a foreground command <count> times.  The
+ *   command prints the time at which it exits, and the benchmark measures
+ *   the time from then until the shell prints its next prompt.  Reports
+ *   the median, 99th percentile and maximum of that latency.
+ *
+ * jobs: Runs <shell> with the extra arguments <args> and has it start
+ *   <count> background jobs that wait to be killed, then look up
+ *   <lookups> of them at random with "bg %<jid>", then list them all with
+ *   "jobs".  Reports the latency of each command, from writing it to the
+ *   shell until the shell prints its next prompt, for the first and last
+ *   tenth of the jobs started and for the lookups, and the shell's
+ *   resident set size once all of the jobs are running.
+ *
+ * tokens: Generates <lines> random command lines of <arguments> arguments
+ *   each and splits every one into arguments <rounds> times, first with
+ *   the original parseline() and then with tokenize() using each
+ *   instruction set that the processor supports.  Checks that they agree
+ *   and reports arguments found per second.  parseline() is skipped if
+ *   the lines are too long for it.
+ *
+ * pipe: Runs <shell> with the extra arguments <args> and has it run a
+ *   foreground pipeline of <stages> commands <count> times, first as a
+ *   native pipeline and then through "/bin/sh -c".  The pipeline echoes
+ *   a word through <stages> - 1 instances of /bin/cat.  Reports the
+ *   latency of each, from writing the command to the shell until the
+ *   shell prints its next prompt.
+ *
+ * compare: Runs <shell> (./tsh by default) and then <refshell> (./tshref
+ *   by default), each with the extra arguments <args>, through the same
+ *   workloads, <count> times each.  Reports the rate at which each runs
+ *   ./mytrue in the foreground, and the latency of spawning a command
+ *   (from writing it to the shell until it runs), of reaping it (from
+ *   its exit until the next prompt), of forwarding a SIGINT sent to the
+ *   shell to it, and of the round trip for ./myfanout, ./mymsint and
+ *   ./mymsstop followed by "fg".  The workloads are found in the current
+ *   directory.
+ *
+ * builtins: Runs <shell> with the extra arguments <args> and has it run
+ *   each of echo, printf, true, "kill -0" of the shell itself and
+ *   "sleep 0" <count> times, first as a built-in command and then with
+ *   the "command" prefix, which runs the program instead.  Reports the
+ *   latency of each, from writing the command to the shell until the
+ *   shell prints its next prompt.
+ *
+ * cache: Runs <shell> with the extra arguments <args> and has it run
+ *   "/bin/uname -a" <count> times, first as is and then with the "cached"
+ *   prefix and an empty output cache in a new directory under /tmp, so
+ *   that all but the first are replayed.  Reports the latency of each
+ *   the same way, and removes the cache.
+ *
+ * serve: Runs <count> tasks, each of which runs /bin/true <commands>
+ *   times in a shell and then ends it, first by starting <shell> with the
+ *   extra arguments <args> for each task, and then by connecting to a
+ *   single <shell> started with "--serve" on a socket under /tmp.  Reports
+ *   the tasks and commands completed per second each way.
+ */
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <limits.h>
+#include <stddef.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tokenize.h"
+
+#define MAXLINE      1024   // max line size for parseline()
+#define MAXARGS       128   // max args on a command line for parseline()
+
+extern char **environ;
+
+static char *true_argv[] = { "/bin/true", NULL };
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the value of the monotonic clock in seconds.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Prints a usage message and terminates the program.
+ */
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr, "Usage: %s spawn [-n <count>] [-m <megabytes>]\n",
+	    prog);
+	fprintf(stderr, "       %s prompt [-n <count>] [-s <shell>] "
+	    "[-a <args>]\n", prog);
+	fprintf(stderr, "       %s jobs [-n <count>] [-m <lookups>] "
+	    "[-s <shell>] [-a <args>]\n", prog);
+	fprintf(stderr, "       %s tokens [-n <lines>] [-a <arguments>] "
+	    "[-r <rounds>]\n", prog);
+	fprintf(stderr, "       %s pipe [-n <count>] [-k <stages>] "
+	    "[-s <shell>] [-a <args>]\n", prog);
+	fprintf(stderr, "       %s compare [-n <count>] [-s <shell>] "
+	    "[-r <refshell>] [-a <args>]\n", prog);
+	fprintf(stderr, "       %s builtins [-n <count>] [-s <shell>] "
+	    "[-a <args>]\n", prog);
+	fprintf(stderr, "       %s cache [-n <count>] [-s <shell>] "
+	    "[-a <args>]\n", prog);
+	fprintf(stderr, "       %s serve [-n <count>] [-k <commands>] "
+	    "[-s <shell>] [-a <args>]\n", prog);
+	exit(1);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Launches /bin/true in a new process group the way tsh does with
+ *   fork() and waits for it to exit.
+ */
+static void
+run_fork(const sigset_t *mask)
+{
+	pid_t pid;
+
+	if ((pid = fork()) == 0) {
+		setpgid(0, 0);
+		sigprocmask(SIG_SETMASK, mask, NULL);
+		execve(true_argv[0], true_argv, environ);
+		_exit(127);
+	}
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Launches /bin/true in a new process group the way tsh -s does with
+ *   posix_spawn() and waits for it to exit.
+ */
+static void
+run_spawn(const sigset_t *mask)
+{
+	posix_spawnattr_t attr;
+	pid_t pid;
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr,
+	    POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setsigmask(&attr, mask);
+	if (posix_spawn(&pid, true_argv[0], NULL, &attr, true_argv,
+	    environ) != 0) {
+		perror("posix_spawn");
+		exit(1);
+	}
+	posix_spawnattr_destroy(&attr);
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the spawn benchmark described at the top of this file.
+ */
+static void
+bench_spawn(int argc, char **argv)
+{
+	sigset_t mask;
+	double start, t_fork, t_spawn;
+	char *ballast;
+	size_t mb = 0;
+	int c, i, count = 2000;
+
+	while ((c = getopt(argc, argv, "n:m:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'm':
+			mb = atoi(optarg);
+			break;
+		default:
+			usage("tshbench");
+		}
+	}
+	if (mb > 0) {
+		if ((ballast = malloc(mb << 20)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		memset(ballast, 1, mb << 20);
+	}
+	sigemptyset(&mask);
+
+	start = now();
+	for (i = 0; i < count; i++)
+		run_fork(&mask);
+	t_fork = now() - start;
+
+	start = now();
+	for (i = 0; i < count; i++)
+		run_spawn(&mask);
+	t_spawn = now() - start;
+
+	printf("spawn: %d processes, %zu MB resident ballast\n", count, mb);
+	printf("  fork+execve  %10.0f /s  %8.1f us each\n", count / t_fork,
+	    t_fork / count * 1e6);
+	printf("  posix_spawn  %10.0f /s  %8.1f us each\n", count / t_spawn,
+	    t_spawn / count * 1e6);
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to doubles.
+ *
+ * Effects:
+ *   Compares two doubles for qsort().
+ */
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Requires:
+ *   "samples" is an array of "n" > 0 latencies in seconds.
+ *
+ * Effects:
+ *   Sorts the samples and prints their median, 99th percentile and
+ *   maximum, labeled with "what".
+ */
+static void
+report(const char *what, double *samples, int n)
+{
+
+	qsort(samples, n, sizeof(*samples), cmpdouble);
+	printf("  %-22s p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", what,
+	    samples[n / 2] * 1e6, samples[(int)(n * 0.99)] * 1e6,
+	    samples[n - 1] * 1e6);
+}
+
+/*
+ * Requires:
+ *   "shell" is the path of a shell and "args", if not NULL, is a string
+ *   of space separated arguments for it.  "tofd" and "fromfd" point to
+ *   ints.
+ *
+ * Effects:
+ *   Starts the shell with pipes connected to its stdin and stdout (and
+ *   stderr), stores our ends of them in "*tofd" and "*fromfd", and
+ *   returns the shell's PID.
+ */
+static pid_t
+startshell(const char *shell, char *args, int *tofd, int *fromfd)
+{
+	char *argv[32], *arg;
+	int argc = 0, in[2], out[2];
+	pid_t pid;
+
+	argv[argc++] = (char *)shell;
+	if (args != NULL)
+		for (arg = strtok(args, " "); arg != NULL && argc < 31;
+		    arg = strtok(NULL, " "))
+			argv[argc++] = arg;
+	argv[argc] = NULL;
+	if (pipe(in) < 0 || pipe(out) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	if ((pid = fork()) == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(out[1], STDERR_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execv(shell, argv);
+		perror(shell);
+		_exit(1);
+	}
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	close(in[0]);
+	close(out[1]);
+	*tofd = in[1];
+	*fromfd = out[0];
+	return (pid);
+}
+
+/*
+ * Requires:
+ *   "fd" is the read end of a pipe from a shell, "buf" holds "*lenp"
+ *   bytes previously read from it and has room for BUFSIZ bytes, and
+ *   "pattern" is a properly terminated string.
+ *
+ * Effects:
+ *   Reads from "fd" until "buf" contains "pattern", then returns a
+ *   pointer just past the pattern's first occurrence and records the
+ *   time at which it was seen in "*when".  Exits if the shell closes the
+ *   pipe first.
+ */
+static char *
+expect(int fd, char *buf, size_t *lenp, const char *pattern, double *when)
+{
+	char *match;
+	ssize_t n;
+
+	while (true) {
+		buf[*lenp] = '\0';
+		if ((match = strstr(buf, pattern)) != NULL) {
+			*when = now();
+			return (match + strlen(pattern));
+		}
+		// Keep only a tail that might hold the start of the pattern.
+		if (*lenp > BUFSIZ / 2) {
+			memmove(buf, buf + *lenp - 64, 64);
+			*lenp = 64;
+		}
+		if ((n = read(fd, buf + *lenp, BUFSIZ - 1 - *lenp)) <= 0) {
+			fprintf(stderr, "tshbench: shell exited early\n");
+			exit(1);
+		}
+		*lenp += n;
+	}
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the prompt latency benchmark described at the top of this file.
+ */
+static void
+bench_prompt(int argc, char **argv)
+{
+	char buf[BUFSIZ], cmd[PATH_MAX + 16], self[PATH_MAX], *stamp, *rest;
+	char *shell = "./tsh", *args = NULL;
+	double *samples, seen, exited;
+	size_t len = 0;
+	ssize_t n;
+	int c, i, tofd, fromfd, count = 200;
+
+	while ((c = getopt(argc, argv, "n:s:a:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			shell = optarg;
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		default:
+			usage("tshbench");
+		}
+	}
+	if (count < 1 || (samples = malloc(count * sizeof(*samples))) ==
+	    NULL)
+		usage("tshbench");
+	if ((n = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0) {
+		perror("readlink");
+		exit(1);
+	}
+	self[n] = '\0';
+	snprintf(cmd, sizeof(cmd), "%s stamp\n", self);
+
+	startshell(shell, args, &tofd, &fromfd);
+	rest = expect(fromfd, buf, &len, "tsh> ", &seen);
+	for (i = 0; i < count; i++) {
+		// Forget everything up to and including the last prompt.
+		len -= rest - buf;
+		memmove(buf, rest, len);
+		if (write(tofd, cmd, strlen(cmd)) < 0) {
+			perror("write");
+			exit(1);
+		}
+		rest = expect(fromfd, buf, &len, "tsh> ", &seen);
+		if ((stamp = strstr(buf, "STAMP ")) == NULL || stamp > rest) {
+			fprintf(stderr, "tshbench: command failed: %s", buf);
+			exit(1);
+		}
+		exited = strtod(stamp + strlen("STAMP "), NULL);
+		samples[i] = seen - exited;
+	}
+	close(tofd);
+
+	printf("prompt: %d foreground commands with %s%s%s\n", count, shell,
+	    args != NULL ? " " : "", args != NULL ? args : "");
+	report("child exit -> prompt", samples, count);
+	free(samples);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the resident set size of process "pid" in kB, or -1 if it
+ *   cannot be found.
+ */
+static long
+rss(pid_t pid)
+{
+	char path[64], line[256];
+	long kb = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	fclose(fp);
+	return (kb);
+}
+
+/*
+ * Requires:
+ *   "tofd" and "fromfd" are connected to a shell that has printed its
+ *   prompt, and everything in "buf" up to "*restp" has been consumed.
+ *
+ * Effects:
+ *   Writes "cmd" to the shell and reads until its next prompt, leaving
+ *   "*restp" just past it.  Returns the time that took.
+ */
+static double
+command(int tofd, int fromfd, char *buf, size_t *lenp, char **restp,
+    const char *cmd)
+{
+	double start, seen;
+
+	*lenp -= *restp - buf;
+	memmove(buf, *restp, *lenp);
+	start = now();
+	if (write(tofd, cmd, strlen(cmd)) < 0) {
+		perror("write");
+		exit(1);
+	}
+	*restp = expect(fromfd, buf, lenp, "tsh> ", &seen);
+	return (seen - start);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the job table benchmark described at the top of this file.
+ */
+static void
+bench_jobs(int argc, char **argv)
+{
+	char buf[BUFSIZ], cmd[PATH_MAX + 16], self[PATH_MAX], *rest;
+	char *shell = "./tsh", *args = NULL;
+	double *samples, seen, t_list;
+	size_t len = 0;
+	ssize_t n;
+	int c, i, tenth, tofd, fromfd, count = 10000, lookups = 10000;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "n:m:s:a:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'm':
+			lookups = atoi(optarg);
+			break;
+		case 's':
+			shell = optarg;
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		default:
+			usage("tshbench");
+		}
+	}
+	if (count < 10 || lookups < 1 || (samples = malloc((count >
+	    lookups ? count : lookups) * sizeof(*samples))) == NULL)
+		usage("tshbench");
+	if ((n = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0) {
+		perror("readlink");
+		exit(1);
+	}
+	self[n] = '\0';
+	snprintf(cmd, sizeof(cmd), "%s pause &\n", self);
+
+	pid = startshell(shell, args, &tofd, &fromfd);
+	rest = expect(fromfd, buf, &len, "tsh> ", &seen);
+	for (i = 0; i < count; i++) {
+		samples[i] = command(tofd, fromfd, buf, &len, &rest, cmd);
+		if (strstr(buf, "too many jobs") != NULL) {
+			fprintf(stderr, "tshbench: %s cannot hold %d jobs\n",
+			    shell, count);
+			exit(1);
+		}
+	}
+
+	printf("jobs: %d background jobs with %s%s%s\n", count, shell,
+	    args != NULL ? " " : "", args != NULL ? args : "");
+	tenth = count / 10;
+	report("start, first tenth", samples, tenth);
+	report("start, last tenth", samples + count - tenth, tenth);
+	printf("  %-22s %9ld kB\n", "shell VmRSS", rss(pid));
+
+	srandom(1);
+	for (i = 0; i < lookups; i++) {
+		snprintf(cmd, sizeof(cmd), "bg %%%ld\n", random() % count + 1);
+		samples[i] = command(tofd, fromfd, buf, &len, &rest, cmd);
+	}
+	report("bg %<random jid>", samples, lookups);
+
+	t_list = command(tofd, fromfd, buf, &len, &rest, "jobs\n");
+	printf("  %-22s %9.1f us\n", "jobs", t_list * 1e6);
+
+	// The jobs die with the shell.
+	close(tofd);
+	free(samples);
+}
+
+/*
+ * Requires:
+ *   "cmdline" is a NUL ('\0') terminated string with a trailing '\n'
+ *   character, of fewer than MAXLINE bytes and MAXARGS arguments.
+ *
+ * Effects:
+ *   The parseline() that tsh used before tokenize(), kept to compare
+ *   against: copies the line to a static buffer and builds "argv" from
+ *   it with strchr().  Returns true if the line is blank or requests a
+ *   background job.
+ */
+static int
+parseline(const char *cmdline, char **argv)
+{
+	static char array[MAXLINE];
+	char *buf = array, *delim;
+	int argc, bg;
+
+	strcpy(buf, cmdline);
+	buf[strlen(buf) - 1] = ' ';
+	while (*buf != '\0' && *buf == ' ')
+		buf++;
+	argc = 0;
+	if (*buf == '\'') {
+		buf++;
+		delim = strchr(buf, '\'');
+	} else
+		delim = strchr(buf, ' ');
+	while (delim != NULL) {
+		argv[argc++] = buf;
+		*delim = '\0';
+		buf = delim + 1;
+		while (*buf != '\0' && *buf == ' ')
+			buf++;
+		if (*buf == '\'') {
+			buf++;
+			delim = strchr(buf, '\'');
+		} else
+			delim = strchr(buf, ' ');
+	}
+	argv[argc] = NULL;
+	if (argc == 0)
+		return (1);
+	if ((bg = (*argv[argc - 1] == '&')) != 0)
+		argv[--argc] = NULL;
+	return (bg);
+}
+
+/*
+ * Requires:
+ *   "buf" has room for "size" bytes, and "nargs" is at least 1.
+ *
+ * Effects:
+ *   Writes a random command line of "nargs" arguments, ending in '\n', to
+ *   "buf" and returns its length, or 0 if it does not fit.  Some
+ *   arguments are quoted and contain spaces, some are separated by more
+ *   than one space, and some lines end with '&'.
+ */
+static size_t
+randomline(char *buf, size_t size, int nargs)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789./-_";
+	size_t len = 0, n;
+	int i, j;
+
+	for (i = 0; i < nargs; i++) {
+		if (len + 64 >= size)
+			return (0);
+		for (j = random() % 4 == 0 ? 2 : 1; j > 0; j--)
+			buf[len++] = ' ';
+		n = 1 + random() % 12;
+		if (random() % 10 == 0) {
+			buf[len++] = '\'';
+			for (; n > 0; n--)
+				buf[len++] = n % 4 == 0 ? ' ' :
+				    chars[random() % (sizeof(chars) - 1)];
+			buf[len++] = '\'';
+		} else {
+			for (; n > 0; n--)
+				buf[len++] = chars[random() %
+				    (sizeof(chars) - 1)];
+		}
+	}
+	if (random() % 4 == 0) {
+		buf[len++] = ' ';
+		buf[len++] = '&';
+	}
+	buf[len++] = '\n';
+	buf[len] = '\0';
+	return (len);
+}
+
+/*
+ * Requires:
+ *   "lines" holds "nlines" command lines, each terminated by a NUL, one
+ *   after the other.  If "check" is true, each line is shorter than
+ *   MAXLINE and has fewer than MAXARGS arguments.
+ *
+ * Effects:
+ *   Tokenizes every line and returns the number of arguments found.  If
+ *   "check" is true, also checks that the result agrees with parseline()
+ *   and that the line is restored afterward, and exits if not.
+ */
+static long
+tokenizeall(char *lines, int nlines, bool check)
+{
+	static struct TokenList tl;
+	char *argv[MAXARGS], *line, orig[MAXLINE];
+	long ntokens = 0;
+	size_t len;
+	int bg, i, j;
+
+	for (i = 0, line = lines; i < nlines; i++, line += len + 1) {
+		len = strlen(line);
+		if (check)
+			memcpy(orig, line, len + 1);
+		if ((bg = tokenize(line, len, &tl)) < 0) {
+			perror("tokenize");
+			exit(1);
+		}
+		ntokens += tl.argc;
+		if (check) {
+			if (bg != parseline(orig, argv))
+				goto mismatch;
+			for (j = 0; j <= tl.argc; j++)
+				if (tl.argv[j] == NULL || argv[j] == NULL ?
+				    tl.argv[j] != argv[j] :
+				    strcmp(tl.argv[j], argv[j]) != 0)
+					goto mismatch;
+		}
+		untokenize(&tl);
+		if (check && memcmp(line, orig, len + 1) != 0)
+			goto mismatch;
+	}
+	return (ntokens);
+mismatch:
+	fprintf(stderr, "tshbench: %s tokenizer disagrees with parseline() "
+	    "on line %d: %s", tokenize_isa(), i, orig);
+	exit(1);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the tokenizer benchmark described at the top of this file.
+ */
+static void
+bench_tokens(int argc, char **argv)
+{
+	static const char *isas[] = { "scalar", "sse2", "avx2" };
+	char *args[MAXARGS], *lines, *line;
+	double start, elapsed;
+	long ntokens;
+	size_t len, maxlen = 0, size;
+	bool comparable;
+	int c, i, r, nargs = 16, nlines = 100000, rounds = 5;
+
+	while ((c = getopt(argc, argv, "n:a:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			nlines = atoi(optarg);
+			break;
+		case 'a':
+			nargs = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage("tshbench");
+		}
+	}
+	if (nlines < 1 || nargs < 1 || rounds < 1)
+		usage("tshbench");
+
+	// Generate the lines, each followed by its NUL.
+	size = (size_t)nlines * (nargs * 18 + 72);
+	if ((lines = malloc(size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	srandom(1);
+	for (i = 0, line = lines; i < nlines; i++, line += len + 1) {
+		len = randomline(line, lines + size - line, nargs);
+		if (len > maxlen)
+			maxlen = len;
+	}
+	printf("tokens: %d lines of %d arguments, %.1f bytes each\n",
+	    nlines, nargs, (double)(line - lines) / nlines - 1);
+
+	// Only lines that parseline() can handle are compared with it.
+	comparable = maxlen < MAXLINE && nargs + 1 < MAXARGS;
+	if (comparable) {
+		start = now();
+		for (r = 0; r < rounds; r++) {
+			ntokens = 0;
+			for (i = 0, line = lines; i < nlines;
+			    i++, line += strlen(line) + 1) {
+				parseline(line, args);
+				for (c = 0; args[c] != NULL; c++)
+					ntokens++;
+			}
+		}
+		elapsed = now() - start;
+		printf("  %-22s %12.0f tokens/s\n", "parseline()",
+		    ntokens * rounds / elapsed);
+	} else
+		printf("  %-22s cannot handle these lines\n", "parseline()");
+
+	for (i = 0; i < (int)(sizeof(isas) / sizeof(isas[0])); i++) {
+		if (tokenize_use(isas[i]) < 0)
+			continue;
+		tokenizeall(lines, nlines, comparable);
+		start = now();
+		for (r = 0; r < rounds; r++)
+			ntokens = tokenizeall(lines, nlines, false);
+		elapsed = now() - start;
+		printf("  tokenize(), %-10s %12.0f tokens/s\n", isas[i],
+		    ntokens * rounds / elapsed);
+	}
+	free(lines);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the pipeline benchmark described at the top of this file.
+ */
+static void
+bench_pipe(int argc, char **argv)
+{
+	char buf[BUFSIZ], native[BUFSIZ], viash[BUFSIZ + 16], *rest;
+	char *shell = "./tsh", *args = NULL;
+	double *samples, seen;
+	size_t len = 0, n;
+	int c, i, tofd, fromfd, count = 200, stages = 3;
+
+	while ((c = getopt(argc, argv, "n:k:s:a:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'k':
+			stages = atoi(optarg);
+			break;
+		case 's':
+			shell = optarg;
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		default:
+			usage("tshbench");
+		}
+	}
+	if (count < 1 || stages < 1 || stages > 100 ||
+	    (samples = malloc(count * sizeof(*samples))) == NULL)
+		usage("tshbench");
+
+	// The same pipeline, run natively and by sh.
+	n = snprintf(native, sizeof(native), "/bin/echo piped");
+	for (i = 1; i < stages; i++)
+		n += snprintf(native + n, sizeof(native) - n, " | /bin/cat");
+	snprintf(viash, sizeof(viash), "/bin/sh -c '%s'\n", native);
+	snprintf(native + n, sizeof(native) - n, "\n");
+
+	startshell(shell, args, &tofd, &fromfd);
+	rest = expect(fromfd, buf, &len, "tsh> ", &seen);
+	printf("pipe: %d pipelines of %d stages with %s%s%s\n", count, stages,
+	    shell, args != NULL ? " " : "", args != NULL ? args : "");
+	for (i = 0; i < count; i++) {
+		samples[i] = command(tofd, fromfd, buf, &len, &rest, native);
+		if (strstr(buf, "piped") == NULL) {
+			fprintf(stderr, "tshbench: pipeline failed: %s", buf);
+			exit(1);
+		}
+	}
+	report("native pipeline", samples, count);
+	for (i = 0; i < count; i++) {
+		samples[i] = command(tofd, fromfd, buf, &len, &rest, viash);
+		if (strstr(buf, "piped") == NULL) {
+			fprintf(stderr, "tshbench: pipeline failed: %s", buf);
+			exit(1);
+		}
+	}
+	report("/bin/sh -c pipeline", samples, count);
+	close(tofd);
+	free(samples);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the built-in command benchmark described at the top of this
+ *   file.
+ */
+static void
+bench_builtins(int argc, char **argv)
+{
+	// Formats for the pid of the shell.
+	static const char *const cmds[] = {
+		"echo hello",
+		"printf '%%d\\n' 42",
+		"true",
+		"kill -0 %d",
+		"sleep 0",
+	};
+	char buf[BUFSIZ], cmd[BUFSIZ], what[BUFSIZ], *rest;
+	char *shell = "./tsh", *args = NULL;
+	double *samples, seen;
+	size_t len = 0;
+	pid_t pid;
+	int c, i, j, k, tofd, fromfd, count = 200;
+
+	while ((c = getopt(argc, argv, "n:s:a:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			shell = optarg;
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		default:
+			usage("tshbench");
+		}
+	}
+	if (count < 1 || (samples = malloc(count * sizeof(*samples))) == NULL)
+		usage("tshbench");
+
+	pid = startshell(shell, args, &tofd, &fromfd);
+	rest = expect(fromfd, buf, &len, "tsh> ", &seen);
+	printf("builtins: %d of each command with %s%s%s\n", count, shell,
+	    args != NULL ? " " : "", args != NULL ? args : "");
+	for (j = 0; j < (int)(sizeof(cmds) / sizeof(cmds[0])); j++) {
+		// First in the shell, then as a program.
+		for (k = 0; k < 2; k++) {
+			snprintf(what, sizeof(what), "%s", k ? "command " : "");
+			snprintf(what + strlen(what), sizeof(what) -
+			    strlen(what), cmds[j], (int)pid);
+			snprintf(cmd, sizeof(cmd), "%s\n", what);
+			for (i = 0; i < count; i++)
+				samples[i] = command(tofd, fromfd, buf, &len,
+				    &rest, cmd);
+			report(what, samples, count);
+		}
+	}
+	close(tofd);
+	free(samples);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the output cache benchmark described at the top of this file.
+ */
+static void
+bench_cache(int argc, char **argv)
+{
+	char buf[BUFSIZ], cmd[PATH_MAX + 16], dir[] = "/tmp/tshbench.XXXXXX";
+	char *shell = "./tsh", *args = NULL, *rest;
+	double *samples, seen;
+	size_t len = 0;
+	int c, i, tofd, fromfd, count = 200;
+
+	while ((c = getopt(argc, argv, "n:s:a:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			shell = optarg;
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		default:
+			usage("tshbench");
+		}
+	}
+	if (count < 1 || (samples = malloc(count * sizeof(*samples))) == NULL)
+		usage("tshbench");
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	startshell(shell, args, &tofd, &fromfd);
+	rest = expect(fromfd, buf, &len, "tsh> ", &seen);
+	printf("cache: %d of each command with %s%s%s\n", count, shell,
+	    args != NULL ? " " : "", args != NULL ? args : "");
+	snprintf(cmd, sizeof(cmd), "cache -d %s\n", dir);
+	command(tofd, fromfd, buf, &len, &rest, cmd);
+	for (i = 0; i < count; i++)
+		samples[i] = command(tofd, fromfd, buf, &len, &rest,
+		    "/bin/uname -a\n");
+	report("/bin/uname -a", samples, count);
+	for (i = 0; i < count; i++)
+		samples[i] = command(tofd, fromfd, buf, &len, &rest,
+		    "cached /bin/uname -a\n");
+	report("cached /bin/uname -a", samples, count);
+	command(tofd, fromfd, buf, &len, &rest, "cache -r\n");
+	close(tofd);
+	rmdir(dir);
+	free(samples);
+}
+
+/*
+ * Requires:
+ *   "path" is the path of a socket that a shell has been started to
+ *   serve on.
+ *
+ * Effects:
+ *   Returns a descriptor connected to the shell, retrying for up to five
+ *   seconds while the shell starts.
+ */
+static int
+connectshell(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd, i;
+
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	for (i = 0; ; i++) {
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			perror("socket");
+			exit(1);
+		}
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return (fd);
+		close(fd);
+		if (i == 5000) {
+			perror(path);
+			exit(1);
+		}
+		usleep(1000);
+	}
+}
+
+/*
+ * Requires:
+ *   "tofd" and "fromfd" are connected to a shell that has yet to print
+ *   its first prompt.
+ *
+ * Effects:
+ *   Waits for the prompt, runs /bin/true "ncmds" times, and closes both
+ *   descriptors, which ends the shell.
+ */
+static void
+runtask(int tofd, int fromfd, int ncmds)
+{
+	char buf[BUFSIZ], *rest;
+	double seen;
+	size_t len = 0;
+	int i;
+
+	rest = expect(fromfd, buf, &len, "tsh> ", &seen);
+	for (i = 0; i < ncmds; i++)
+		command(tofd, fromfd, buf, &len, &rest, "/bin/true\n");
+	close(tofd);
+	if (fromfd != tofd)
+		close(fromfd);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the shell server benchmark described at the top of this file.
+ */
+static void
+bench_serve(int argc, char **argv)
+{
+	char sock[PATH_MAX], sargs[BUFSIZ], *shell = "./tsh", *args = NULL, *copy;
+	double start, t_spawn, t_serve;
+	pid_t pid, server;
+	int c, i, fd, tofd, fromfd, count = 200, ncmds = 10;
+
+	while ((c = getopt(argc, argv, "n:k:s:a:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'k':
+			ncmds = atoi(optarg);
+			break;
+		case 's':
+			shell = optarg;
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		default:
+			usage("tshbench");
+		}
+	}
+	if (count < 1 || ncmds < 0)
+		usage("tshbench");
+	printf("serve: %d tasks of %d commands with %s%s%s\n", count, ncmds,
+	    shell, args != NULL ? " " : "", args != NULL ? args : "");
+
+	// A shell for each task, which startshell() splits "args" for.
+	start = now();
+	for (i = 0; i < count; i++) {
+		if (args != NULL && (copy = strdup(args)) == NULL) {
+			perror("strdup");
+			exit(1);
+		}
+		pid = startshell(shell, args != NULL ? copy : NULL, &tofd,
+		    &fromfd);
+		runtask(tofd, fromfd, ncmds);
+		waitpid(pid, NULL, 0);
+		if (args != NULL)
+			free(copy);
+	}
+	t_spawn = now() - start;
+
+	// One shell, started before the clock, for every task.
+	snprintf(sock, sizeof(sock), "/tmp/tshbench.%d.sock", (int)getpid());
+	snprintf(sargs, sizeof(sargs), "%s%s--serve %s",
+	    args != NULL ? args : "", args != NULL ? " " : "", sock);
+	server = startshell(shell, sargs, &tofd, &fromfd);
+	close(connectshell(sock));
+	start = now();
+	for (i = 0; i < count; i++) {
+		fd = connectshell(sock);
+		runtask(fd, fd, ncmds);
+	}
+	t_serve = now() - start;
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	close(tofd);
+	close(fromfd);
+
+	printf("  %-22s %9.0f tasks/s %9.0f commands/s\n", "shell per task",
+	    count / t_spawn, count * ncmds / t_spawn);
+	printf("  %-22s %9.0f tasks/s %9.0f commands/s\n", "--serve session",
+	    count / t_serve, count * ncmds / t_serve);
+}
+
+/*
+ * Requires:
+ *   "tofd" and "fromfd" are connected to a shell that has printed its
+ *   prompt, everything in "buf" up to "*restp" has been consumed, and
+ *   "self" is the path of this program.
+ *
+ * Effects:
+ *   Has the shell run "tshbench sigwait" in the foreground, sends the
+ *   shell a SIGINT once it is waiting, and reads until the next prompt.
+ *   Returns the time from sending the signal until the job received it.
+ */
+static double
+forward(pid_t shell, int tofd, int fromfd, char *buf, size_t *lenp,
+    char **restp, const char *self)
+{
+	char cmd[PATH_MAX + 16], *mark;
+	double sent, seen;
+
+	*lenp -= *restp - buf;
+	memmove(buf, *restp, *lenp);
+	snprintf(cmd, sizeof(cmd), "%s sigwait\n", self);
+	if (write(tofd, cmd, strlen(cmd)) < 0) {
+		perror("write");
+		exit(1);
+	}
+	expect(fromfd, buf, lenp, "READY\n", &seen);
+	sent = now();
+	kill(shell, SIGINT);
+	*restp = expect(fromfd, buf, lenp, "tsh> ", &seen);
+	if ((mark = strstr(buf, "SIGNALED ")) == NULL || mark > *restp) {
+		fprintf(stderr, "tshbench: signal was not forwarded: %s", buf);
+		exit(1);
+	}
+	return (strtod(mark + strlen("SIGNALED "), NULL) - sent);
+}
+
+/*
+ * Requires:
+ *   "tofd" and "fromfd" are connected to a shell that has printed its
+ *   prompt, and everything in "buf" up to "*restp" has been consumed.
+ *
+ * Effects:
+ *   Has the shell run ./mymsstop, which stops itself, and then continue
+ *   it with "fg".  Returns the time that both commands took.
+ */
+static double
+stopandfg(int tofd, int fromfd, char *buf, size_t *lenp, char **restp)
+{
+	char cmd[32], *job;
+	double elapsed;
+	int jid;
+
+	elapsed = command(tofd, fromfd, buf, lenp, restp, "./mymsstop 1\n");
+	if ((job = strstr(buf, "Job [")) == NULL || job > *restp ||
+	    sscanf(job, "Job [%d]", &jid) != 1) {
+		fprintf(stderr, "tshbench: job did not stop: %s", buf);
+		exit(1);
+	}
+	snprintf(cmd, sizeof(cmd), "fg %%%d\n", jid);
+	return (elapsed + command(tofd, fromfd, buf, lenp, restp, cmd));
+}
+
+/*
+ * Requires:
+ *   "samples" has room for "count" > 0 latencies and "self" is the path
+ *   of this program.
+ *
+ * Effects:
+ *   Runs the workloads of the comparison benchmark on one shell and
+ *   prints the results.
+ */
+static void
+compare(const char *shell, char *args, int count, double *samples,
+    const char *self)
+{
+	char buf[BUFSIZ], cmd[PATH_MAX + 16], *stamp, *rest;
+	double start, seen, ran, *reaps;
+	size_t len = 0;
+	pid_t pid;
+	int i, tofd, fromfd;
+
+	printf("compare: %s%s%s\n", shell, args != NULL ? " " : "",
+	    args != NULL ? args : "");
+	pid = startshell(shell, args, &tofd, &fromfd);
+	rest = expect(fromfd, buf, &len, "tsh> ", &seen);
+
+	start = now();
+	for (i = 0; i < count; i++)
+		command(tofd, fromfd, buf, &len, &rest, "./mytrue\n");
+	printf("  %-22s %9.0f commands/s\n", "./mytrue",
+	    count / (now() - start));
+
+	if ((reaps = malloc(count * sizeof(*reaps))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	snprintf(cmd, sizeof(cmd), "%s stamp\n", self);
+	for (i = 0; i < count; i++) {
+		start = now();
+		seen = start + command(tofd, fromfd, buf, &len, &rest, cmd);
+		if ((stamp = strstr(buf, "STAMP ")) == NULL || stamp > rest) {
+			fprintf(stderr, "tshbench: command failed: %s", buf);
+			exit(1);
+		}
+		ran = strtod(stamp + strlen("STAMP "), NULL);
+		samples[i] = ran - start;
+		reaps[i] = seen - ran;
+	}
+	report("write -> command runs", samples, count);
+	report("command exit -> prompt", reaps, count);
+	free(reaps);
+
+	for (i = 0; i < count; i++)
+		samples[i] = forward(pid, tofd, fromfd, buf, &len, &rest, self);
+	report("SIGINT -> job", samples, count);
+
+	for (i = 0; i < count; i++)
+		samples[i] = command(tofd, fromfd, buf, &len, &rest,
+		    "./myfanout 2 4\n");
+	report("./myfanout 2 4", samples, count);
+	for (i = 0; i < count; i++)
+		samples[i] = command(tofd, fromfd, buf, &len, &rest,
+		    "./mymsint 1\n");
+	report("./mymsint 1", samples, count);
+	for (i = 0; i < count; i++)
+		samples[i] = stopandfg(tofd, fromfd, buf, &len, &rest);
+	report("./mymsstop 1; fg", samples, count);
+	close(tofd);
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the comparison benchmark described at the top of this file.
+ */
+static void
+bench_compare(int argc, char **argv)
+{
+	char self[PATH_MAX], *shell = "./tsh", *refshell = "./tshref";
+	char *args = NULL, *refargs = NULL;
+	double *samples;
+	ssize_t n;
+	int c, count = 200;
+
+	while ((c = getopt(argc, argv, "n:s:r:a:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			shell = optarg;
+			break;
+		case 'r':
+			refshell = optarg;
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		default:
+			usage("tshbench");
+		}
+	}
+	if (count < 1 || (samples = malloc(count * sizeof(*samples))) ==
+	    NULL)
+		usage("tshbench");
+	if ((n = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0) {
+		perror("readlink");
+		exit(1);
+	}
+	self[n] = '\0';
+	// startshell() splits the arguments in place.
+	if (args != NULL && (refargs = strdup(args)) == NULL) {
+		perror("strdup");
+		exit(1);
+	}
+
+	compare(shell, args, count, samples, self);
+	compare(refshell, refargs, count, samples, self);
+	free(refargs);
+	free(samples);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Prints the current time, for the prompt benchmark, and exits.
+ */
+static void
+stamp(void)
+{
+
+	printf("STAMP %.9f\n", now());
+	exit(0);
+}
+
+/*
+ * Requires:
+ *   "path" is the path of a socket that a shell has been started to
+ *   serve on.
+ *
+ * Effects:
+ *   Sends stdin, for the tests, to a session of the shell, and copies
+ *   what the session writes to stdout until it ends, then exits.
+ */
+static void
+client(const char *path)
+{
+	char buf[BUFSIZ];
+	ssize_t n;
+	int fd;
+
+	fd = connectshell(path);
+	while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+		if (write(fd, buf, n) < 0) {
+			perror("write");
+			exit(1);
+		}
+	shutdown(fd, SHUT_WR);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		if (write(STDOUT_FILENO, buf, n) < 0)
+			exit(1);
+	exit(0);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Waits, as a job for the jobs benchmark, until it is killed or its
+ *   parent, the shell, exits.
+ */
+static void
+waitforshell(void)
+{
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() == 1)
+		exit(0);
+	while (true)
+		pause();
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Handles SIGINT for waitforsignal() by printing the time and exiting.
+ */
+static void
+signaled(int sig)
+{
+	char line[64];
+	int len;
+
+	(void)sig;
+	len = snprintf(line, sizeof(line), "SIGNALED %.9f\n", now());
+	if (write(STDOUT_FILENO, line, len) < 0)
+		_exit(1);
+	_exit(0);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Prints "READY" and waits, as a job for the comparison benchmark,
+ *   until it receives a SIGINT, then prints the time at which it did.
+ */
+static void
+waitforsignal(void)
+{
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	signal(SIGINT, signaled);
+	printf("READY\n");
+	fflush(stdout);
+	while (true)
+		pause();
+}
+
+int
+main(int argc, char **argv)
+{
+
+	if (argc < 2)
+		usage(argv[0]);
+	if (!strcmp(argv[1], "spawn"))
+		bench_spawn(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "prompt"))
+		bench_prompt(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "jobs"))
+		bench_jobs(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "tokens"))
+		bench_tokens(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "pipe"))
+		bench_pipe(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "compare"))
+		bench_compare(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "builtins"))
+		bench_builtins(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "cache"))
+		bench_cache(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "serve"))
+		bench_serve(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "stamp"))
+		stamp();
+	else if (!strcmp(argv[1], "pause"))
+		waitforshell();
+	else if (!strcmp(argv[1], "sigwait"))
+		waitforsignal();
+	else if (!strcmp(argv[1], "client") && argc == 3)
+		client(argv[2]);
+	else
+		usage(argv[0]);
+	return (0);
+}
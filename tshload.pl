@@ -0,0 +1,414 @@
+#!/usr/bin/perl
+use Getopt::Std;
+use IO::Handle;
+use IO::Select;
+use IPC::Open2;
+use Time::HiRes qw(time sleep);
+
+#######################################################################
+# tshload.pl - Generate and replay long mixed workloads for the shell
+#
+# With -g, the script writes a trace in the format that sdriver.pl
+# reads: a random mix of foreground and background jobs of random
+# length, jobs that interrupt or stop themselves, foreground jobs that
+# the driver sends TSTP or INT, and the jobs, bg and fg builtins.  The
+# jobs are the millisecond workloads (mymspin, mymsint and mymsstop).
+# sdriver.pl sends signals without waiting for the commands before them
+# to start, so such traces are meant to be replayed with -t.
+#
+# With -t, the script replays such a trace, over and over, against the
+# shell for the given number of seconds.  It writes one command at a
+# time at the given arrival rate and waits for the shell's next prompt
+# before writing the next, so the shell must not be given -p.  It
+# resumes jobs as soon as they are reported stopped, so that they do
+# not fill the job table, lists the jobs after every background launch,
+# when the table is at its fullest, and every interval lists them and
+# samples the shell's resident set size (VmRSS in /proc/<pid>/status).
+# At the end it lets the remaining jobs finish and reports:
+#
+#   - throughput, the commands completed per second;
+#   - the latency of foreground, background and builtin commands, from
+#     writing them until the next prompt;
+#   - the high-water mark of the job table, from every listing of the
+#     jobs;
+#   - lost notifications, for jobs that stopped or interrupted
+#     themselves but were never reported, and duplicated ones, for jobs
+#     that were reported stopped or terminated more than once;
+#   - the growth of the shell's resident set.
+#
+# The replay fails if any notification was lost or duplicated, or if
+# background jobs were launched but none was ever listed.
+#
+######################################################################
+
+#
+# usage - print help message and terminate
+#
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] -g <trace> [-n <lines>] [-m <mix>] [-d <ms>] [-e <seed>]\n";
+    printf STDERR "       $0 [-h] -t <trace> -s <shellprog> [-a <args>] [-T <seconds>]\n";
+    printf STDERR "                 [-r <rate>] [-i <seconds>]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h            Print this message\n";
+    printf STDERR "  -g <trace>    Trace file to generate\n";
+    printf STDERR "  -n <lines>    Number of commands to generate (default 10000)\n";
+    printf STDERR "  -m <mix>      Weights of the kinds of commands (default\n";
+    printf STDERR "                $default_mix)\n";
+    printf STDERR "  -d <ms>       Mean length of a job in milliseconds (default 20)\n";
+    printf STDERR "  -e <seed>     Random seed (default 1)\n";
+    printf STDERR "  -t <trace>    Trace file to replay\n";
+    printf STDERR "  -s <shell>    Shell program to test\n";
+    printf STDERR "  -a <args>     Shell arguments\n";
+    printf STDERR "  -T <seconds>  Length of the replay (default 60)\n";
+    printf STDERR "  -r <rate>     Commands written per second, or 0 for no limit\n";
+    printf STDERR "                (default 100)\n";
+    printf STDERR "  -i <seconds>  Interval between samples (default 10)\n";
+    die "\n" ;
+}
+
+#
+# duration - return a random job length in milliseconds, exponentially
+#     distributed with mean $_[0] and at most ten times that
+#
+sub duration
+{
+    my $mean = $_[0];
+    my $ms = int(-$mean * log(1 - rand()));
+
+    $ms = 10 * $mean if ($ms > 10 * $mean);
+    return $ms < 1 ? 1 : $ms;
+}
+
+#
+# generate - write a trace of $_[1] commands, mixed as $_[2], to $_[0]
+#
+sub generate
+{
+    my ($file, $lines, $mix, $mean, $seed) = @_;
+    my (%weight, $total, $kind, $pick, $d, $k);
+
+    foreach (split(/,/, $mix)) {
+        /^(fg|bg|int|stop|tstp|intr|jobs|resume)=(\d+)$/
+            or usage("Bad mix entry $_");
+        $weight{$1} = $2;
+        $total += $2;
+    }
+    $total > 0
+        or usage("The mix is empty");
+    srand($seed);
+    open(TRACE, ">", $file)
+        or die "$0: ERROR: Couldn't create $file: $!\n";
+    print TRACE "#\n# $file - $lines commands mixed as $mix, ".
+        "jobs of ${mean}ms on average\n#\n";
+    for ($i = 0; $i < $lines; $i++) {
+        $pick = rand($total);
+        foreach $k (sort(keys(%weight))) {
+            $kind = $k;
+            last if (($pick -= $weight{$k}) < 0);
+        }
+        $d = duration($mean);
+        if ($kind eq "fg") {
+            print TRACE "./mymspin $d\n";
+        } elsif ($kind eq "bg") {
+            print TRACE "./mymspin $d &\n";
+        } elsif ($kind eq "int") {
+            print TRACE "./mymsint $d", rand() < 0.5 ? " &" : "", "\n";
+        } elsif ($kind eq "stop") {
+            print TRACE "./mymsstop $d", rand() < 0.5 ? " &" : "", "\n";
+        } elsif ($kind eq "tstp" || $kind eq "intr") {
+            # Long enough for the signal to find the job running.
+            printf TRACE "./mymspin %d\n%s\n", 4 * $mean + 20,
+                $kind eq "tstp" ? "TSTP" : "INT";
+        } elsif ($kind eq "jobs") {
+            print TRACE "jobs\n";
+        } else {
+            printf TRACE "%s %%%d\n", rand() < 0.5 ? "bg" : "fg",
+                1 + int(rand(4));
+        }
+    }
+    close(TRACE);
+    printf("Wrote %d commands to %s\n", $lines, $file);
+}
+
+#
+# rss - return the resident set size of process $_[0] in kB
+#
+sub rss
+{
+    my $pid = $_[0];
+    open(STATUS, "/proc/$pid/status")
+        or die "$0: ERROR: Couldn't read /proc/$pid/status\n";
+    while (<STATUS>) {
+        if (/^VmRSS:\s+(\d+)/) {
+            close(STATUS);
+            return $1;
+        }
+    }
+    close(STATUS);
+    die "$0: ERROR: No VmRSS for process $pid\n";
+}
+
+#
+# kind - return the kind of command line $_[0]
+#
+sub kind
+{
+    my $line = $_[0];
+
+    return "builtin" if ($line =~ /^\s*(jobs|bg|fg)\b/);
+    return ($line =~ /&\s*$/ ? "bg" : "fg") .
+        ($line =~ /mymsint/ ? "int" : $line =~ /mymsstop/ ? "stop" : "");
+}
+
+#
+# parse - account for one line $_[0] of the shell's output to the
+#     command in %cur
+#
+sub parse
+{
+    my $line = $_[0];
+
+    if ($line =~ /^Job \[(\d+)\] \((\d+)\) (stopped|terminated) by signal/) {
+        $seen{"$2 $3"}++;
+        $notifications++;
+        $resume{$1} = 1 if ($3 eq "stopped");
+        # A foreground job is reported before the next prompt.
+        if ($cur{kind} eq "fgint" && $3 eq "terminated" ||
+            $cur{kind} eq "fgstop" && $3 eq "stopped") {
+            $expect{$2} = $3;
+            $cur{reported} = 1;
+        }
+    } elsif ($line =~ /^\[(\d+)\] \((\d+)\) (Running|Stopped) /) {
+        $cur{listed}++;
+        $resume{$1} = 1 if ($3 eq "Stopped");
+    } elsif ($line =~ /^\[(\d+)\] \((\d+)\) /) {
+        $cur{launched} = 1;
+        $launched++;
+        $expect{$2} = "terminated" if ($cur{kind} eq "bgint");
+        $expect{$2} = "stopped" if ($cur{kind} eq "bgstop");
+    }
+}
+
+#
+# pump - read whatever the shell has written within $_[0] seconds and
+#     parse it
+#
+sub pump
+{
+    my $timeout = $_[0];
+    my $data;
+
+    if ($select->can_read($timeout)) {
+        sysread(Reader, $data, 65536) > 0
+            or die "$0: ERROR: $shellprog exited\n";
+        $buf .= $data;
+    }
+    while (1) {
+        # A prompt may follow a line that was cut short.
+        if ($buf =~ s/^([^\n]*?)tsh> //) {
+            parse($1) if ($1 ne "");
+            $prompts++;
+        } elsif ($buf =~ s/^([^\n]*)\n//) {
+            parse($1);
+        } else {
+            last;
+        }
+    }
+}
+
+#
+# run - write command line $_[0] to the shell, sending any signals in
+#     @{$_[1]} while it runs, and return the time until the next prompt
+#
+sub run
+{
+    my ($line, $signals) = @_;
+    my ($start, $want) = (time(), $prompts + 1);
+
+    %cur = (kind => kind($line), reported => 0, listed => 0, launched => 0);
+    print Writer "$line\n";
+    foreach (@$signals) {
+        sleep(0.005);
+        kill $_, $pid;
+    }
+    while ($prompts < $want) {
+        pump(10);
+        time() - $start < 60
+            or die "$0: ERROR: No prompt after \"$line\"\n";
+    }
+    $highwater = $cur{listed} if ($cur{listed} > $highwater);
+    if ($cur{kind} =~ /^fg(int|stop)$/ && !$cur{reported}) {
+        printf("Lost notification for \"%s\"\n", $line);
+        $lost++;
+    }
+    return time() - $start;
+}
+
+#
+# housekeep - resume stopped jobs, or with $_[0], also list the jobs
+#     and return how many there are
+#
+sub housekeep
+{
+    my $list = $_[0];
+
+    foreach (sort { $a <=> $b } keys(%resume)) {
+        run("bg %$_", []);
+    }
+    %resume = ();
+    return 0 if (!$list);
+    run("jobs", []);
+    return $cur{listed};
+}
+
+#
+# percentile - return the $_[1]th percentile of the sorted list @{$_[0]}
+#
+sub percentile
+{
+    my ($list, $p) = @_;
+    return $list->[int($#$list * $p / 100 + 0.5)];
+}
+
+#
+# replay - replay trace $_[0] against the shell and report the results
+#
+sub replay
+{
+    my ($file, $seconds, $rate, $interval) = @_;
+    my (@lines, $signals, %latency, @samples, $i, $start, $next, $line);
+    my ($jobs, $commands, $elapsed, $growth, $dups, $kind, @l, $wait);
+
+    open(TRACE, $file)
+        or die "$0: ERROR: Couldn't open input file $file: $!\n";
+    while (<TRACE>) {
+        chomp;
+        next if (/^#/ || /^\s*$/);
+        if (/^(TSTP|INT)$/ && @lines) {
+            push(@{$lines[-1][1]}, $1);
+        } elsif (/^SLEEP (\d+)/) {
+            push(@lines, [$_, []]);
+        } elsif (/^(QUIT|KILL|CLOSE|WAIT)$/) {
+            printf("Ignoring %s\n", $_);
+        } else {
+            push(@lines, [$_, []]);
+        }
+    }
+    close(TRACE);
+    @lines
+        or die "$0: ERROR: $file has no commands\n";
+
+    $pid = open2(\*Reader, \*Writer, "$shellprog $shellargs");
+    Writer->autoflush();
+    $select = IO::Select->new(\*Reader);
+    pump(10) while ($prompts < 1);
+    $prompts = 0;
+
+    $start = time();
+    $next = $start + $interval;
+    push(@samples, rss($pid));
+    for ($i = 0; time() - $start < $seconds; $i++) {
+        if ($rate > 0) {
+            $wait = $start + $commands / $rate - time();
+            sleep($wait) if ($wait > 0);
+        }
+        ($line, $signals) = @{$lines[$i % @lines]};
+        if ($line =~ /^SLEEP (\d+)/) {
+            sleep($1);
+            next;
+        }
+        $kind = kind($line);
+        $kind =~ s/(int|stop)$//;
+        push(@{$latency{$kind}}, run($line, $signals));
+        $commands++;
+        # The job table is at its fullest just after a launch.
+        run("jobs", []) if ($cur{launched});
+        if (time() < $next) {
+            housekeep(0);
+            next;
+        }
+        $jobs = housekeep(1);
+        push(@samples, rss($pid));
+        printf("%6ds: %8d commands, %7.1f/s, %3d jobs, VmRSS %6d kB\n",
+            time() - $start, $commands, $commands / (time() - $start),
+            $jobs, $samples[-1]);
+        $next += $interval;
+    }
+    $elapsed = time() - $start;
+
+    # Let the remaining jobs run to completion.
+    for ($i = 0; $i < 200; $i++) {
+        last if (housekeep(1) == 0);
+        sleep(0.05);
+    }
+    push(@samples, rss($pid));
+    close(Writer);
+    while (sysread(Reader, $buf, 65536) > 0) {
+    }
+    close(Reader);
+    waitpid($pid, 0);
+
+    foreach (keys(%expect)) {
+        next if ($seen{"$_ $expect{$_}"});
+        printf("Lost notification for process %d\n", $_);
+        $lost++;
+    }
+    foreach (keys(%seen)) {
+        next if ($seen{$_} < 2);
+        printf("Duplicated notification for process %s\n", $_);
+        $dups += $seen{$_} - 1;
+    }
+    $growth = $samples[-1] - $samples[0];
+
+    printf("\n%d commands in %.1fs: %.1f commands/s\n", $commands, $elapsed,
+        $commands / $elapsed);
+    foreach $kind ("fg", "bg", "builtin") {
+        next if (!$latency{$kind});
+        @l = sort { $a <=> $b } @{$latency{$kind}};
+        printf("  %-8s %7d  p50 %8.2f ms  p99 %8.2f ms  p99.9 %8.2f ms  ".
+            "max %8.2f ms\n", $kind, scalar(@l), 1000 * percentile(\@l, 50),
+            1000 * percentile(\@l, 99), 1000 * percentile(\@l, 99.9),
+            1000 * $l[-1]);
+    }
+    printf("Job table high-water mark: %d\n", $highwater);
+    printf("Notifications: %d, %d lost, %d duplicated\n", $notifications,
+        $lost, $dups);
+    printf("VmRSS: %d kB at the start, %d kB at the end, grew by %d kB\n",
+        $samples[0], $samples[-1], $growth);
+    if ($lost || $dups) {
+        die "$0: FAIL: notifications were lost or duplicated\n";
+    }
+    if ($launched && !$highwater) {
+        die "$0: FAIL: $launched jobs were launched but none was listed\n";
+    }
+    printf("PASS\n");
+}
+
+# Parse the command line arguments
+$default_mix = "fg=40,bg=20,int=5,stop=5,tstp=5,intr=5,jobs=10,resume=10";
+getopts('hg:n:m:d:e:t:s:a:T:r:i:');
+if ($opt_h) {
+    usage();
+}
+$SIG{PIPE} = 'IGNORE';
+if ($opt_g) {
+    generate($opt_g, $opt_n ? $opt_n : 10000,
+        $opt_m ? $opt_m : $default_mix, $opt_d ? $opt_d : 20,
+        defined($opt_e) ? $opt_e : 1);
+    exit;
+}
+if (!$opt_t) {
+    usage("Missing required -g or -t argument");
+}
+if (!$opt_s) {
+    usage("Missing required -s argument");
+}
+$shellprog = $opt_s;
+$shellargs = $opt_a;
+(-e $shellprog)
+    or  die "$0: ERROR: $shellprog not found\n";
+replay($opt_t, $opt_T ? $opt_T : 60, defined($opt_r) ? $opt_r : 100,
+    $opt_i ? $opt_i : 10);
+exit;